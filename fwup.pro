@@ -37,6 +37,8 @@ SOURCES += \
     src/mmc_linux.c \
     src/requirement.c \
     src/cfgprint.c \
+    src/chunks.c \
+    src/chunk_store.c \
     src/simple_string.c \
     src/archive_open.c \
     src/mmc_windows.c \
@@ -48,6 +50,11 @@ SOURCES += \
     src/mmc_bsd.c \
     src/resources.c \
     src/block_cache.c \
+    src/bmap.c \
+    src/sha256.c \
+    src/readback.c \
+    src/io_plan.c \
+    src/zip_splice.c \
     src/pad_to_block_writer.c \
     3rdparty/fatfs/source/ff.c \
     3rdparty/fatfs/source/ffunicode.c \
@@ -96,6 +103,8 @@ HEADERS += \
     src/fwup_verify.h \
     src/requirement.h \
     src/cfgprint.h \
+    src/chunks.h \
+    src/chunk_store.h \
     src/simple_string.h \
     src/archive_open.h \
     src/uboot_env.h \
@@ -105,6 +114,11 @@ HEADERS += \
     src/progress.h \
     src/resources.h \
     src/block_cache.h \
+    src/bmap.h \
+    src/sha256.h \
+    src/readback.h \
+    src/io_plan.h \
+    src/zip_splice.h \
     src/fatfs.h \
     src/pad_to_block_writer.h \
     3rdparty/fatfs/source/diskio.h \
@@ -29,6 +29,11 @@
 
 #define DEFAULT_LIBARCHIVE_BLOCK_SIZE 16384
 
+// Files are read in bigger pieces. libarchive hands the inflater whatever
+// was read, so this also makes each decompressed block bigger and reduces
+// how often libarchive has to copy data that straddles two reads.
+#define FILE_LIBARCHIVE_BLOCK_SIZE (256 * 1024)
+
 struct fwup_archive_data {
     size_t current_frame_remaining;
     bool is_stdin;
@@ -37,7 +42,8 @@ struct fwup_archive_data {
     struct fwup_progress *progress;
 
     char name[PATH_MAX];
-    char buffer[DEFAULT_LIBARCHIVE_BLOCK_SIZE];
+    size_t buffer_size;
+    char buffer[];
 };
 
 static ssize_t normal_read(struct archive *a, void *client_data, const void **buff)
@@ -46,7 +52,7 @@ static ssize_t normal_read(struct archive *a, void *client_data, const void **bu
 
     *buff = ad->buffer;
     for (;;) {
-        ssize_t bytes_read = read(ad->fd, ad->buffer, sizeof(ad->buffer));
+        ssize_t bytes_read = read(ad->fd, ad->buffer, ad->buffer_size);
         if (bytes_read < 0) {
             if (errno == EINTR)
                 continue;
@@ -66,6 +72,21 @@ static ssize_t normal_read(struct archive *a, void *client_data, const void **bu
     }
 }
 
+static int64_t normal_skip(struct archive *a, void *client_data, int64_t request)
+{
+    struct fwup_archive_data *ad = (struct fwup_archive_data *) client_data;
+    (void)a; /* UNUSED */
+
+    // Returning 0 makes libarchive read through the data instead.
+    if (lseek(ad->fd, request, SEEK_CUR) < 0)
+        return 0;
+
+    if (ad->progress)
+        ad->progress->input_bytes += request;
+
+    return request;
+}
+
 static int normal_close(struct archive *a, void *client_data)
 {
     struct fwup_archive_data *ad = (struct fwup_archive_data *) client_data;
@@ -116,8 +137,8 @@ static ssize_t framed_stdin_read(struct archive *a, void *client_data, const voi
     }
 
     size_t amount_to_read = ad->current_frame_remaining;
-    if (amount_to_read > sizeof(ad->buffer))
-        amount_to_read = sizeof(ad->buffer);
+    if (amount_to_read > ad->buffer_size)
+        amount_to_read = ad->buffer_size;
 
     amount_read = fread(ad->buffer, 1, amount_to_read, stdin);
     if (amount_read == 0) {
@@ -144,7 +165,9 @@ static ssize_t framed_stdin_read(struct archive *a, void *client_data, const voi
  */
 int fwup_archive_open_filename(struct archive *a, const char *filename, struct fwup_progress *progress)
 {
-    struct fwup_archive_data *ad = (struct fwup_archive_data *) calloc(1, sizeof(struct fwup_archive_data));
+    bool is_stdin = (filename == NULL || filename[0] == '\0');
+    size_t buffer_size = is_stdin ? DEFAULT_LIBARCHIVE_BLOCK_SIZE : FILE_LIBARCHIVE_BLOCK_SIZE;
+    struct fwup_archive_data *ad = (struct fwup_archive_data *) calloc(1, sizeof(struct fwup_archive_data) + buffer_size);
     if (ad == NULL) {
         archive_set_error(a, ENOMEM, "No memory");
         return ARCHIVE_FATAL;
@@ -152,7 +175,8 @@ int fwup_archive_open_filename(struct archive *a, const char *filename, struct f
 
     ad->current_frame_remaining = 0;
     ad->is_eof = false;
-    ad->is_stdin = (filename == NULL || filename[0] == '\0');
+    ad->is_stdin = is_stdin;
+    ad->buffer_size = buffer_size;
     if (!ad->is_stdin)
         strncpy(ad->name, filename, sizeof(ad->name) - 1);
     ad->progress = progress;
@@ -171,6 +195,10 @@ int fwup_archive_open_filename(struct archive *a, const char *filename, struct f
         }
 #ifdef HAVE_FCNTL
         (void) fcntl(ad->fd, F_SETFD, FD_CLOEXEC);
+#endif
+#ifdef POSIX_FADV_SEQUENTIAL
+        // The archive is read front to back, so ask for more read-ahead.
+        (void) posix_fadvise(ad->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 #endif
     }
 
@@ -184,6 +212,11 @@ int fwup_archive_open_filename(struct archive *a, const char *filename, struct f
     } else {
         // Files and stdin w/o framing are handled similarly.
         archive_read_set_read_callback(a, normal_read);
+
+        // Skipping lets resources that were copied some other way or that
+        // aren't used by the task be passed over without reading them.
+        if (!ad->is_stdin)
+            archive_read_set_skip_callback(a, normal_skip);
     }
 
     return archive_read_open1(a);
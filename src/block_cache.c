@@ -14,15 +14,28 @@
  * limitations under the License.
  */
 
+#include "config.h"
+
+#if HAVE_PUNCH_HOLE || HAVE_ZERO_RANGE || HAVE_COPY_FILE_RANGE || HAVE_SPLICE
+#define _GNU_SOURCE // for fallocate(), copy_file_range() and splice()
+#endif
+
 #include "block_cache.h"
 #include "mmc.h"
+#include "monocypher.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#ifdef _WIN32
+#include <io.h>
+#endif
+
 static size_t min(size_t a, size_t b)
 {
     if (a <= b)
@@ -31,54 +44,198 @@ static size_t min(size_t a, size_t b)
         return b;
 }
 
-// Trim handling functions
-static void enlarge_trim_bitvector(struct block_cache *bc, size_t ix)
+// Range set handling functions
+static void range_set_init(struct block_cache_range_set *set)
 {
-    // Round up the new length in 4K (aka 4GB chunks)
-    size_t oldlength = bc->trimmed_len;
-    size_t newlength = (ix + 4095) & ~4095;
-    bc->trimmed = realloc(bc->trimmed, newlength);
-    if (bc->trimmed == NULL)
-        fwup_err(EXIT_FAILURE, "realloc");
-    memset(bc->trimmed + oldlength,
-           bc->trimmed_remainder ? 0xff : 00,
-           newlength - oldlength);
-    bc->trimmed_len = newlength;
+    set->ranges = NULL;
+    set->count = 0;
+    set->capacity = 0;
+}
+
+static void range_set_free(struct block_cache_range_set *set)
+{
+    free(set->ranges);
+    range_set_init(set);
+}
+
+// Return the index of the first range that ends after offset.
+static size_t range_set_lower_bound(const struct block_cache_range_set *set, off_t offset)
+{
+    size_t lo = 0;
+    size_t hi = set->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (set->ranges[mid].end <= offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Return the index of the first range that starts at or after offset.
+static size_t range_set_upper_bound(const struct block_cache_range_set *set, off_t offset)
+{
+    size_t lo = 0;
+    size_t hi = set->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (set->ranges[mid].start < offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Replace the ranges from [first, last) with the new_count ranges in new_ranges
+static void range_set_replace(struct block_cache_range_set *set,
+                              size_t first,
+                              size_t last,
+                              const struct block_cache_range *new_ranges,
+                              size_t new_count)
+{
+    size_t count = set->count - (last - first) + new_count;
+    if (count > set->capacity) {
+        size_t capacity = set->capacity ? set->capacity * 2 : 16;
+        while (capacity < count)
+            capacity *= 2;
+
+        set->ranges = (struct block_cache_range *) realloc(set->ranges, capacity * sizeof(struct block_cache_range));
+        if (set->ranges == NULL)
+            fwup_err(EXIT_FAILURE, "realloc");
+        set->capacity = capacity;
+    }
+
+    memmove(&set->ranges[first + new_count],
+            &set->ranges[last],
+            (set->count - last) * sizeof(struct block_cache_range));
+    memcpy(&set->ranges[first], new_ranges, new_count * sizeof(struct block_cache_range));
+    set->count = count;
 }
 
-static bool is_trimmed(struct block_cache *bc, off_t offset)
+static void range_set_add(struct block_cache_range_set *set, off_t start, off_t end)
 {
-    size_t segment_ix = offset / BLOCK_CACHE_SEGMENT_SIZE;
-    size_t bit_ix = segment_ix / 8;
+    if (start >= end)
+        return;
+
+    // Include ranges that touch the new one so that they get coalesced.
+    size_t first = range_set_lower_bound(set, start - 1);
+    size_t last = range_set_upper_bound(set, end < BLOCK_CACHE_MAX_OFFSET ? end + 1 : end);
+
+    struct block_cache_range merged = {start, end};
+    if (first < last) {
+        if (set->ranges[first].start < merged.start)
+            merged.start = set->ranges[first].start;
+        if (set->ranges[last - 1].end > merged.end)
+            merged.end = set->ranges[last - 1].end;
+    }
+    range_set_replace(set, first, last, &merged, 1);
+}
 
-    if (bit_ix >= bc->trimmed_len)
-        return bc->trimmed_remainder;
+static void range_set_remove(struct block_cache_range_set *set, off_t start, off_t end)
+{
+    if (start >= end)
+        return;
+
+    size_t first = range_set_lower_bound(set, start);
+    size_t last = range_set_upper_bound(set, end);
+    if (first >= last)
+        return;
+
+    // Keep the parts of the first and last ranges that stick out.
+    struct block_cache_range leftovers[2];
+    size_t leftover_count = 0;
+    if (set->ranges[first].start < start) {
+        leftovers[leftover_count].start = set->ranges[first].start;
+        leftovers[leftover_count].end = start;
+        leftover_count++;
+    }
+    if (set->ranges[last - 1].end > end) {
+        leftovers[leftover_count].start = end;
+        leftovers[leftover_count].end = set->ranges[last - 1].end;
+        leftover_count++;
+    }
+    range_set_replace(set, first, last, leftovers, leftover_count);
+}
 
-    int bit = segment_ix & 7;
-    return (bc->trimmed[bit_ix] & (1 << bit)) != 0;
+static bool range_set_contains(const struct block_cache_range_set *set, off_t start, off_t end)
+{
+    size_t ix = range_set_lower_bound(set, start);
+    return ix < set->count &&
+           set->ranges[ix].start <= start &&
+           set->ranges[ix].end >= end;
 }
 
-static void clear_trimmed(struct block_cache *bc, off_t offset)
+static bool range_set_overlaps(const struct block_cache_range_set *set, off_t start, off_t end)
 {
-    size_t segment_ix = offset / BLOCK_CACHE_SEGMENT_SIZE;
-    size_t bit_ix = segment_ix / 8;
+    size_t ix = range_set_lower_bound(set, start);
+    return ix < set->count && set->ranges[ix].start < end;
+}
 
-    if (bit_ix >= bc->trimmed_len) {
-        // If we're clearing the trim on something that's already not trimmed, then
-        // we don't need to do anything.
-        if (!bc->trimmed_remainder)
-            return;
+// Zero out the parts of buf (located at offset) that are in the set
+static void range_set_zero_fill(const struct block_cache_range_set *set, uint8_t *buf, off_t offset, size_t count)
+{
+    off_t end = offset + count;
+    for (size_t ix = range_set_lower_bound(set, offset);
+         ix < set->count && set->ranges[ix].start < end;
+         ix++) {
+        off_t fill_start = set->ranges[ix].start > offset ? set->ranges[ix].start : offset;
+        off_t fill_end = set->ranges[ix].end < end ? set->ranges[ix].end : end;
+        memset(buf + (fill_start - offset), 0, fill_end - fill_start);
+    }
+}
 
-        // Expand the bit area to hold the new value
-        enlarge_trim_bitvector(bc, bit_ix);
+static bool is_all_zeros(const uint8_t *data, size_t count)
+{
+    // Real data almost always has a non-zero byte near the beginning, so
+    // check a block at a time to stop early. Within a block, OR everything
+    // together without branching so that the compiler can vectorize it.
+    // That keeps the all zero case cheap too.
+    while (count >= FWUP_BLOCK_SIZE) {
+        uint64_t words[FWUP_BLOCK_SIZE / sizeof(uint64_t)];
+        memcpy(words, data, FWUP_BLOCK_SIZE);
+
+        uint64_t bits = 0;
+        for (size_t i = 0; i < FWUP_BLOCK_SIZE / sizeof(uint64_t); i++)
+            bits |= words[i];
+        if (bits)
+            return false;
+
+        data += FWUP_BLOCK_SIZE;
+        count -= FWUP_BLOCK_SIZE;
     }
 
+    for (size_t i = 0; i < count; i++) {
+        if (data[i])
+            return false;
+    }
+    return true;
+}
 
-    int bit = segment_ix & 7;
-    bc->trimmed[bit_ix] &= ~(1 << bit);
+static inline bool is_known_zero(struct block_cache *bc, off_t offset, size_t count)
+{
+    return range_set_contains(&bc->trimmed, offset, offset + count) ||
+           range_set_contains(&bc->zeroed, offset, offset + count);
 }
 
 // Cache bit handling functions
+static inline void note_write(struct block_cache *bc, off_t start, off_t end)
+{
+    if (bc->track_changes)
+        range_set_add(&bc->changed, start, end);
+    if (bc->track_written)
+        range_set_add(&bc->written, start, end);
+}
+
+static inline void note_trim(struct block_cache *bc, off_t start, off_t end)
+{
+    if (bc->track_changes)
+        range_set_add(&bc->changed, start, end);
+    if (bc->track_written)
+        range_set_remove(&bc->written, start, end);
+}
+
 static inline void set_dirty(struct block_cache_segment *seg, int block)
 {
     // Dirty implies that the block is valid, so make sure that it's set too.
@@ -152,13 +309,61 @@ static void init_segment(struct block_cache *bc, off_t offset, struct block_cach
     seg->streamed = true;
 }
 
+static inline void lock_written(struct block_cache *bc)
+{
+#if USE_PTHREADS
+    OK_OR_FAIL(pthread_mutex_lock(&bc->mutex));
+#else
+    (void) bc;
+#endif
+}
+
+static inline void unlock_written(struct block_cache *bc)
+{
+#if USE_PTHREADS
+    OK_OR_FAIL(pthread_mutex_unlock(&bc->mutex));
+#else
+    (void) bc;
+#endif
+}
+
+/**
+ * Read a segment from the destination
+ *
+ * On dry runs, segments that would have been written come from the overlay
+ * instead. If there's no destination yet, it reads as zeros.
+ */
+static ssize_t read_destination(struct block_cache *bc, void *data, off_t offset)
+{
+    if (!bc->dry_run)
+        return pread(bc->fd, data, BLOCK_CACHE_SEGMENT_SIZE, offset);
+
+    // Reads happen on both the main and I/O threads.
+    lock_written(bc);
+    bool in_overlay = range_set_contains(&bc->overlay_ranges, offset, offset + BLOCK_CACHE_SEGMENT_SIZE);
+    if (bc->stats) {
+        range_set_add(&bc->stats->read, offset, offset + BLOCK_CACHE_SEGMENT_SIZE);
+        bc->stats->bytes_read += BLOCK_CACHE_SEGMENT_SIZE;
+    }
+    unlock_written(bc);
+
+    if (in_overlay)
+        return pread(fileno(bc->overlay), data, BLOCK_CACHE_SEGMENT_SIZE, offset);
+    if (bc->fd < 0) {
+        memset(data, 0, BLOCK_CACHE_SEGMENT_SIZE);
+        return BLOCK_CACHE_SEGMENT_SIZE;
+    }
+    return pread(bc->fd, data, BLOCK_CACHE_SEGMENT_SIZE, offset);
+}
+
 static int read_segment(struct block_cache *bc, struct block_cache_segment *seg, void *data)
 {
-    if (is_trimmed(bc, seg->offset)) {
-        // Trimmed, so we'd be reading uninitialized data (in theory), if we called pread.
+    if (is_known_zero(bc, seg->offset, BLOCK_CACHE_SEGMENT_SIZE)) {
+        // Either zeros were written here or the segment was trimmed and
+        // we'd be reading uninitialized data (in theory), if we called pread.
         memset(data, 0, BLOCK_CACHE_SEGMENT_SIZE);
     } else {
-        ssize_t bytes_read = pread(bc->fd, data, BLOCK_CACHE_SEGMENT_SIZE, seg->offset);
+        ssize_t bytes_read = read_destination(bc, data, seg->offset);
         if (bytes_read < 0) {
             ERR_RETURN("unexpected error reading %d bytes at offset %" PRId64 ": %s.\nPossible causes are that the destination is too small, the device (e.g., an SD card) is going bad, or the connection to it is flaky.",
                     BLOCK_CACHE_SEGMENT_SIZE, seg->offset, strerror(errno));
@@ -168,6 +373,9 @@ static int read_segment(struct block_cache *bc, struct block_cache_segment *seg,
             // and don't fail.
             memset((uint8_t *) data + bytes_read, 0, BLOCK_CACHE_SEGMENT_SIZE - bytes_read);
         }
+
+        // Anything trimmed inside the segment reads back as zeros.
+        range_set_zero_fill(&bc->trimmed, data, seg->offset, BLOCK_CACHE_SEGMENT_SIZE);
     }
     return 0;
 }
@@ -197,27 +405,96 @@ static int make_segment_valid(struct block_cache *bc, struct block_cache_segment
     return 0;
 }
 
-static int verified_segment_write(struct block_cache *bc, volatile struct block_cache_segment *seg, uint8_t *temp)
+static void add_unverified_digest(struct block_cache *bc, off_t offset, const uint8_t *digest)
+{
+    // Writes happen on both the main and I/O threads.
+    lock_written(bc);
+
+    // If the segment was written again, only the latest write matters.
+    struct block_cache_written *entry = NULL;
+    for (int i = 0; i < bc->unverified_count; i++) {
+        if (bc->unverified[i].offset == offset) {
+            entry = &bc->unverified[i];
+            break;
+        }
+    }
+    if (!entry) {
+        if (bc->unverified_count == bc->unverified_capacity) {
+            bc->unverified_capacity = bc->unverified_capacity ? bc->unverified_capacity * 2 : BLOCK_CACHE_VERIFY_BATCH * 2;
+            bc->unverified = realloc(bc->unverified, bc->unverified_capacity * sizeof(struct block_cache_written));
+            if (!bc->unverified)
+                fwup_err(EXIT_FAILURE, "realloc");
+        }
+        entry = &bc->unverified[bc->unverified_count++];
+        entry->offset = offset;
+    }
+    memcpy(entry->digest, digest, BLOCK_CACHE_DIGEST_LEN);
+
+    unlock_written(bc);
+}
+
+static void add_unverified(struct block_cache *bc, off_t offset, const uint8_t *data)
+{
+    uint8_t digest[BLOCK_CACHE_DIGEST_LEN];
+    crypto_blake2b_general(digest, sizeof(digest), NULL, 0, data, BLOCK_CACHE_SEGMENT_SIZE);
+    add_unverified_digest(bc, offset, digest);
+}
+
+static int write_overlay(struct block_cache *bc, off_t offset, const uint8_t *data)
+{
+    if (pwrite(fileno(bc->overlay), data, BLOCK_CACHE_SEGMENT_SIZE, offset) != BLOCK_CACHE_SEGMENT_SIZE)
+        ERR_RETURN("dry run can't save segment at offset %" PRId64 ": %s", offset, strerror(errno));
+
+    // Writes happen on both the main and I/O threads.
+    lock_written(bc);
+    range_set_add(&bc->overlay_ranges, offset, offset + BLOCK_CACHE_SEGMENT_SIZE);
+    if (bc->stats) {
+        range_set_add(&bc->stats->written, offset, offset + BLOCK_CACHE_SEGMENT_SIZE);
+        bc->stats->bytes_written += BLOCK_CACHE_SEGMENT_SIZE;
+    }
+    unlock_written(bc);
+    return 0;
+}
+
+static int write_segment(struct block_cache *bc, volatile struct block_cache_segment *seg)
 {
     off_t offset = seg->offset;
     const uint8_t *data = seg->data;
 
+    if (bc->dry_run)
+        return write_overlay(bc, offset, data);
+
     if (pwrite(bc->fd, data, BLOCK_CACHE_SEGMENT_SIZE, offset) != BLOCK_CACHE_SEGMENT_SIZE)
         ERR_RETURN("write failed at offset %" PRId64 ". Check media size.", offset);
 
-    if (bc->verify_writes) {
-        if (pread(bc->fd, temp, BLOCK_CACHE_SEGMENT_SIZE, offset) != BLOCK_CACHE_SEGMENT_SIZE)
-            ERR_RETURN("read back failed at offset %" PRId64, offset);
-
-        if (memcmp(data, temp, BLOCK_CACHE_SEGMENT_SIZE) != 0)
-            ERR_RETURN("write verification failed at offset %" PRId64, offset);
-    }
+    // Reading back right away would mostly check the OS's cache and double
+    // the time for each write, so just remember what to check later.
+    if (bc->verify_writes)
+        add_unverified(bc, offset, data);
 
     return 0;
 }
 
+static int verify_full_batch(struct block_cache *bc);
+
 #if USE_PTHREADS
-static void *writer_worker(void *void_bc)
+static void readahead_segment(struct block_cache *bc, struct block_cache_segment *seg)
+{
+    // Errors are ignored here. The segment is left invalid, so it will be
+    // read again synchronously and any error will be reported then.
+    ssize_t bytes_read = read_destination(bc, seg->data, seg->offset);
+    if (bytes_read < 0)
+        return;
+
+    // Short reads happen at the end of media that's not a multiple of the
+    // segment size. Fill the remainder with zeros like read_segment().
+    if (bytes_read < BLOCK_CACHE_SEGMENT_SIZE)
+        memset(seg->data + bytes_read, 0, BLOCK_CACHE_SEGMENT_SIZE - bytes_read);
+
+    set_all_valid(seg);
+}
+
+static void *io_worker(void *void_bc)
 {
     struct block_cache *bc = (struct block_cache *) void_bc;
 
@@ -227,12 +504,28 @@ static void *writer_worker(void *void_bc)
             volatile struct block_cache_segment *seg = bc->seg_to_write;
 
             OK_OR_FAIL(pthread_mutex_unlock(&bc->mutex));
-            if (verified_segment_write(bc, seg, bc->thread_verify_temp) < 0)
+            if (write_segment(bc, seg) < 0)
                 bc->bad_offset = seg->offset;
             OK_OR_FAIL(pthread_mutex_lock(&bc->mutex));
 
             bc->seg_to_write = NULL;
             OK_OR_FAIL(pthread_cond_broadcast(&bc->cond));
+            continue;
+        }
+
+        // Writes take priority, but service read-ahead when idle.
+        if (bc->readahead_count > 0) {
+            struct block_cache_segment *seg = bc->readahead_queue[0];
+            bc->readahead_count--;
+            memmove(&bc->readahead_queue[0], &bc->readahead_queue[1], bc->readahead_count * sizeof(struct block_cache_segment *));
+
+            OK_OR_FAIL(pthread_mutex_unlock(&bc->mutex));
+            readahead_segment(bc, seg);
+            OK_OR_FAIL(pthread_mutex_lock(&bc->mutex));
+
+            seg->pending_read = false;
+            OK_OR_FAIL(pthread_cond_broadcast(&bc->cond));
+            continue;
         }
 
         if (!bc->running)
@@ -249,10 +542,20 @@ static int check_async_error(struct block_cache *bc)
         ERR_RETURN("write failed at offset %" PRId64". Check media size.", bc->bad_offset);
     return 0;
 }
+static int wait_for_writes(struct block_cache *bc)
+{
+    OK_OR_FAIL(pthread_mutex_lock(&bc->mutex));
+    while (bc->seg_to_write != NULL)
+        OK_OR_FAIL(pthread_cond_wait(&bc->cond, &bc->mutex));
+    OK_OR_FAIL(pthread_mutex_unlock(&bc->mutex));
+
+    return check_async_error(bc);
+}
 static int do_async_write(struct block_cache *bc, struct block_cache_segment *seg)
 {
     // Don't start if already errored.
     OK_OR_RETURN(check_async_error(bc));
+    OK_OR_RETURN(verify_full_batch(bc));
 
     // Wait for the writer thread to complete the last set of writes
     // before starting new ones.
@@ -267,19 +570,48 @@ static int do_async_write(struct block_cache *bc, struct block_cache_segment *se
     //       be a previous write.
     return check_async_error(bc);
 }
-static void wait_for_write_completion(struct block_cache *bc, struct block_cache_segment *seg)
+static void wait_for_segment_io(struct block_cache *bc, struct block_cache_segment *seg)
 {
-    // Wait for write thread to finish
+    // Wait for the I/O thread to finish writing or reading ahead this segment
     OK_OR_FAIL(pthread_mutex_lock(&bc->mutex));
-    while (bc->seg_to_write == seg)
+    while (bc->seg_to_write == seg || seg->pending_read)
         OK_OR_FAIL(pthread_cond_wait(&bc->cond, &bc->mutex));
     OK_OR_FAIL(pthread_mutex_unlock(&bc->mutex));
 }
+static void start_readahead(struct block_cache *bc, struct block_cache_segment *seg)
+{
+    OK_OR_FAIL(pthread_mutex_lock(&bc->mutex));
+    seg->pending_read = true;
+    bc->readahead_queue[bc->readahead_count++] = seg;
+    OK_OR_FAIL(pthread_cond_broadcast(&bc->cond));
+    OK_OR_FAIL(pthread_mutex_unlock(&bc->mutex));
+}
+static inline bool readahead_queue_full(struct block_cache *bc)
+{
+    // Only the main thread adds to the queue, so reading the count without
+    // the lock can only underestimate how much room there is.
+    return bc->readahead_count >= BLOCK_CACHE_MAX_READAHEAD;
+}
+static void cancel_readahead(struct block_cache *bc)
+{
+    // Throw out anything that hasn't been started and wait for what has.
+    OK_OR_FAIL(pthread_mutex_lock(&bc->mutex));
+    for (int i = 0; i < bc->readahead_count; i++) {
+        bc->readahead_queue[i]->pending_read = false;
+        bc->readahead_queue[i]->in_use = false;
+    }
+    bc->readahead_count = 0;
+    OK_OR_FAIL(pthread_mutex_unlock(&bc->mutex));
+
+    for (int i = 0; i < BLOCK_CACHE_NUM_SEGMENTS; i++)
+        wait_for_segment_io(bc, &bc->segments[i]);
+}
 
 static inline int do_sync_write(struct block_cache *bc, struct block_cache_segment *seg)
 {
     // Don't start if already errored.
     OK_OR_RETURN(check_async_error(bc));
+    OK_OR_RETURN(verify_full_batch(bc));
 
     OK_OR_FAIL(pthread_mutex_lock(&bc->mutex));
     if (bc->seg_to_write == seg) {
@@ -290,7 +622,7 @@ static inline int do_sync_write(struct block_cache *bc, struct block_cache_segme
         return check_async_error(bc);
     } else {
         OK_OR_FAIL(pthread_mutex_unlock(&bc->mutex));
-        int rc = verified_segment_write(bc, seg, bc->verify_temp);
+        int rc = write_segment(bc, seg);
         if (rc < 0)
             bc->bad_offset = seg->offset;
         return rc;
@@ -298,21 +630,214 @@ static inline int do_sync_write(struct block_cache *bc, struct block_cache_segme
 }
 #else
 // Single-threaded version
+static inline int wait_for_writes(struct block_cache *bc)
+{
+    // Writes are always done.
+    (void) bc;
+    return 0;
+}
 static inline int do_sync_write(struct block_cache *bc, struct block_cache_segment *seg)
 {
-    return verified_segment_write(bc, seg, bc->verify_temp);
+    OK_OR_RETURN(verify_full_batch(bc));
+    return write_segment(bc, seg);
 }
 static inline int do_async_write(struct block_cache *bc, struct block_cache_segment *seg)
 {
     return do_sync_write(bc, seg);
 }
-static inline void wait_for_write_completion(struct block_cache *bc, struct block_cache_segment *seg)
+static inline void wait_for_segment_io(struct block_cache *bc, struct block_cache_segment *seg)
 {
     // Not async, so no waits.
     (void) bc;
     (void) seg;
 }
+static inline void start_readahead(struct block_cache *bc, struct block_cache_segment *seg)
+{
+    // Read-ahead is only useful if it's asynchronous.
+    (void) bc;
+    (void) seg;
+}
+static inline bool readahead_queue_full(struct block_cache *bc)
+{
+    // Never start read-ahead since it would just be a synchronous read.
+    (void) bc;
+    return true;
+}
+static inline void cancel_readahead(struct block_cache *bc)
+{
+    (void) bc;
+}
+#endif
+
+static int offsetcompare(const void *pa, const void *pb)
+{
+    const struct block_cache_written *a = (const struct block_cache_written *) pa;
+    const struct block_cache_written *b = (const struct block_cache_written *) pb;
+
+    if (a->offset < b->offset)
+        return -1;
+    else if (a->offset > b->offset)
+        return 1;
+    else
+        return 0;
+}
+
+/**
+ * Wait for everything that's been written to be on the media
+ *
+ * Devices are opened with O_DIRECT on Linux, so the OS has nothing to write,
+ * but this still makes the device write out its own cache.
+ */
+static int sync_output(struct block_cache *bc)
+{
+    if (bc->dry_run) {
+        if (bc->stats)
+            bc->stats->syncs++;
+        return 0;
+    }
+
+    int rc;
+#if defined(__linux__)
+    rc = fdatasync(bc->fd);
+#elif defined(_WIN32)
+    rc = _commit(bc->fd);
+#else
+#if defined(F_FULLFSYNC)
+    // fsync doesn't flush the drive's cache on OSX
+    if (fcntl(bc->fd, F_FULLFSYNC) == 0)
+        return 0;
+#endif
+    rc = fsync(bc->fd);
+#endif
+
+    // Some destinations, like character devices, have nothing to sync.
+    if (rc < 0 && (errno == EINVAL || errno == ENOTSUP || errno == EROFS))
+        rc = 0;
+    return rc;
+}
+
+/**
+ * Read back everything written since the last time and compare digests
+ *
+ * Nothing can be in the middle of being written when this is called.
+ */
+static int verify_unverified(struct block_cache *bc)
+{
+    int rc = 0;
+    if (bc->unverified_count == 0)
+        return 0;
+
+    // Push the writes out to the media so that they're what gets checked
+    // rather than the OS's cache.
+    (void) sync_output(bc);
+
+    // Read runs of adjacent segments at the same time.
+    qsort(bc->unverified, bc->unverified_count, sizeof(struct block_cache_written), offsetcompare);
+    for (int i = 0; i < bc->unverified_count; ) {
+        off_t offset = bc->unverified[i].offset;
+        int run = 1;
+        while (i + run < bc->unverified_count &&
+               run < BLOCK_CACHE_VERIFY_READ_SIZE / BLOCK_CACHE_SEGMENT_SIZE &&
+               bc->unverified[i + run].offset == offset + run * BLOCK_CACHE_SEGMENT_SIZE)
+            run++;
+
+        size_t len = run * BLOCK_CACHE_SEGMENT_SIZE;
+#ifdef POSIX_FADV_DONTNEED
+        (void) posix_fadvise(bc->fd, offset, len, POSIX_FADV_DONTNEED);
+#endif
+        if (pread(bc->fd, bc->verify_temp, len, offset) != (ssize_t) len)
+            ERR_CLEANUP_MSG("read back failed at offset %" PRId64, offset);
+
+        for (int j = 0; j < run; j++) {
+            uint8_t digest[BLOCK_CACHE_DIGEST_LEN];
+            crypto_blake2b_general(digest, sizeof(digest), NULL, 0, bc->verify_temp + j * BLOCK_CACHE_SEGMENT_SIZE, BLOCK_CACHE_SEGMENT_SIZE);
+            if (memcmp(digest, bc->unverified[i + j].digest, sizeof(digest)) != 0)
+                ERR_CLEANUP_MSG("write verification failed at offset %" PRId64, bc->unverified[i + j].offset);
+        }
+        i += run;
+    }
+
+cleanup:
+    bc->unverified_count = 0;
+    return rc;
+}
+
+static int verify_all(struct block_cache *bc)
+{
+    OK_OR_RETURN(wait_for_writes(bc));
+    return verify_unverified(bc);
+}
+
+static int verify_full_batch(struct block_cache *bc)
+{
+    // Only the I/O thread changes the count while this runs, so at worst
+    // this misses a write and the batch gets checked next time.
+    if (bc->unverified_count < BLOCK_CACHE_VERIFY_BATCH)
+        return 0;
+
+    return verify_all(bc);
+}
+
+/**
+ * Turn a range of a sparse output file into a hole
+ *
+ * Nothing needs to be done past the end of the data since the file will be
+ * extended with a hole if needed.
+ *
+ * @return true if the range reads back as zeros
+ */
+static bool punch_hole(struct block_cache *bc, off_t start, off_t end)
+{
+    if (start >= bc->data_end)
+        return true;
+    if (end > bc->data_end)
+        end = bc->data_end;
+
+    // Dry runs assume that it would have worked.
+    if (bc->dry_run)
+        return true;
+
+#if HAVE_PUNCH_HOLE
+    return fallocate(bc->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, end - start) == 0;
+#else
+    return false;
 #endif
+}
+
+/**
+ * Update the trimmed and zeroed ranges for a segment that's about to be
+ * written.
+ *
+ * @return true if the segment needs to be written; false if the destination
+ *         already has zeros there and so do we
+ */
+static bool prepare_segment_write(struct block_cache *bc, struct block_cache_segment *seg)
+{
+    off_t end = seg->offset + BLOCK_CACHE_SEGMENT_SIZE;
+    bool zeros = is_all_zeros(seg->data, BLOCK_CACHE_SEGMENT_SIZE);
+
+    if (zeros && range_set_contains(&bc->zeroed, seg->offset, end))
+        return false;
+
+    range_set_remove(&bc->trimmed, seg->offset, end);
+    if (zeros)
+        range_set_add(&bc->zeroed, seg->offset, end);
+    else
+        range_set_remove(&bc->zeroed, seg->offset, end);
+
+    if (bc->sparse_output) {
+        if (zeros && punch_hole(bc, seg->offset, end)) {
+            if (end > bc->sparse_end)
+                bc->sparse_end = end;
+            return false;
+        }
+
+        if (end > bc->data_end)
+            bc->data_end = end;
+    }
+
+    return true;
+}
 
 static int flush_segment(struct block_cache *bc, struct block_cache_segment *seg)
 {
@@ -320,10 +845,17 @@ static int flush_segment(struct block_cache *bc, struct block_cache_segment *seg
     if (!seg->in_use || !is_segment_dirty(seg))
         return 0;
 
+    // Dirty segments are never read ahead, but be safe.
+    wait_for_segment_io(bc, seg);
+
     // Try to write the segment out. If it is partial, do a read/modify/write
     int rc = 0;
     OK_OR_CLEANUP(make_segment_valid(bc, seg));
-    OK_OR_CLEANUP(do_sync_write(bc, seg));
+    if (prepare_segment_write(bc, seg) && do_sync_write(bc, seg) < 0) {
+        // Don't trust anything about what's on the destination here.
+        range_set_remove(&bc->zeroed, seg->offset, seg->offset + BLOCK_CACHE_SEGMENT_SIZE);
+        ERR_CLEANUP();
+    }
 
 cleanup:
     // On success, the block isn't dirty and it's no longer trimmed.
@@ -331,11 +863,33 @@ cleanup:
     // block repeatedly stuck dirty and hopelessly retried. Hopefully the error
     // gets handled by the caller of fwup to take appropriate action, though.
     clear_all_dirty(seg);
-    clear_trimmed(bc, seg->offset);
+    range_set_remove(&bc->trimmed, seg->offset, seg->offset + BLOCK_CACHE_SEGMENT_SIZE);
 
     return rc;
 }
 
+/**
+ * Stop writing to a follower
+ *
+ * The reason is taken from the last error.
+ *
+ * @param follower the follower that failed
+ */
+void block_cache_drop_follower(struct block_cache *follower)
+{
+    follower->error = strdup(last_error());
+    if (!follower->error)
+        fwup_err(EXIT_FAILURE, "strdup");
+}
+
+// Repeat WORK on each follower that's still working. F is the follower.
+#define FOR_EACH_FOLLOWER(BC, F, WORK) \
+    for (int follower_ix = 0; follower_ix < (BC)->follower_count; follower_ix++) { \
+        struct block_cache *F = (BC)->followers[follower_ix]; \
+        if (!F->error && (WORK) < 0) \
+            block_cache_drop_follower(F); \
+    }
+
 /**
  * @brief block_cache_init
  * @param bc
@@ -343,13 +897,15 @@ cleanup:
  * @param end_offset the size of the destination in bytes
  * @param enable_trim true if allowed to issue TRIM commands to the device
  * @param verify_writes true to verify writes
+ * @param sparse_output true to leave holes for zeros if the destination is a regular file
  * @return
  */
 int block_cache_init(struct block_cache *bc,
         int fd,
         off_t end_offset,
         bool enable_trim,
-        bool verify_writes)
+        bool verify_writes,
+        bool sparse_output)
 {
     memset(bc, 0, sizeof(struct block_cache));
 
@@ -359,8 +915,6 @@ int block_cache_init(struct block_cache *bc,
 
     pthread_mutex_init(&bc->mutex, NULL);
     pthread_cond_init(&bc->cond, NULL);
-    if (verify_writes)
-        alloc_page_aligned((void **) &bc->thread_verify_temp, BLOCK_CACHE_SEGMENT_SIZE);
 #endif
 
     bc->fd = fd;
@@ -368,19 +922,26 @@ int block_cache_init(struct block_cache *bc,
     alloc_page_aligned((void **) &bc->read_temp, BLOCK_CACHE_SEGMENT_SIZE);
 
     if (verify_writes)
-        alloc_page_aligned((void **) &bc->verify_temp, BLOCK_CACHE_SEGMENT_SIZE);
+        alloc_page_aligned((void **) &bc->verify_temp, BLOCK_CACHE_VERIFY_READ_SIZE);
 
     // Initialized to nothing trimmed. I.e. every write that doesn't fall on a
     // segment boundary is a read/modify/write.
-    bc->trimmed_remainder = false;
-    bc->trimmed_len = 64 * 1024; // 64K * 8 bits/byte * 128K bytes/segment = 64G start trimmed area tracking size
-    bc->trimmed_end_offset = ((off_t) bc->trimmed_len) * 8 * BLOCK_CACHE_SEGMENT_SIZE;
-    bc->trimmed = (uint8_t *) malloc(bc->trimmed_len);
-    if (bc->trimmed == NULL)
-        fwup_err(EXIT_FAILURE, "malloc");
-    memset(bc->trimmed, 0, bc->trimmed_len);
+    range_set_init(&bc->trimmed);
+    range_set_init(&bc->zeroed);
+    range_set_init(&bc->changed);
+    range_set_init(&bc->written);
     bc->hw_trim_enabled = enable_trim;
+    bc->end_offset = end_offset;
     bc->num_blocks = 0;
+    bc->last_read_segment = -1;
+    bc->readahead_next = 0;
+    bc->readahead_window = 0;
+
+    // Anything in the file before fwup started could be non-zero.
+    struct stat st;
+    bc->sparse_output = sparse_output && fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    bc->data_end = bc->sparse_output ? st.st_size : 0;
+    bc->sparse_end = 0;
 
     // Set the trim points based on the file size
     if (end_offset > 0) {
@@ -391,15 +952,16 @@ int block_cache_init(struct block_cache *bc,
         // Save away the file size in blocks if needed later
         bc->num_blocks = (uint32_t) (end_offset / FWUP_BLOCK_SIZE);
     } else {
-        // When the device size is unknown, don't try to initialize the trim bit
-        // vector to support to optimize reads past the end. This really only helps
-        // for regular files with partial segment writes at the end, so not a big deal.
+        // When the device size is unknown, don't try to mark anything past
+        // the end as trimmed to optimize reads past the end. This really only
+        // helps for regular files with partial segment writes at the end, so
+        // not a big deal.
         bc->num_blocks = 0;
     }
 
-    // Start async writer thread if available
+    // Start async I/O thread if available
 #if USE_PTHREADS
-    if (pthread_create(&bc->writer_thread, NULL, writer_worker, bc))
+    if (pthread_create(&bc->io_thread, NULL, io_worker, bc))
         fwup_errx(EXIT_FAILURE, "pthread_create");
 #endif
 
@@ -427,17 +989,26 @@ void block_cache_reset(struct block_cache *bc)
     // Throw away everything in the cache. This is only called on errors so
     // that any writes that we still control can be cancelled to minimize
     // changes. The block cache can be used again for error handling code.
+    cancel_readahead(bc);
 
     for (int i = 0; i < BLOCK_CACHE_NUM_SEGMENTS; i++) {
         struct block_cache_segment *seg = &bc->segments[i];
         if (seg->in_use) {
-            wait_for_write_completion(bc, seg);
+            wait_for_segment_io(bc, seg);
             seg->in_use = false;
         }
     }
 #if USE_PTHREADS
     bc->bad_offset = -1;
 #endif
+
+    // Writes may have been lost, so forget what's known to be zero and
+    // don't check them.
+    range_set_free(&bc->zeroed);
+    bc->unverified_count = 0;
+
+    for (int i = 0; i < bc->follower_count; i++)
+        block_cache_reset(bc->followers[i]);
 }
 
 int block_cache_flush(struct block_cache *bc)
@@ -462,17 +1033,70 @@ int block_cache_flush(struct block_cache *bc)
         sorted_segments[i] = &bc->segments[i];
     qsort(sorted_segments, BLOCK_CACHE_NUM_SEGMENTS, sizeof(struct block_cache_segment *), lrucompare);
 
+    int last_dirty = -1;
+    for (int i = 0; i < BLOCK_CACHE_NUM_SEGMENTS; i++) {
+        if (sorted_segments[i]->in_use && is_segment_dirty(sorted_segments[i]))
+            last_dirty = i;
+    }
+
     int rc = 0;
     for (int i = 0; i < BLOCK_CACHE_NUM_SEGMENTS; i++) {
+        // Check that everything else made it before the final write since
+        // that's usually the one that makes the update take effect.
+        if (i == last_dirty && verify_all(bc) < 0) {
+            rc = -1;
+            break;
+        }
+
         if (flush_segment(bc, sorted_segments[i]) < 0) {
             rc = -1;
             break;
         }
     }
 
+    // Wait for the last asynchronous writes and check everything that's
+    // been written.
+    if (rc == 0)
+        rc = verify_all(bc);
+
+    // Zeros at the end were skipped, so extend the file over them.
+    if (rc == 0 && bc->sparse_end > bc->data_end && !bc->dry_run) {
+        if (ftruncate(bc->fd, bc->sparse_end) < 0) {
+            set_last_error("can't extend output to %" PRId64 " bytes", bc->sparse_end);
+            rc = -1;
+        }
+    }
+
+    FOR_EACH_FOLLOWER(bc, f, block_cache_flush(f));
     return rc;
 }
 
+static int sync_or_fail(struct block_cache *bc)
+{
+    if (sync_output(bc) < 0)
+        ERR_RETURN("can't sync output: %s", strerror(errno));
+    return 0;
+}
+
+/**
+ * @brief Make everything written so far durable
+ *
+ * The cache is flushed and then the OS and device are asked to put the
+ * writes on the media. Nothing written after the barrier can get there
+ * first, so if power is lost, either everything before the barrier made it
+ * or nothing after it did.
+ *
+ * @param bc
+ * @return 0 on success
+ */
+int block_cache_barrier(struct block_cache *bc)
+{
+    OK_OR_RETURN(block_cache_flush(bc));
+    OK_OR_RETURN(sync_or_fail(bc));
+    FOR_EACH_FOLLOWER(bc, f, sync_or_fail(f));
+    return 0;
+}
+
 /**
  * @brief Free all memory allocated by the block cache
  *
@@ -484,6 +1108,9 @@ int block_cache_flush(struct block_cache *bc)
  */
 int block_cache_free(struct block_cache *bc)
 {
+    // Nothing will read what's been read ahead, so don't wait for it.
+    cancel_readahead(bc);
+
 #if USE_PTHREADS
     // Wait for the most recent async write to complete and
     // signal that the thread should exit.
@@ -492,13 +1119,10 @@ int block_cache_free(struct block_cache *bc)
     pthread_cond_broadcast(&bc->cond);
     pthread_mutex_unlock(&bc->mutex);
 
-    if (pthread_join(bc->writer_thread, NULL))
+    if (pthread_join(bc->io_thread, NULL))
         fwup_errx(EXIT_FAILURE, "pthread_join");
     pthread_mutex_destroy(&bc->mutex);
     pthread_cond_destroy(&bc->cond);
-    if (bc->verify_writes)
-        free_page_aligned(bc->thread_verify_temp);
-    bc->thread_verify_temp = NULL;
 #endif
 
     for (int i = 0; i < BLOCK_CACHE_NUM_SEGMENTS; i++) {
@@ -512,16 +1136,177 @@ int block_cache_free(struct block_cache *bc)
     free_page_aligned(bc->read_temp);
     if (bc->verify_writes)
         free_page_aligned(bc->verify_temp);
+    free(bc->unverified);
+    bc->unverified = NULL;
+    bc->unverified_count = 0;
+    bc->unverified_capacity = 0;
+
+    range_set_free(&bc->trimmed);
+    range_set_free(&bc->zeroed);
+    range_set_free(&bc->changed);
+    range_set_free(&bc->written);
+    range_set_free(&bc->overlay_ranges);
+    if (bc->overlay)
+        fclose(bc->overlay);
+
+    // Followers are freed by whoever created them.
+    free(bc->followers);
+    free(bc->error);
+    bc->followers = NULL;
+    bc->follower_count = 0;
+    bc->error = NULL;
 
-    free(bc->trimmed);
-
-    bc->trimmed = NULL;
     bc->read_temp = NULL;
     bc->verify_temp = NULL;
     bc->fd = -1;
     return 0;
 }
 
+/**
+ * @brief Check if a range is known to be zeros without reading it
+ *
+ * This only knows about zeros that fwup wrote or trimmed. Call
+ * block_cache_flush first so that nothing in the cache is newer.
+ *
+ * @param bc
+ * @param offset the byte offset
+ * @param count how many bytes
+ * @return true if the range is all zeros
+ */
+bool block_cache_is_known_zero(struct block_cache *bc, off_t offset, size_t count)
+{
+    return is_known_zero(bc, offset, count);
+}
+
+/**
+ * @brief Start recording the ranges that are written or trimmed
+ *
+ * This lets callers find out if something they wrote was changed afterwards.
+ *
+ * @param bc
+ */
+void block_cache_track_changes(struct block_cache *bc)
+{
+    bc->track_changes = true;
+}
+
+/**
+ * @brief Check if any part of a range was written or trimmed since the last clear
+ *
+ * @param bc
+ * @param offset the byte offset
+ * @param count how many bytes
+ * @return true if something changed in the range
+ */
+bool block_cache_changed(struct block_cache *bc, off_t offset, off_t count)
+{
+    return range_set_overlaps(&bc->changed, offset, offset + count);
+}
+
+/**
+ * @brief Forget the changes recorded so far
+ *
+ * @param bc
+ */
+void block_cache_clear_changes(struct block_cache *bc)
+{
+    range_set_free(&bc->changed);
+}
+
+/**
+ * @brief Start recording the ranges that fwup writes, zeros included
+ *
+ * Trimmed ranges are removed again, so what's left are the ranges whose
+ * contents on the destination came from fwup.
+ *
+ * @param bc
+ */
+void block_cache_track_written(struct block_cache *bc)
+{
+    bc->track_written = true;
+}
+
+/**
+ * @brief Check if fwup wrote any part of a range and didn't trim it afterwards
+ *
+ * @param bc
+ * @param offset the byte offset
+ * @param count how many bytes
+ * @return true if something was written in the range
+ */
+bool block_cache_was_written(struct block_cache *bc, off_t offset, off_t count)
+{
+    return range_set_overlaps(&bc->written, offset, offset + count);
+}
+
+/**
+ * @brief Write everything that's written to this cache to another one too
+ *
+ * This is for programming more than one destination at a time. If the
+ * follower fails, it's dropped from the gang and its error field is set.
+ * Failures of the followers don't affect the original cache.
+ *
+ * @param bc the cache that's used for reads
+ * @param follower a cache for another destination
+ */
+void block_cache_add_follower(struct block_cache *bc, struct block_cache *follower)
+{
+    struct block_cache **new_followers = realloc(bc->followers, (bc->follower_count + 1) * sizeof(struct block_cache *));
+    if (!new_followers)
+        fwup_err(EXIT_FAILURE, "realloc");
+
+    bc->followers = new_followers;
+    bc->followers[bc->follower_count++] = follower;
+}
+
+/**
+ * @brief Don't write anything to the destination
+ *
+ * Writes go to a temporary overlay file instead so that reading them back
+ * still works. Reads of everything else come from the destination, which may
+ * be opened read-only. This must be called before anything is written.
+ *
+ * @param bc
+ * @param stats if not NULL, record what would have been done here
+ * @return 0 on success
+ */
+int block_cache_dry_run(struct block_cache *bc, struct block_cache_stats *stats)
+{
+    bc->overlay = tmpfile();
+    if (!bc->overlay)
+        ERR_RETURN("can't create a temporary file for the dry run: %s", strerror(errno));
+
+    range_set_init(&bc->overlay_ranges);
+    bc->dry_run = true;
+    bc->hw_trim_enabled = false;
+
+    // Nothing's really written, so there's nothing to check.
+    if (bc->verify_writes) {
+        free_page_aligned(bc->verify_temp);
+        bc->verify_temp = NULL;
+        bc->verify_writes = false;
+    }
+
+    bc->stats = stats;
+    if (stats) {
+        memset(stats, 0, sizeof(struct block_cache_stats));
+        range_set_init(&stats->written);
+        range_set_init(&stats->read);
+        range_set_init(&stats->trimmed);
+    }
+    return 0;
+}
+
+/**
+ * @brief Free the ranges recorded on a dry run
+ */
+void block_cache_stats_free(struct block_cache_stats *stats)
+{
+    range_set_free(&stats->written);
+    range_set_free(&stats->read);
+    range_set_free(&stats->trimmed);
+}
+
 /**
  * Find the segment at the specified offset. If it doesn't exist, allocate
  * one, and if we've hit the max number of segments, discard the LRU.
@@ -531,19 +1316,27 @@ int block_cache_free(struct block_cache *bc)
  * @param segment
  * @return
  */
-static int get_segment(struct block_cache *bc, off_t offset, struct block_cache_segment **segment)
+static struct block_cache_segment *find_segment(struct block_cache *bc, off_t offset)
 {
-    // Check for a hit
     for (int i = 0; i < BLOCK_CACHE_NUM_SEGMENTS; i++) {
         struct block_cache_segment *seg = &bc->segments[i];
-        if (seg->in_use && seg->offset == offset) {
-            // Wait for async writes to complete on this segment before use.
-            wait_for_write_completion(bc, seg);
+        if (seg->in_use && seg->offset == offset)
+            return seg;
+    }
+    return NULL;
+}
 
-            seg->last_access = bc->timestamp++;
-            *segment = seg;
-            return 0;
-        }
+static int get_segment(struct block_cache *bc, off_t offset, struct block_cache_segment **segment)
+{
+    // Check for a hit
+    struct block_cache_segment *seg = find_segment(bc, offset);
+    if (seg) {
+        // Wait for async writes to complete on this segment before use.
+        wait_for_segment_io(bc, seg);
+
+        seg->last_access = bc->timestamp++;
+        *segment = seg;
+        return 0;
     }
 
     // Cache miss, so either use an unused entry or the LRU
@@ -564,16 +1357,64 @@ static int get_segment(struct block_cache *bc, off_t offset, struct block_cache_
             lru = seg;
     }
 
+    // Read-ahead may still be filling the LRU segment
+    wait_for_segment_io(bc, lru);
     OK_OR_RETURN(flush_segment(bc, lru));
     init_segment(bc, offset, lru);
     *segment = lru;
     return 0;
 }
 
+static void trim_range(struct block_cache *bc, off_t start, off_t end)
+{
+    range_set_add(&bc->trimmed, start, end);
+    range_set_remove(&bc->zeroed, start, end);
+
+    // Trim out anything in the cache
+    for (size_t i = 0; i < BLOCK_CACHE_NUM_SEGMENTS; i++) {
+        struct block_cache_segment *seg = &bc->segments[i];
+        off_t seg_end = seg->offset + BLOCK_CACHE_SEGMENT_SIZE;
+        if (!seg->in_use || seg_end <= start || seg->offset >= end)
+            continue;
+
+        // Wait for writes to complete on this segment before letting it be used again.
+        wait_for_segment_io(bc, seg);
+
+        if (seg->offset >= start && seg_end <= end) {
+            // Return the segment
+            seg->in_use = false;
+        } else {
+            // Partially trimmed, so zero out the trimmed part. If those
+            // blocks weren't valid, they'll be zero filled when read.
+            off_t zero_start = seg->offset > start ? seg->offset : start;
+            off_t zero_end = seg_end < end ? seg_end : end;
+            memset(seg->data + (zero_start - seg->offset), 0, zero_end - zero_start);
+        }
+    }
+}
+
+static void hw_trim_range(struct block_cache *bc, off_t start, off_t end)
+{
+    // Force the offset and count to segment boundaries. Since
+    // trimming is best effort, ignore sub boundary areas.
+    // E.g., round the offset up and the end down.
+    off_t aligned_start = (start + BLOCK_CACHE_SEGMENT_SIZE - 1) & BLOCK_CACHE_SEGMENT_MASK;
+    off_t aligned_end = end & BLOCK_CACHE_SEGMENT_MASK;
+
+    // Try to issue a trim to the storage device. This is best effort, so if
+    // not supported, it's no big deal.
+    if (bc->hw_trim_enabled && aligned_end > aligned_start)
+        mmc_trim(bc->fd, aligned_start, aligned_end - aligned_start);
+
+    // Regular files get holes instead. This is best effort too.
+    if (bc->sparse_output && aligned_end > aligned_start)
+        (void) punch_hole(bc, aligned_start, aligned_end);
+}
+
 /**
  * @brief Clear out a range in the cache
  *
- * Additionally, mark these blocks so that they don't need to be written to
+ * Additionally, mark these bytes so that they don't need to be written to
  * disk. If the format code writes to them, they'll be marked dirty. However,
  * if any code tries to read them, they'll get back zeros without any I/O. This
  * is best effort.
@@ -586,93 +1427,19 @@ static int get_segment(struct block_cache *bc, off_t offset, struct block_cache_
  */
 int block_cache_trim(struct block_cache *bc, off_t offset, off_t count, bool hwtrim)
 {
-    // Force the offset and count to segment boundaries. Since
-    // trimming is best effort, ignore sub boundary areas.
-    // E.g., round the offset up and the count down.
-    off_t aligned_offset = (offset + BLOCK_CACHE_SEGMENT_SIZE - 1) & BLOCK_CACHE_SEGMENT_MASK;
-    count -= aligned_offset - offset;
-    count = count & BLOCK_CACHE_SEGMENT_MASK;
-    if (count <= 0)
+    if (offset < 0 || count <= 0)
         return 0;
 
-    // Only trim the bit vector if within range
-    if (offset < bc->trimmed_end_offset) {
-        // Adjust the count to be within the bit vector
-        size_t adjusted_count;
-        if (offset + count <= bc->trimmed_end_offset)
-            adjusted_count = count;
-        else
-            adjusted_count = (size_t) (bc->trimmed_end_offset - offset);
-
-        size_t begin_segment_ix = aligned_offset / BLOCK_CACHE_SEGMENT_SIZE;
-        size_t begin_bit_ix = begin_segment_ix / 8;
-        size_t end_segment_ix = begin_segment_ix + adjusted_count / BLOCK_CACHE_SEGMENT_SIZE;
-        size_t end_bit_ix = end_segment_ix / 8;
-
-        // Check if the trim region needs expanding
-        if (end_bit_ix > bc->trimmed_len) {
-            if (bc->trimmed_remainder) {
-                // If the end is already trimmed, then adjust the marking region
-                end_segment_ix = bc->trimmed_len * 8;
-                end_bit_ix = bc->trimmed_len;
-
-                // Check whether end got trimmed before the beginning.
-                if (begin_bit_ix > end_bit_ix)
-                    return 0;
-            } else {
-                // If not, then expand the bit array.
-                enlarge_trim_bitvector(bc, end_bit_ix);
-            }
-        }
-
-        // Set bits
-        if (begin_bit_ix == end_bit_ix) {
-            // Only set a few bits
-            for (size_t bit = begin_segment_ix & 7;
-                 bit < (end_segment_ix & 7);
-                 bit++) {
-                bc->trimmed[begin_bit_ix] |= (1 << bit);
-            }
-        } else {
-            // Set bits in bulk.
-
-            // Handle the first byte
-            for (size_t bit = begin_segment_ix & 7;
-                 bit < 8;
-                 bit++) {
-                bc->trimmed[begin_bit_ix] |= (1 << bit);
-            }
-            begin_bit_ix++;
-
-            // Handle any middle bytes
-            if (end_bit_ix > begin_bit_ix)
-                memset(&bc->trimmed[begin_bit_ix], 0xff, end_bit_ix - begin_bit_ix);
-
-            // Handle the last byte
-            for (size_t bit = 0;
-                 bit < (end_segment_ix & 7);
-                 bit++)
-                bc->trimmed[end_bit_ix] |= (1 << bit);
-        }
-
-        // Trim out anything in the cache
-        for (size_t i = 0; i < BLOCK_CACHE_NUM_SEGMENTS; i++) {
-            struct block_cache_segment *seg = &bc->segments[i];
-            if (seg->in_use && seg->offset >= aligned_offset && seg->offset < aligned_offset + (off_t) count) {
-                // Wait for writes to complete on this segment before letting it be used again.
-                wait_for_write_completion(bc, seg);
-
-                // Return the segment
-                seg->in_use = false;
-            }
-        }
-    }
+    off_t end = (count > BLOCK_CACHE_MAX_OFFSET - offset) ? BLOCK_CACHE_MAX_OFFSET : offset + count;
+    trim_range(bc, offset, end);
+    note_trim(bc, offset, end);
+    if (bc->stats)
+        range_set_add(&bc->stats->trimmed, offset, end);
 
-    // Try to issue a trim to the storage device. This is best effort, so if
-    // not supported, it's no big deal.
-    if (bc->hw_trim_enabled && hwtrim)
-        mmc_trim(bc->fd, aligned_offset, count);
+    if (hwtrim)
+        hw_trim_range(bc, offset, end);
 
+    FOR_EACH_FOLLOWER(bc, f, block_cache_trim(f, offset, count, hwtrim));
     return 0;
 }
 
@@ -685,31 +1452,32 @@ int block_cache_trim(struct block_cache *bc, off_t offset, off_t count, bool hwt
  */
 int block_cache_trim_after(struct block_cache *bc, off_t offset, bool hwtrim)
 {
-    if (offset > bc->trimmed_end_offset) {
-        // The offset is in a range that we don't track with the bit vector,
-        // so don't do anything to the cache datastructures.
-
-        // IMPROVEMENT: Issue a trim to the disk for the offset and afterwards.
-
+    if (offset < 0)
         return 0;
-    }
 
-    // Trim everything after what we keep track of
-    bc->trimmed_remainder = true;
+    trim_range(bc, offset, BLOCK_CACHE_MAX_OFFSET);
+    note_trim(bc, offset, BLOCK_CACHE_MAX_OFFSET);
+    if (bc->stats)
+        range_set_add(&bc->stats->trimmed, offset, BLOCK_CACHE_MAX_OFFSET);
 
-    // Trim out all blocks in the cache.
-    for (int i = 0; i < BLOCK_CACHE_NUM_SEGMENTS; i++) {
-        struct block_cache_segment *seg = &bc->segments[i];
-        if (seg->in_use && seg->offset >= offset) {
-            // Wait for writes to complete on this segment before letting it be used again.
-            wait_for_write_completion(bc, seg);
+    // Only trim the device up to the end if it's known. Regular files only
+    // need holes up to the end of what could be non-zero.
+    off_t trim_end = bc->sparse_output ? bc->data_end : bc->end_offset;
+    if (hwtrim && trim_end > offset)
+        hw_trim_range(bc, offset, trim_end);
 
-            // Return the segment
-            seg->in_use = false;
-        }
-    }
+    FOR_EACH_FOLLOWER(bc, f, block_cache_trim_after(f, offset, hwtrim));
+    return 0;
+}
 
-    return block_cache_trim(bc, offset, bc->trimmed_end_offset - (size_t) offset, hwtrim);
+static int start_segment_write(struct block_cache *bc, struct block_cache_segment *seg)
+{
+    if (prepare_segment_write(bc, seg))
+        OK_OR_RETURN(do_async_write(bc, seg));
+
+    // Mark everything valid.
+    set_all_valid(seg);
+    return 0;
 }
 
 static int block_segment_pwrite(struct block_cache *bc, struct block_cache_segment *seg, const void *buf, size_t count, size_t offset_into_segment, bool streamed)
@@ -726,13 +1494,7 @@ static int block_segment_pwrite(struct block_cache *bc, struct block_cache_segme
     // Check for the whole block streaming case where the best
     // strategy is to write it to flash immediately
     if (streamed && seg->streamed && is_segment_completely_dirty(seg)) {
-        OK_OR_RETURN(do_async_write(bc, seg));
-
-        // Mark everything valid.
-        for (size_t i = 0; i < sizeof(seg->flags); i++)
-            seg->flags[i] = 0xaa;
-
-        clear_trimmed(bc, seg->offset);
+        OK_OR_RETURN(start_segment_write(bc, seg));
     } else {
         if (!streamed)
             seg->streamed = false;
@@ -741,7 +1503,7 @@ static int block_segment_pwrite(struct block_cache *bc, struct block_cache_segme
     return 0;
 }
 
-int block_cache_pwrite(struct block_cache *bc, const void *buf, size_t count, off_t offset, bool streamed)
+static int cache_pwrite(struct block_cache *bc, const void *buf, size_t count, off_t offset, bool streamed)
 {
     // Break into segment-sized chunks
     off_t first = offset & BLOCK_CACHE_SEGMENT_MASK;
@@ -772,8 +1534,377 @@ int block_cache_pwrite(struct block_cache *bc, const void *buf, size_t count, of
     return 0;
 }
 
-static int block_segment_pread(struct block_cache *bc, struct block_cache_segment *seg, void *buf, size_t count, size_t offset_into_segment)
+int block_cache_pwrite(struct block_cache *bc, const void *buf, size_t count, off_t offset, bool streamed)
 {
+    OK_OR_RETURN(cache_pwrite(bc, buf, count, offset, streamed));
+    note_write(bc, offset, offset + count);
+    if (bc->stats)
+        bc->stats->bytes_requested += count;
+
+    FOR_EACH_FOLLOWER(bc, f, cache_pwrite(f, buf, count, offset, streamed));
+    return 0;
+}
+
+/**
+ * @brief Get the cache's memory for a segment so that it can be filled in directly
+ *
+ * This is for producers that generate whole, aligned segments. Rather than
+ * building the data in their own buffer and having block_cache_pwrite() copy
+ * it, they write straight into the segment and then call
+ * block_cache_commit_segment(). The producer must fill in all
+ * BLOCK_CACHE_SEGMENT_SIZE bytes and must not call any other block_cache
+ * function until it commits.
+ *
+ * @param bc
+ * @param offset the byte offset of the segment. This must be segment aligned.
+ * @param data a pointer to the segment's memory
+ * @return 0 on success
+ */
+int block_cache_reserve_segment(struct block_cache *bc, off_t offset, uint8_t **data)
+{
+    if (offset & ~BLOCK_CACHE_SEGMENT_MASK)
+        ERR_RETURN("block_cache_reserve_segment: unaligned offset %" PRId64, offset);
+
+    struct block_cache_segment *seg;
+    OK_OR_RETURN(get_segment(bc, offset, &seg));
+
+    // Nothing in the segment can be trusted until it's committed. This
+    // keeps an abandoned reservation from being mistaken for valid data.
+    memset(seg->flags, 0, sizeof(seg->flags));
+
+    *data = seg->data;
+    return 0;
+}
+
+/**
+ * @brief Write out a segment that was filled in after block_cache_reserve_segment()
+ *
+ * This is handled like a fully streamed segment, so the write is started
+ * immediately.
+ *
+ * @param bc
+ * @param offset the byte offset passed to block_cache_reserve_segment()
+ * @return 0 on success
+ */
+int block_cache_commit_segment(struct block_cache *bc, off_t offset)
+{
+    struct block_cache_segment *seg = find_segment(bc, offset);
+    if (!seg)
+        ERR_RETURN("block_cache_commit_segment: segment at %" PRId64 " not reserved", offset);
+
+    // Everything is dirty
+    memset(seg->flags, 0xff, sizeof(seg->flags));
+    seg->last_access = bc->timestamp++;
+    note_write(bc, offset, offset + BLOCK_CACHE_SEGMENT_SIZE);
+    if (bc->stats)
+        bc->stats->bytes_requested += BLOCK_CACHE_SEGMENT_SIZE;
+
+    // Followers get a copy since only one cache can own the memory
+    FOR_EACH_FOLLOWER(bc, f, cache_pwrite(f, seg->data, BLOCK_CACHE_SEGMENT_SIZE, offset, true));
+
+    return start_segment_write(bc, seg);
+}
+
+/**
+ * Have the kernel copy from in_fd to the destination
+ *
+ * copy_file_range() handles regular files and splice() through a pipe
+ * handles block devices. Either can refuse (different filesystems, O_DIRECT
+ * alignment, old kernels, etc.), so this copies as much as it can.
+ *
+ * @return how many bytes were copied. This is always a multiple of FWUP_BLOCK_SIZE.
+ */
+static off_t kernel_copy(struct block_cache *bc, int in_fd, off_t in_offset, off_t count, off_t offset)
+{
+    off_t copied = 0;
+
+#if HAVE_COPY_FILE_RANGE
+    while (copied < count) {
+        loff_t in_pos = in_offset + copied;
+        loff_t out_pos = offset + copied;
+        ssize_t amount = copy_file_range(in_fd, &in_pos, bc->fd, &out_pos, count - copied, 0);
+        if (amount < 0 && errno == EINTR)
+            continue;
+        if (amount <= 0)
+            break;
+
+        copied += amount;
+    }
+#endif
+
+#if HAVE_SPLICE
+    int pipefd[2];
+    if (copied < count && pipe(pipefd) == 0) {
+        while (copied < count) {
+            loff_t in_pos = in_offset + copied;
+            ssize_t amount = splice(in_fd, &in_pos, pipefd[1], NULL, count - copied, SPLICE_F_MOVE);
+            if (amount < 0 && errno == EINTR)
+                continue;
+            if (amount <= 0)
+                break;
+
+            ssize_t drained = 0;
+            while (drained < amount) {
+                loff_t out_pos = offset + copied + drained;
+                ssize_t rc = splice(pipefd[0], NULL, bc->fd, &out_pos, amount - drained, SPLICE_F_MOVE);
+                if (rc < 0 && errno == EINTR)
+                    continue;
+                if (rc <= 0)
+                    break;
+
+                drained += rc;
+            }
+            copied += drained;
+            if (drained < amount)
+                break;
+        }
+        close(pipefd[0]);
+        close(pipefd[1]);
+    }
+#else
+    (void) bc;
+    (void) in_fd;
+    (void) in_offset;
+    (void) count;
+    (void) offset;
+#endif
+
+    // A partial block gets written again through the cache
+    return copied & ~((off_t) FWUP_BLOCK_SIZE - 1);
+}
+
+/**
+ * Write back and drop anything cached in a range so that the destination
+ * can be written directly
+ */
+static int uncache_range(struct block_cache *bc, off_t start, off_t end)
+{
+    for (size_t i = 0; i < BLOCK_CACHE_NUM_SEGMENTS; i++) {
+        struct block_cache_segment *seg = &bc->segments[i];
+        off_t seg_end = seg->offset + BLOCK_CACHE_SEGMENT_SIZE;
+        if (!seg->in_use || seg_end <= start || seg->offset >= end)
+            continue;
+
+        wait_for_segment_io(bc, seg);
+
+        // Blocks outside of the range still need to be written
+        if (seg->offset < start || seg_end > end)
+            OK_OR_RETURN(flush_segment(bc, seg));
+
+        seg->in_use = false;
+    }
+    return 0;
+}
+
+static int copy_through_cache(struct block_cache *bc, int in_fd, off_t in_offset, off_t count, off_t offset, uint8_t *buffer)
+{
+    off_t copied = 0;
+    while (copied < count) {
+        size_t amount = min(count - copied, BLOCK_CACHE_SEGMENT_SIZE);
+        ssize_t amount_read = pread(in_fd, buffer, amount, in_offset + copied);
+        if (amount_read < 0 && errno == EINTR)
+            continue;
+        if (amount_read != (ssize_t) amount)
+            ERR_RETURN("block_cache_copy_from_fd: unexpected end of input at %" PRId64, in_offset + copied);
+
+        OK_OR_RETURN(block_cache_pwrite(bc, buffer, amount, offset + copied, true));
+        copied += amount;
+    }
+    return 0;
+}
+
+/**
+ * Remember what segments copied by the kernel should read back as
+ *
+ * The data is read from in_fd again, which is normally still in the OS's
+ * cache, so only the destination gets read back.
+ */
+static int add_unverified_copy(struct block_cache *bc, int in_fd, off_t in_offset, off_t count, off_t offset, uint8_t *buffer)
+{
+    for (off_t pos = 0; pos < count; pos += BLOCK_CACHE_SEGMENT_SIZE) {
+        if (pread(in_fd, buffer, BLOCK_CACHE_SEGMENT_SIZE, in_offset + pos) != BLOCK_CACHE_SEGMENT_SIZE)
+            ERR_RETURN("block_cache_copy_from_fd: unexpected end of input at %" PRId64, in_offset + pos);
+
+        add_unverified(bc, offset + pos, buffer);
+        OK_OR_RETURN(verify_full_batch(bc));
+    }
+    return 0;
+}
+
+/**
+ * @brief Copy data from a file to the destination without going through the cache
+ *
+ * When possible, the kernel moves the data so that it never gets copied into
+ * fwup's memory. Otherwise, or if the kernel can't do it for these files,
+ * the data is read and written through the cache like block_cache_pwrite().
+ * When verifying writes, only whole segments are copied by the kernel and
+ * they're read back with the next batch.
+ *
+ * @param bc
+ * @param in_fd the file to copy from
+ * @param in_offset where the data starts in in_fd
+ * @param count how many bytes to copy. This must be a multiple of FWUP_BLOCK_SIZE.
+ * @param offset where to write the data. This must be block aligned.
+ * @return 0 on success
+ */
+int block_cache_copy_from_fd(struct block_cache *bc, int in_fd, off_t in_offset, off_t count, off_t offset)
+{
+    if ((count | offset) & (FWUP_BLOCK_SIZE - 1))
+        ERR_RETURN("block_cache_copy_from_fd: unaligned copy of %" PRId64 " bytes to %" PRId64, count, offset);
+
+    int rc = 0;
+    uint8_t *buffer = malloc(BLOCK_CACHE_SEGMENT_SIZE);
+    if (!buffer)
+        fwup_err(EXIT_FAILURE, "malloc");
+
+    off_t end = offset + count;
+
+    // Verification keeps digests of whole segments.
+    off_t copy_start = offset;
+    off_t copy_end = end;
+    if (bc->verify_writes) {
+        copy_start = (offset + BLOCK_CACHE_SEGMENT_SIZE - 1) & BLOCK_CACHE_SEGMENT_MASK;
+        copy_end = end & BLOCK_CACHE_SEGMENT_MASK;
+    }
+
+    // Dry runs and followers need to see the data.
+    off_t copied = 0;
+    if (!bc->dry_run && bc->follower_count == 0 && copy_start < copy_end) {
+        OK_OR_CLEANUP(uncache_range(bc, copy_start, copy_end));
+
+        copied = kernel_copy(bc, in_fd, in_offset + (copy_start - offset), copy_end - copy_start, copy_start);
+        if (bc->verify_writes)
+            copied &= BLOCK_CACHE_SEGMENT_MASK;
+        if (copied > 0) {
+            note_write(bc, copy_start, copy_start + copied);
+            range_set_remove(&bc->trimmed, copy_start, copy_start + copied);
+            range_set_remove(&bc->zeroed, copy_start, copy_start + copied);
+            if (bc->sparse_output && copy_start + copied > bc->data_end)
+                bc->data_end = copy_start + copied;
+
+            if (bc->verify_writes)
+                OK_OR_CLEANUP(add_unverified_copy(bc, in_fd, in_offset + (copy_start - offset), copied, copy_start, buffer));
+        }
+    }
+    if (copied == 0)
+        copy_start = offset;
+
+    // Whatever the kernel didn't copy goes through the cache
+    off_t copied_end = copy_start + copied;
+    OK_OR_CLEANUP(copy_through_cache(bc, in_fd, in_offset, copy_start - offset, offset, buffer));
+    OK_OR_CLEANUP(copy_through_cache(bc, in_fd, in_offset + (copied_end - offset), end - copied_end, copied_end, buffer));
+
+cleanup:
+    free(buffer);
+    return rc;
+}
+
+/**
+ * Zero whole segments on the destination without writing data to them
+ *
+ * @return true if the range reads back as zeros
+ */
+static bool zero_destination(struct block_cache *bc, off_t start, off_t end)
+{
+    if (bc->sparse_output) {
+        if (!punch_hole(bc, start, end))
+            return false;
+
+        if (end > bc->sparse_end)
+            bc->sparse_end = end;
+        return true;
+    }
+
+#if HAVE_ZERO_RANGE
+    // This extends the file if needed just like writing would.
+    if (fallocate(bc->fd, FALLOC_FL_ZERO_RANGE, start, end - start) == 0)
+        return true;
+#endif
+
+    return mmc_zeroout(bc->fd, start, end - start) == 0;
+}
+
+/**
+ * @brief Write zeros to the destination without sending it the data when possible
+ *
+ * Regular files get holes or have their filesystem zero the range. Devices
+ * are asked to do it themselves. The parts of the range that don't fill a
+ * segment go through the cache. When verifying writes, the zeroed segments
+ * are read back with the next batch.
+ *
+ * @param bc
+ * @param offset where to start. This must be block aligned.
+ * @param count how many bytes to zero. This must be a multiple of FWUP_BLOCK_SIZE.
+ * @param zeroed set to false if the destination can't do this. The range
+ *               needs to be written with block_cache_pwrite() then.
+ * @return 0 on success
+ */
+int block_cache_zero(struct block_cache *bc, off_t offset, off_t count, bool *zeroed)
+{
+    *zeroed = false;
+
+    // Dry runs and followers need to see the data.
+    if (bc->dry_run || bc->follower_count > 0)
+        return 0;
+
+    off_t end = offset + count;
+    off_t aligned_start = (offset + BLOCK_CACHE_SEGMENT_SIZE - 1) & BLOCK_CACHE_SEGMENT_MASK;
+    off_t aligned_end = end & BLOCK_CACHE_SEGMENT_MASK;
+    if (aligned_end <= aligned_start)
+        return 0;
+
+    // Anything still cached would be written over the zeros later.
+    OK_OR_RETURN(uncache_range(bc, aligned_start, aligned_end));
+
+    int rc = 0;
+    uint8_t *zeros = calloc(1, BLOCK_CACHE_SEGMENT_SIZE);
+    if (!zeros)
+        fwup_err(EXIT_FAILURE, "calloc");
+
+    if (!range_set_contains(&bc->zeroed, aligned_start, aligned_end)) {
+        if (!zero_destination(bc, aligned_start, aligned_end))
+            goto cleanup;
+
+        note_write(bc, aligned_start, aligned_end);
+        range_set_remove(&bc->trimmed, aligned_start, aligned_end);
+        range_set_add(&bc->zeroed, aligned_start, aligned_end);
+
+        // The device did the writing, so read the zeros back with the
+        // next batch like any other write.
+        if (bc->verify_writes) {
+            uint8_t digest[BLOCK_CACHE_DIGEST_LEN];
+            crypto_blake2b_general(digest, sizeof(digest), NULL, 0, zeros, BLOCK_CACHE_SEGMENT_SIZE);
+            for (off_t seg_offset = aligned_start; seg_offset < aligned_end; seg_offset += BLOCK_CACHE_SEGMENT_SIZE) {
+                add_unverified_digest(bc, seg_offset, digest);
+                OK_OR_CLEANUP(verify_full_batch(bc));
+            }
+        }
+    }
+    *zeroed = true;
+
+    if (offset < aligned_start)
+        OK_OR_CLEANUP(block_cache_pwrite(bc, zeros, aligned_start - offset, offset, true));
+    if (aligned_end < end)
+        OK_OR_CLEANUP(block_cache_pwrite(bc, zeros, end - aligned_end, aligned_end, true));
+
+cleanup:
+    free(zeros);
+    return rc;
+}
+
+static int block_segment_pread(struct block_cache *bc, off_t segment_offset, void *buf, size_t count, size_t offset_into_segment)
+{
+    // If the range is known to be zero and nothing newer is in the cache,
+    // skip the I/O and don't evict anything to hold the zeros.
+    if (is_known_zero(bc, segment_offset + offset_into_segment, count) &&
+            find_segment(bc, segment_offset) == NULL) {
+        memset(buf, 0, count);
+        return 0;
+    }
+
+    struct block_cache_segment *seg;
+    OK_OR_RETURN(get_segment(bc, segment_offset, &seg));
+
     // Update the cache
     OK_OR_RETURN(make_segment_valid(bc, seg));
 
@@ -783,16 +1914,84 @@ static int block_segment_pread(struct block_cache *bc, struct block_cache_segmen
     return 0;
 }
 
+static struct block_cache_segment *find_readahead_victim(struct block_cache *bc)
+{
+    // Prefer unused segments, but otherwise take the least recently used
+    // clean one. Dirty segments are never evicted to make room for a guess.
+    struct block_cache_segment *victim = NULL;
+    for (int i = 0; i < BLOCK_CACHE_NUM_SEGMENTS; i++) {
+        struct block_cache_segment *seg = &bc->segments[i];
+        if (!seg->in_use)
+            return seg;
+
+        if (is_segment_dirty(seg) || seg->pending_read)
+            continue;
+#if USE_PTHREADS
+        if (bc->seg_to_write == seg)
+            continue;
+#endif
+        if (!victim || seg->last_access < victim->last_access)
+            victim = seg;
+    }
+    return victim;
+}
+
+static void schedule_readahead(struct block_cache *bc, off_t first_segment, off_t last_segment)
+{
+    // Track whether the reads are sequential. Rereading the same segment
+    // (small reads) counts as sequential, but doesn't grow the window.
+    if (first_segment == bc->last_read_segment + BLOCK_CACHE_SEGMENT_SIZE ||
+            (first_segment == bc->last_read_segment && last_segment != first_segment)) {
+        bc->readahead_window = bc->readahead_window ? bc->readahead_window * 2 : 1;
+        if (bc->readahead_window > BLOCK_CACHE_MAX_READAHEAD)
+            bc->readahead_window = BLOCK_CACHE_MAX_READAHEAD;
+    } else if (first_segment != bc->last_read_segment) {
+        bc->readahead_window = 0;
+        bc->readahead_next = 0;
+    }
+    bc->last_read_segment = last_segment;
+
+    if (bc->readahead_window == 0)
+        return;
+
+    off_t next = last_segment + BLOCK_CACHE_SEGMENT_SIZE;
+    if (next < bc->readahead_next)
+        next = bc->readahead_next;
+    off_t end = last_segment + (off_t) (bc->readahead_window + 1) * BLOCK_CACHE_SEGMENT_SIZE;
+    if (bc->end_offset > 0 && end > bc->end_offset)
+        end = bc->end_offset;
+
+    for (; next < end && !readahead_queue_full(bc); next += BLOCK_CACHE_SEGMENT_SIZE) {
+        // Skip anything that's cached or that can be read without I/O
+        if (find_segment(bc, next) ||
+                range_set_overlaps(&bc->trimmed, next, next + BLOCK_CACHE_SEGMENT_SIZE) ||
+                range_set_overlaps(&bc->zeroed, next, next + BLOCK_CACHE_SEGMENT_SIZE))
+            continue;
+
+        struct block_cache_segment *seg = find_readahead_victim(bc);
+        if (!seg)
+            break;
+
+        init_segment(bc, next, seg);
+        start_readahead(bc, seg);
+    }
+    bc->readahead_next = next;
+}
+
 int block_cache_pread(struct block_cache *bc, void *buf, size_t count, off_t offset)
 {
+    if (count == 0)
+        return 0;
+
+    off_t first_segment = offset & BLOCK_CACHE_SEGMENT_MASK;
+    off_t last_segment = (offset + count - 1) & BLOCK_CACHE_SEGMENT_MASK;
+
     // Break into segment-sized chunks
     off_t first = offset & BLOCK_CACHE_SEGMENT_MASK;
     if (first != offset) {
-        struct block_cache_segment *seg;
-        OK_OR_RETURN(get_segment(bc, first, &seg));
         size_t offset_into_segment = offset - first;
         size_t segcount = min(count, BLOCK_CACHE_SEGMENT_SIZE - offset_into_segment);
-        OK_OR_RETURN(block_segment_pread(bc, seg, buf, segcount, offset_into_segment));
+        OK_OR_RETURN(block_segment_pread(bc, first, buf, segcount, offset_into_segment));
 
         count -= segcount;
         offset += segcount;
@@ -800,16 +1999,14 @@ int block_cache_pread(struct block_cache *bc, void *buf, size_t count, off_t off
     }
 
     while (count > 0) {
-        struct block_cache_segment *seg;
-        OK_OR_RETURN(get_segment(bc, offset, &seg));
-
         size_t segcount = min(count, BLOCK_CACHE_SEGMENT_SIZE);
-        OK_OR_RETURN(block_segment_pread(bc, seg, buf, segcount, 0));
+        OK_OR_RETURN(block_segment_pread(bc, offset, buf, segcount, 0));
 
         count -= segcount;
         offset += segcount;
         buf = (char *) buf + segcount;
     }
 
+    schedule_readahead(bc, first_segment, last_segment);
     return 0;
 }
@@ -38,6 +38,11 @@
 #define BLOCK_CACHE_NUM_SEGMENTS       64         // 8 MB cache
 #define BLOCK_CACHE_BLOCKS_PER_SEGMENT (BLOCK_CACHE_SEGMENT_SIZE / FWUP_BLOCK_SIZE)
 #define BLOCK_CACHE_SEGMENT_MASK       (~(BLOCK_CACHE_SEGMENT_SIZE - 1))
+#define BLOCK_CACHE_MAX_OFFSET         ((off_t) INT64_MAX)
+#define BLOCK_CACHE_MAX_READAHEAD      8          // 1 MB of sequential read-ahead
+#define BLOCK_CACHE_VERIFY_BATCH       64         // Read back writes every 8 MB
+#define BLOCK_CACHE_VERIFY_READ_SIZE   (1024*1024)
+#define BLOCK_CACHE_DIGEST_LEN         16
 
 struct block_cache_segment {
     bool in_use;
@@ -57,6 +62,9 @@ struct block_cache_segment {
     // the actual writes can start.
     bool streamed;
 
+    // Set while the I/O thread is reading this segment ahead of use
+    volatile bool pending_read;
+
     // Bit fields for determining whether blocks inside the
     // segment are valid (hold the most up-to-date data) and/or
     // dirty (need to be written back to the target image).
@@ -64,6 +72,39 @@ struct block_cache_segment {
     uint8_t flags[BLOCK_CACHE_BLOCKS_PER_SEGMENT * 2 / 8];
 };
 
+// A sorted set of non-overlapping byte ranges. Adjacent ranges are always
+// coalesced so that lookups can be done with a binary search.
+struct block_cache_range {
+    off_t start;
+    off_t end; // exclusive
+};
+
+struct block_cache_range_set {
+    struct block_cache_range *ranges;
+    size_t count;
+    size_t capacity;
+};
+
+// What would have been done to the destination on a dry run
+struct block_cache_stats {
+    struct block_cache_range_set written;
+    struct block_cache_range_set read;
+    struct block_cache_range_set trimmed;
+
+    off_t bytes_requested; // Passed to block_cache_pwrite and friends
+    off_t bytes_written;   // Written to the destination in whole segments
+    off_t bytes_read;
+    int syncs;
+    int fat_mounts;
+    int uboot_env_writes;
+};
+
+// A segment that was written, but hasn't been read back yet
+struct block_cache_written {
+    off_t offset;
+    uint8_t digest[BLOCK_CACHE_DIGEST_LEN];
+};
+
 struct block_cache {
     int fd;
 
@@ -82,37 +123,103 @@ struct block_cache {
     // Temporary buffer for checking that writes worked
     uint8_t *verify_temp;
 
-    // Track "trimmed" segments in a bitfield. One bit per segment.
-    // E.g., 128K/bit -> 1M takes represented in 1 byte -> 1G in 1 KB, etc.
-    size_t trimmed_len;
-    off_t trimmed_end_offset;
-    uint8_t *trimmed;
-    bool trimmed_remainder; // true if segments after end of bitfield are trimmed
+    // Segments that still need to be read back. Writes only save a digest
+    // and the reads are done in batches after syncing so that they check
+    // the media and not the OS's cache.
+    struct block_cache_written *unverified;
+    int unverified_count;
+    int unverified_capacity;
+
+    // Byte ranges that have been trimmed. Reads from these return zeros
+    // without any I/O, but the destination may still hold old data.
+    struct block_cache_range_set trimmed;
+
+    // Byte ranges that are known to hold zeros on the destination since
+    // fwup wrote them. Writing zeros to these ranges is skipped.
+    struct block_cache_range_set zeroed;
+
+    // Byte ranges written or trimmed since block_cache_clear_changes() if
+    // track_changes is set
+    bool track_changes;
+    struct block_cache_range_set changed;
+
+    // Byte ranges that fwup wrote and didn't trim afterwards if
+    // track_written is set
+    bool track_written;
+    struct block_cache_range_set written;
     bool hw_trim_enabled;
 
+    // The size of the destination in bytes or <= 0 if unknown
+    off_t end_offset;
+
+    // Regular files don't get all-zero segments or trimmed ranges written
+    // to them. Those become holes instead. Past data_end, the file is known
+    // to be zeros so writes are skipped and the file is extended to
+    // sparse_end on flush.
+    bool sparse_output;
+    off_t data_end;
+    off_t sparse_end;
+
+    // Dry runs write to the overlay file instead of the destination.
+    // overlay_ranges has the segments that are in it.
+    bool dry_run;
+    FILE *overlay;
+    struct block_cache_range_set overlay_ranges;
+    struct block_cache_stats *stats; // NULL if not recording
+
     // This tracks the number of blocks on the destination
     uint32_t num_blocks;
 
-    // Asynchronous writes
+    // Sequential read detection. The read-ahead window doubles each time
+    // a read moves on to the next segment and resets on a seek.
+    off_t last_read_segment;
+    off_t readahead_next;
+    int readahead_window;
+
+    // Asynchronous writes and read-ahead
 #if USE_PTHREADS
-    pthread_t writer_thread;
+    pthread_t io_thread;
     pthread_mutex_t mutex;
     pthread_cond_t cond;
-    uint8_t *thread_verify_temp;
 
     volatile bool running;
     volatile struct block_cache_segment *seg_to_write;
     volatile off_t bad_offset; // set if pwrite fails asynchronously
+
+    struct block_cache_segment *readahead_queue[BLOCK_CACHE_MAX_READAHEAD];
+    volatile int readahead_count;
 #endif
+
+    // Gang programming. Everything written to this cache is repeated on
+    // the followers. Reads only come from this one. A follower that fails
+    // is dropped and the reason is saved in its error field.
+    struct block_cache **followers;
+    int follower_count;
+    char *error;
 };
 
-int block_cache_init(struct block_cache *bc, int fd, off_t end_offset, bool enable_trim, bool verify_writes);
+int block_cache_init(struct block_cache *bc, int fd, off_t end_offset, bool enable_trim, bool verify_writes, bool sparse_output);
 int block_cache_trim(struct block_cache *bc, off_t offset, off_t count, bool hwtrim);
 int block_cache_trim_after(struct block_cache *bc, off_t offset, bool hwtrim);
 int block_cache_pwrite(struct block_cache *bc, const void *buf, size_t count, off_t offset, bool streamed);
 int block_cache_pread(struct block_cache *bc, void *buf, size_t count, off_t offset);
+int block_cache_reserve_segment(struct block_cache *bc, off_t offset, uint8_t **data);
+int block_cache_commit_segment(struct block_cache *bc, off_t offset);
+int block_cache_zero(struct block_cache *bc, off_t offset, off_t count, bool *zeroed);
+int block_cache_copy_from_fd(struct block_cache *bc, int in_fd, off_t in_offset, off_t count, off_t offset);
 int block_cache_flush(struct block_cache *bc);
+int block_cache_barrier(struct block_cache *bc);
 void block_cache_reset(struct block_cache *bc);
 int block_cache_free(struct block_cache *bc);
+void block_cache_add_follower(struct block_cache *bc, struct block_cache *follower);
+void block_cache_drop_follower(struct block_cache *follower);
+bool block_cache_is_known_zero(struct block_cache *bc, off_t offset, size_t count);
+void block_cache_track_changes(struct block_cache *bc);
+bool block_cache_changed(struct block_cache *bc, off_t offset, off_t count);
+void block_cache_clear_changes(struct block_cache *bc);
+void block_cache_track_written(struct block_cache *bc);
+bool block_cache_was_written(struct block_cache *bc, off_t offset, off_t count);
+int block_cache_dry_run(struct block_cache *bc, struct block_cache_stats *stats);
+void block_cache_stats_free(struct block_cache_stats *stats);
 
 #endif // BLOCK_CACHE_H
@@ -0,0 +1,290 @@
+/*
+ * Copyright 2026 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+
+#if HAVE_SPARSE_SEEK
+#define _GNU_SOURCE // for SEEK_DATA and SEEK_HOLE
+#endif
+
+#include "bmap.h"
+#include "block_cache.h"
+#include "sha256.h"
+#include "simple_string.h"
+#include "util.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * A bmap file lists the blocks in an image file that need to be copied. It
+ * lets bmaptool and similar programs skip everything else when flashing the
+ * image. See https://github.com/yoctoproject/bmaptool.
+ *
+ * fwup already knows which parts of the image it wrote and which it trimmed,
+ * so there's no need to scan the image for zeros. Zeros that fwup wrote are
+ * mapped since they're usually there to erase something. Only the mapped
+ * blocks are read to compute their checksums.
+ */
+
+#define BMAP_READ_SIZE (1024 * 1024)
+
+struct bmap_range {
+    off_t first; // block numbers (inclusive)
+    off_t last;
+    uint8_t digest[SHA256_LEN];
+};
+
+struct bmap {
+    struct bmap_range *ranges;
+    size_t count;
+    size_t capacity;
+};
+
+static void add_block(struct bmap *map, off_t block)
+{
+    if (map->count > 0 && map->ranges[map->count - 1].last + 1 == block) {
+        map->ranges[map->count - 1].last = block;
+        return;
+    }
+
+    if (map->count == map->capacity) {
+        map->capacity = map->capacity ? map->capacity * 2 : 64;
+        map->ranges = realloc(map->ranges, map->capacity * sizeof(struct bmap_range));
+        if (!map->ranges)
+            fwup_err(EXIT_FAILURE, "realloc");
+    }
+    map->ranges[map->count].first = block;
+    map->ranges[map->count].last = block;
+    map->count++;
+}
+
+/**
+ * Find the next range of the file that the filesystem has data for
+ *
+ * Holes that were in the file before fwup started or that fwup made are
+ * skipped this way. Without support for sparse files, the whole file is
+ * treated as data.
+ */
+static void find_data(int fd, off_t offset, off_t image_size, off_t *data_start, off_t *data_end)
+{
+#if HAVE_SPARSE_SEEK
+    off_t start = lseek(fd, offset, SEEK_DATA);
+    if (start < 0) {
+        // ENXIO means that there's no more data. Anything else means that
+        // it's unknown so everything has to be copied.
+        *data_start = errno == ENXIO ? image_size : offset;
+        *data_end = image_size;
+        return;
+    }
+
+    off_t end = lseek(fd, start, SEEK_HOLE);
+    *data_start = start;
+    *data_end = (end < 0 || end > image_size) ? image_size : end;
+#else
+    (void) fd;
+    *data_start = offset;
+    *data_end = image_size;
+#endif
+}
+
+static void map_blocks(struct bmap *map, struct block_cache *bc, off_t image_size)
+{
+    const struct block_cache_range_set *written = &bc->written;
+    size_t next_written = 0;
+    off_t offset = 0;
+    while (offset < image_size) {
+        off_t data_start;
+        off_t data_end;
+        find_data(bc->fd, offset, image_size, &data_start, &data_end);
+
+        // Zeros that fwup wrote on purpose, like a wiped U-Boot environment,
+        // may be holes now, but they still need to be copied over whatever
+        // is on the target device.
+        while (next_written < written->count && written->ranges[next_written].end <= offset)
+            next_written++;
+        if (next_written < written->count) {
+            const struct block_cache_range *range = &written->ranges[next_written];
+            off_t written_start = range->start > offset ? range->start : offset;
+            if (written_start < data_start) {
+                data_end = range->end < data_start ? range->end : data_start;
+                data_start = written_start;
+                if (data_end > image_size)
+                    data_end = image_size;
+            }
+        }
+        if (data_start >= image_size)
+            break;
+
+        // Blocks that fwup knows are zero since they were trimmed don't
+        // need to be copied even if they take up space in the file.
+        off_t first = data_start / BMAP_BLOCK_SIZE;
+        off_t last = (data_end - 1) / BMAP_BLOCK_SIZE;
+        for (off_t block = first; block <= last; block++) {
+            off_t block_offset = block * BMAP_BLOCK_SIZE;
+            off_t block_len = image_size - block_offset;
+            if (block_len > BMAP_BLOCK_SIZE)
+                block_len = BMAP_BLOCK_SIZE;
+
+            if (block_cache_was_written(bc, block_offset, block_len) ||
+                    !block_cache_is_known_zero(bc, block_offset, block_len))
+                add_block(map, block);
+        }
+
+        offset = (last + 1) * BMAP_BLOCK_SIZE;
+    }
+}
+
+static int checksum_ranges(struct bmap *map, int fd, off_t image_size)
+{
+    int rc = 0;
+    uint8_t *buffer = malloc(BMAP_READ_SIZE);
+    if (!buffer)
+        fwup_err(EXIT_FAILURE, "malloc");
+
+    for (size_t i = 0; i < map->count; i++) {
+        struct bmap_range *range = &map->ranges[i];
+        off_t offset = range->first * BMAP_BLOCK_SIZE;
+        off_t end = (range->last + 1) * BMAP_BLOCK_SIZE;
+        if (end > image_size)
+            end = image_size;
+
+        struct sha256_ctx ctx;
+        sha256_init(&ctx);
+        while (offset < end) {
+            size_t amount = end - offset > BMAP_READ_SIZE ? BMAP_READ_SIZE : (size_t) (end - offset);
+            ssize_t amount_read = pread(fd, buffer, amount, offset);
+            if (amount_read <= 0)
+                ERR_CLEANUP_MSG("read failed at offset %" PRId64 " when creating bmap", offset);
+
+            sha256_update(&ctx, buffer, amount_read);
+            offset += amount_read;
+        }
+        sha256_final(&ctx, range->digest);
+    }
+
+cleanup:
+    free(buffer);
+    return rc;
+}
+
+static void format_bmap(struct simple_string *s, const struct bmap *map, off_t image_size, off_t block_count, off_t mapped_count)
+{
+    char hex[SHA256_LEN * 2 + 1];
+
+    ssprintf(s, "<?xml version=\"1.0\" ?>\n");
+    ssprintf(s, "<!-- Block map created by fwup. Only the blocks listed in the BlockMap\n"
+                "     need to be copied to the target device. -->\n");
+    ssprintf(s, "<bmap version=\"2.0\">\n");
+    ssprintf(s, "    <ImageSize> %" PRId64 " </ImageSize>\n", (int64_t) image_size);
+    ssprintf(s, "    <BlockSize> %d </BlockSize>\n", BMAP_BLOCK_SIZE);
+    ssprintf(s, "    <BlocksCount> %" PRId64 " </BlocksCount>\n", (int64_t) block_count);
+    ssprintf(s, "    <MappedBlocksCount> %" PRId64 " </MappedBlocksCount>\n", (int64_t) mapped_count);
+    ssprintf(s, "    <ChecksumType> sha256 </ChecksumType>\n");
+
+    // The file checksum is calculated with zeros here and then filled in.
+    memset(hex, '0', SHA256_LEN * 2);
+    hex[SHA256_LEN * 2] = '\0';
+    ssprintf(s, "    <BmapFileChecksum> %s </BmapFileChecksum>\n", hex);
+
+    ssprintf(s, "    <BlockMap>\n");
+    for (size_t i = 0; i < map->count; i++) {
+        const struct bmap_range *range = &map->ranges[i];
+        bytes_to_hex(range->digest, hex, SHA256_LEN);
+        if (range->first == range->last)
+            ssprintf(s, "        <Range chksum=\"%s\"> %" PRId64 " </Range>\n", hex, (int64_t) range->first);
+        else
+            ssprintf(s, "        <Range chksum=\"%s\"> %" PRId64 "-%" PRId64 " </Range>\n", hex, (int64_t) range->first, (int64_t) range->last);
+    }
+    ssprintf(s, "    </BlockMap>\n");
+    ssprintf(s, "</bmap>\n");
+
+    if (!s->str)
+        fwup_err(EXIT_FAILURE, "simple_string");
+}
+
+static void fill_in_file_checksum(char *xml, size_t len)
+{
+    uint8_t digest[SHA256_LEN];
+    struct sha256_ctx ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, (const uint8_t *) xml, len);
+    sha256_final(&ctx, digest);
+
+    char hex[SHA256_LEN * 2 + 1];
+    bytes_to_hex(digest, hex, SHA256_LEN);
+
+    const char *tag = "<BmapFileChecksum> ";
+    char *p = strstr(xml, tag) + strlen(tag);
+    memcpy(p, hex, SHA256_LEN * 2);
+}
+
+/**
+ * @brief Write a bmap file for an image file
+ *
+ * The block cache must be flushed first so that everything is in the file.
+ *
+ * @param path where to write the bmap file
+ * @param bc the block cache for the image file
+ * @return 0 if successful
+ */
+int bmap_write(const char *path, struct block_cache *bc)
+{
+    int rc = 0;
+    struct bmap map;
+    memset(&map, 0, sizeof(map));
+    struct simple_string s;
+    simple_string_init(&s);
+    FILE *fp = NULL;
+
+    struct stat st;
+    if (fstat(bc->fd, &st) < 0)
+        ERR_CLEANUP_MSG("can't determine image size for bmap");
+
+    off_t image_size = st.st_size;
+    off_t block_count = (image_size + BMAP_BLOCK_SIZE - 1) / BMAP_BLOCK_SIZE;
+
+    map_blocks(&map, bc, image_size);
+    OK_OR_CLEANUP(checksum_ranges(&map, bc->fd, image_size));
+
+    off_t mapped_count = 0;
+    for (size_t i = 0; i < map.count; i++)
+        mapped_count += map.ranges[i].last - map.ranges[i].first + 1;
+
+    format_bmap(&s, &map, image_size, block_count, mapped_count);
+    size_t len = s.p - s.str;
+    fill_in_file_checksum(s.str, len);
+
+    fp = fopen(path, "w");
+    if (!fp)
+        ERR_CLEANUP_MSG("can't create '%s'", path);
+    if (fwrite(s.str, 1, len, fp) != len)
+        ERR_CLEANUP_MSG("error writing '%s'", path);
+
+cleanup:
+    if (fp && fclose(fp) != 0 && rc == 0) {
+        set_last_error("error writing '%s'", path);
+        rc = -1;
+    }
+    free(s.str);
+    free(map.ranges);
+    return rc;
+}
@@ -0,0 +1,27 @@
+/*
+ * Copyright 2026 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BMAP_H
+#define BMAP_H
+
+struct block_cache;
+
+// bmaptool's block size
+#define BMAP_BLOCK_SIZE 4096
+
+int bmap_write(const char *path, struct block_cache *bc);
+
+#endif // BMAP_H
@@ -26,6 +26,7 @@
 #include "3rdparty/semver.c/semver.h"
 #include "monocypher-ed25519.h"
 
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
 #include <archive.h>
@@ -68,6 +69,20 @@ static int cb_func(enum fun_context_type ctype, cfg_t *cfg, cfg_opt_t *opt, int
     for (i = 1; i < fctx.argc; i++)
         cfg_addlist(cfg, "funlist", 1, fctx.argv[i]);
 
+    // Catch functions that can't run in the order that they're listed
+    if (ctype == FUN_CONTEXT_FILE) {
+        struct fun_oplist oplist;
+        int rc = fun_compile_funlist(cfg_getopt(cfg, "funlist"), &oplist);
+        if (rc == 0) {
+            rc = fun_check_resource_oplist(&oplist, cfg_title(cfg));
+            fun_free_oplist(&oplist);
+        }
+        if (rc < 0) {
+            cfg_error(cfg, last_error());
+            return -1;
+        }
+    }
+
     return 0;
 }
 
@@ -332,6 +347,13 @@ static int cb_validate_file_resource(cfg_t *cfg, cfg_opt_t *opt)
         cfg_error(cfg, "only one of host-path or contents should be set for file-resource '%s'", cfg_title(sec));
         return -1;
     }
+    const char *compression = cfg_getstr(sec, "compression");
+    if (strcmp(compression, "auto") != 0 &&
+            strcmp(compression, "deflate") != 0 &&
+            strcmp(compression, "store") != 0) {
+        cfg_error(cfg, "compression must be auto, deflate, or store for file-resource '%s'", cfg_title(sec));
+        return -1;
+    }
 
     return add_file_resource_variables(path, sec);
 }
@@ -423,6 +445,7 @@ static cfg_opt_t file_resource_opts[] = {
     CFG_FUNC("include", &cb_include),
     CFG_STR("host-path", 0, CFGF_NONE),
     CFG_BOOL("skip-holes", cfg_false, CFGF_NONE),
+    CFG_STR("compression", "auto", CFGF_NONE),
 
 #if (SIZEOF_INT == 4 && SIZEOF_OFF_T > 4)
     // If we're on a 32-bit machine that has large file offsets,
@@ -439,6 +462,17 @@ static cfg_opt_t file_resource_opts[] = {
     CFG_STR("sha256", 0, CFGF_NONE), // Old hash for files - use blake2b-256 now
     CFG_INT("assert-size-lte", -1, CFGF_NONE),
     CFG_INT("assert-size-gte", -1, CFGF_NONE),
+    CFG_STR("chunk-seed-host-path", 0, CFGF_NONE),
+    CFG_STR_LIST("chunks", 0, CFGF_NONE),
+    CFG_BOOL("deduplicate", cfg_false, CFGF_NONE),
+    CFG_STR("duplicate-of", 0, CFGF_NONE),
+    CFG_STR("delta-source-host-path", 0, CFGF_NONE),
+    CFG_STR("delta-source-blake2b-256", 0, CFGF_NONE),
+#if (SIZEOF_INT == 4 && SIZEOF_OFF_T > 4)
+    CFG_FLOAT("delta-source-length", 0, CFGF_NONE), // See "length"
+#else
+    CFG_INT("delta-source-length", 0, CFGF_NONE),
+#endif
     CFG_IGNORE_UNKNOWN
     CFG_END()
 };
@@ -505,6 +539,7 @@ static cfg_opt_t uboot_environment_opts[] = {
     CFG_STR_LIST("funlist", 0, CFGF_NONE), \
     CFG_FUNC("include", &cb_include), \
     CFG_FUNC("raw_memset", CB), \
+    CFG_FUNC("raw_copy", CB), \
     CFG_FUNC("raw_write", CB), \
     CFG_FUNC("fat_mkfs", CB), \
     CFG_FUNC("fat_attrib", CB), \
@@ -548,6 +583,8 @@ static cfg_opt_t task_on_resource_opts[] = {
     CFG_INT("delta-source-raw-count", INT32_MAX, CFGF_NONE),
     CFG_STR("delta-source-fat-offset", 0, CFGF_NONE), // Special case: use a string to support unsigned 32-bit offsets on 32-bit machines
     CFG_STR("delta-source-fat-path", 0, CFGF_NONE),
+    CFG_STR("chunk-source-raw-offset", 0, CFGF_NONE), // String for the same reason as delta-source-raw-offset
+    CFG_INT("chunk-source-raw-count", INT32_MAX, CFGF_NONE),
     CFG_ON_EVENT_FUNCTIONS(cb_on_resource_func),
     CFG_END()
 };
@@ -565,6 +602,7 @@ static cfg_opt_t task_opts[] = {
     CFG_INT("require-partition1-offset", -1, CFGF_NONE), // Deprecated
     CFG_BOOL("require-unmounted-destination", cfg_false, CFGF_NONE), // Deprecated
     CFG_BOOL("verify-on-the-fly", cfg_false, CFGF_NONE), // Deprecated
+    CFG_BOOL("durability-barrier", cfg_true, CFGF_NONE),
     CFG_SEC("on-init", task_on_init_opts, CFGF_NONE),
     CFG_SEC("on-finish", task_on_finish_opts, CFGF_NONE),
     CFG_SEC("on-error", task_on_error_opts, CFGF_NONE),
@@ -669,6 +707,9 @@ cleanup:
  */
 int archive_read_all_data(struct archive *a, struct archive_entry *ae, char **buffer, off_t max_size, off_t *size_read)
 {
+    // Start small if the size isn't known and grow the buffer as needed
+    // so that a generous max_size doesn't cost anything.
+    off_t buf_size = 64 * 1024;
     if (archive_entry_size_is_set(ae)) {
         // Reading off disk case - we know the size a priori
         off_t total_size = archive_entry_size(ae);
@@ -678,20 +719,33 @@ int archive_read_all_data(struct archive *a, struct archive_entry *ae, char **bu
         // Only read up to max_size or as much as we have.
         if (total_size < max_size)
             max_size = total_size;
+        buf_size = max_size;
     }
+    if (buf_size > max_size)
+        buf_size = max_size;
+
+    char *buf = (char *) malloc(buf_size + 1);
+    if (!buf)
+        fwup_err(EXIT_FAILURE, "malloc");
+
+    off_t amount_read = 0;
+    while (amount_read < max_size) {
+        if (amount_read == buf_size) {
+            buf_size = buf_size * 2 < max_size ? buf_size * 2 : max_size;
+            char *new_buf = (char *) realloc(buf, buf_size + 1);
+            if (!new_buf)
+                fwup_err(EXIT_FAILURE, "realloc");
+            buf = new_buf;
+        }
 
-    char *buf = (char *) malloc(max_size + 1);
-
-    off_t size_left = max_size;
-    while (size_left > 0) {
-        off_t len = archive_read_data(a, &buf[max_size - size_left], size_left);
+        off_t len = archive_read_data(a, &buf[amount_read], buf_size - amount_read);
         if (len <= 0)
             break;
-        size_left -= len;
+        amount_read += len;
     }
 
-    *size_read = max_size - size_left;
-    buf[*size_read] = 0; // NULL terminate for convenience
+    *size_read = amount_read;
+    buf[amount_read] = 0; // NULL terminate for convenience
     *buffer = buf;
 
     return 0;
@@ -705,14 +759,16 @@ int cfgfile_parse_fw_ae(struct archive *a,
 {
     int rc = 0;
     char *meta_conf = NULL;
-    off_t max_meta_conf_size = 50000;
     off_t total_size;
 
-    if (archive_read_all_data(a, ae, &meta_conf, max_meta_conf_size, &total_size) < 0)
+    // Read one more byte than allowed to detect meta.conf files that are too big
+    if (archive_read_all_data(a, ae, &meta_conf, fwup_max_meta_conf_size + 1, &total_size) < 0)
         ERR_CLEANUP_MSG("Error reading meta.conf from archive.\n"
                         "Check for file corruption or libarchive built without zlib support");
-    if (total_size < 10 || total_size >= max_meta_conf_size)
-        ERR_CLEANUP_MSG("Unexpected meta.conf size: %d", total_size);
+    if (total_size < 10)
+        ERR_CLEANUP_MSG("Unexpected meta.conf size: %d", (int) total_size);
+    if (total_size > fwup_max_meta_conf_size)
+        ERR_CLEANUP_MSG("meta.conf is bigger than %" PRId64 " bytes. Try increasing --max-meta-conf-size.", (int64_t) fwup_max_meta_conf_size);
 
     // Check the signature on meta.conf if it has been signed
     if (*public_keys) {
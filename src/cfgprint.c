@@ -37,6 +37,10 @@
 //      and they contain host paths which may not be desirable to distribute
 //   8. Remove "file-resource|contents" attributes since they're converted to files
 //      during archive creation.
+//   9. Remove "file-resource|chunk-seed-host-path" attributes for the same reason as #7.
+//  10. Remove "file-resource|compression" attributes since they're only used during archive creation
+//  11. Remove "file-resource|deduplicate" attributes for the same reason as #10.
+//  12. Remove "file-resource|delta-source-host-path" attributes for the same reason as #7.
 //
 // Since fwup_cfg_to_string() is used to generate the meta.conf file in the generated
 // firmware images, it is important that it be work for the version of fwup applying
@@ -185,6 +189,10 @@ void fwup_cfg_opt_to_string(cfg_opt_t *opt, struct simple_string *s, bool scrub)
                 if (strcmp("host-path", opt->name) == 0 ||
                     strcmp("bootstrap-code-host-path", opt->name) == 0 ||
                     strcmp("contents", opt->name) == 0 ||
+                    strcmp("chunk-seed-host-path", opt->name) == 0 ||
+                    strcmp("delta-source-host-path", opt->name) == 0 ||
+                    strcmp("compression", opt->name) == 0 ||
+                    strcmp("deduplicate", opt->name) == 0 ||
                     strcmp("skip-holes", opt->name) == 0)
                     return;
 
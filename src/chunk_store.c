@@ -0,0 +1,367 @@
+/*
+ * Copyright 2026 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "chunk_store.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+/**
+ * The chunk store is a directory of chunks that were seen on previous runs.
+ * It lets chunked resources be applied even when the device doesn't have the
+ * chunks that the update expected. This is useful for programming stations
+ * that flash a series of near-identical images to blank devices.
+ *
+ * Chunks are files named by their BLAKE2b-256 digest in subdirectories named
+ * by the first byte of the digest. The modification time of each file is
+ * updated on use so that the least recently used chunks can be removed when
+ * the store gets too big.
+ */
+
+#define CHUNK_PATH_EXTRA (1 + 2 + 1 + FWUP_BLAKE2b_256_LEN * 2 + 32)
+
+static int make_directory(const char *path)
+{
+#ifdef _WIN32
+    int rc = mkdir(path);
+#else
+    int rc = mkdir(path, 0755);
+#endif
+    if (rc < 0 && errno != EEXIST)
+        ERR_RETURN("can't create chunk store directory '%s'", path);
+    return 0;
+}
+
+static void chunk_path(const struct chunk_store *store, const uint8_t *digest, char *path, size_t path_len)
+{
+    char hex[FWUP_BLAKE2b_256_LEN * 2 + 1];
+    bytes_to_hex(digest, hex, FWUP_BLAKE2b_256_LEN);
+    snprintf(path, path_len, "%s/%.2s/%s", store->path, hex, hex);
+}
+
+int chunk_store_init(struct chunk_store *store, const char *path, off_t max_size)
+{
+    store->path = strdup(path);
+    if (!store->path)
+        fwup_err(EXIT_FAILURE, "strdup");
+    store->max_size = max_size;
+
+    return make_directory(path);
+}
+
+void chunk_store_free(struct chunk_store *store)
+{
+    free(store->path);
+    store->path = NULL;
+}
+
+/**
+ * @brief Check if a chunk is in the store
+ *
+ * This marks the chunk as recently used.
+ *
+ * @param store
+ * @param digest the chunk's BLAKE2b-256 digest
+ * @param len the chunk's length
+ * @return true if the chunk is in the store
+ */
+bool chunk_store_has(struct chunk_store *store, const uint8_t *digest, size_t len)
+{
+    size_t path_len = strlen(store->path) + CHUNK_PATH_EXTRA;
+    char *path = malloc(path_len);
+    if (!path)
+        fwup_err(EXIT_FAILURE, "malloc");
+    chunk_path(store, digest, path, path_len);
+
+    struct stat st;
+    bool found = stat(path, &st) == 0 && st.st_size == (off_t) len;
+    if (found)
+        (void) utime(path, NULL);
+
+    free(path);
+    return found;
+}
+
+/**
+ * @brief Read a chunk from the store
+ *
+ * The contents are checked against the digest in case the store was modified.
+ *
+ * @param store
+ * @param digest the chunk's BLAKE2b-256 digest
+ * @param buffer where to store the chunk
+ * @param len the chunk's length
+ * @return 0 if successful
+ */
+int chunk_store_read(struct chunk_store *store, const uint8_t *digest, uint8_t *buffer, size_t len)
+{
+    int rc = 0;
+    size_t path_len = strlen(store->path) + CHUNK_PATH_EXTRA;
+    char *path = malloc(path_len);
+    if (!path)
+        fwup_err(EXIT_FAILURE, "malloc");
+    chunk_path(store, digest, path, path_len);
+
+    int fd = open(path, O_RDONLY | O_WIN32_BINARY);
+    if (fd < 0)
+        ERR_CLEANUP_MSG("can't open '%s'", path);
+
+    size_t amount_read = 0;
+    while (amount_read < len) {
+        ssize_t n = read(fd, buffer + amount_read, len - amount_read);
+        if (n <= 0) {
+            close(fd);
+            ERR_CLEANUP_MSG("error reading '%s'", path);
+        }
+        amount_read += n;
+    }
+    close(fd);
+
+    uint8_t actual_digest[FWUP_BLAKE2b_256_LEN];
+    crypto_blake2b_general(actual_digest, FWUP_BLAKE2b_256_LEN, NULL, 0, buffer, len);
+    if (memcmp(actual_digest, digest, FWUP_BLAKE2b_256_LEN) != 0) {
+        // Remove it so that it doesn't cause trouble next time.
+        unlink(path);
+        ERR_CLEANUP_MSG("chunk store file '%s' is corrupt", path);
+    }
+
+cleanup:
+    free(path);
+    return rc;
+}
+
+/**
+ * @brief Add a chunk to the store
+ *
+ * The store is only an optimization, so errors are ignored. Chunks are
+ * written to temporary files and renamed so that partially written chunks
+ * never show up if fwup is interrupted or multiple fwups share the store.
+ *
+ * @param store
+ * @param digest the chunk's BLAKE2b-256 digest
+ * @param buffer the chunk contents
+ * @param len the chunk's length
+ */
+void chunk_store_add(struct chunk_store *store, const uint8_t *digest, const uint8_t *buffer, size_t len)
+{
+    size_t path_len = strlen(store->path) + CHUNK_PATH_EXTRA;
+    char *path = malloc(path_len);
+    char *tmp_path = malloc(path_len);
+    if (!path || !tmp_path)
+        fwup_err(EXIT_FAILURE, "malloc");
+
+    chunk_path(store, digest, path, path_len);
+
+    struct stat st;
+    if (stat(path, &st) == 0 && st.st_size == (off_t) len) {
+        (void) utime(path, NULL);
+        goto cleanup;
+    }
+
+    // Create the subdirectory
+    snprintf(tmp_path, path_len, "%s/%.2s", store->path, path + strlen(store->path) + 1);
+    if (make_directory(tmp_path) < 0)
+        goto cleanup;
+
+    snprintf(tmp_path, path_len, "%s.%d.tmp", path, (int) getpid());
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_WIN32_BINARY, 0644);
+    if (fd < 0)
+        goto cleanup;
+
+    size_t amount_written = 0;
+    while (amount_written < len) {
+        ssize_t n = write(fd, buffer + amount_written, len - amount_written);
+        if (n <= 0)
+            break;
+        amount_written += n;
+    }
+    close(fd);
+
+    if (amount_written != len || rename(tmp_path, path) < 0) {
+        INFO("couldn't add chunk to store at '%s'", path);
+        unlink(tmp_path);
+    }
+
+cleanup:
+    free(tmp_path);
+    free(path);
+}
+
+struct store_entry {
+    char *path;
+    time_t mtime;
+    off_t size;
+};
+
+static int mtimecompare(const void *pa, const void *pb)
+{
+    const struct store_entry *a = (const struct store_entry *) pa;
+    const struct store_entry *b = (const struct store_entry *) pb;
+
+    if (a->mtime < b->mtime)
+        return -1;
+    else if (a->mtime > b->mtime)
+        return 1;
+    else
+        return 0;
+}
+
+/**
+ * @brief Remove the least recently used chunks until the store fits
+ *
+ * Like adding chunks, this is best effort.
+ *
+ * @param store
+ */
+void chunk_store_prune(struct chunk_store *store)
+{
+    struct store_entry *entries = NULL;
+    int count = 0;
+    int capacity = 0;
+    off_t total_size = 0;
+
+    DIR *top = opendir(store->path);
+    if (!top) {
+        INFO("can't open chunk store directory '%s'", store->path);
+        return;
+    }
+
+    struct dirent *subdir;
+    while ((subdir = readdir(top)) != NULL) {
+        if (subdir->d_name[0] == '.')
+            continue;
+
+        size_t subdir_path_len = strlen(store->path) + strlen(subdir->d_name) + 2;
+        char *subdir_path = malloc(subdir_path_len);
+        if (!subdir_path)
+            fwup_err(EXIT_FAILURE, "malloc");
+        snprintf(subdir_path, subdir_path_len, "%s/%s", store->path, subdir->d_name);
+
+        DIR *d = opendir(subdir_path);
+        struct dirent *de;
+        while (d && (de = readdir(d)) != NULL) {
+            if (de->d_name[0] == '.')
+                continue;
+
+            size_t path_len = subdir_path_len + strlen(de->d_name) + 1;
+            char *path = malloc(path_len);
+            if (!path)
+                fwup_err(EXIT_FAILURE, "malloc");
+            snprintf(path, path_len, "%s/%s", subdir_path, de->d_name);
+
+            struct stat st;
+            if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+                free(path);
+                continue;
+            }
+
+            if (count == capacity) {
+                capacity = capacity ? capacity * 2 : 256;
+                entries = realloc(entries, capacity * sizeof(struct store_entry));
+                if (!entries)
+                    fwup_err(EXIT_FAILURE, "realloc");
+            }
+            entries[count].path = path;
+            entries[count].mtime = st.st_mtime;
+            entries[count].size = st.st_size;
+            count++;
+            total_size += st.st_size;
+        }
+        if (d)
+            closedir(d);
+        free(subdir_path);
+    }
+    closedir(top);
+
+    qsort(entries, count, sizeof(struct store_entry), mtimecompare);
+    for (int i = 0; i < count && total_size > store->max_size; i++) {
+        if (unlink(entries[i].path) == 0)
+            total_size -= entries[i].size;
+    }
+
+    for (int i = 0; i < count; i++)
+        free(entries[i].path);
+    free(entries);
+}
+
+static int feeder_callback(void *cookie, off_t offset, size_t len, const uint8_t *digest)
+{
+    struct chunk_store_feeder *feeder = (struct chunk_store_feeder *) cookie;
+    (void) offset;
+
+    // The chunk always starts at the beginning of the buffer since
+    // everything before it has been removed.
+    chunk_store_add(feeder->store, digest, feeder->buffer, len);
+
+    feeder->len -= len;
+    memmove(feeder->buffer, feeder->buffer + len, feeder->len);
+    return 0;
+}
+
+void chunk_store_feeder_init(struct chunk_store_feeder *feeder, struct chunk_store *store)
+{
+    feeder->store = store;
+    feeder->buffer = malloc(CHUNK_MAX_SIZE);
+    if (!feeder->buffer)
+        fwup_err(EXIT_FAILURE, "malloc");
+    feeder->len = 0;
+    chunker_init(&feeder->chunker, feeder_callback, feeder);
+}
+
+/**
+ * @brief Add the next part of a stream to the store
+ *
+ * @param feeder
+ * @param data the data
+ * @param len how many bytes
+ * @return 0 if successful
+ */
+int chunk_store_feed(struct chunk_store_feeder *feeder, const uint8_t *data, size_t len)
+{
+    while (len > 0) {
+        // Only add as much as fits. The chunker cuts a chunk at
+        // CHUNK_MAX_SIZE, so there's always room for at least one byte.
+        size_t amount = CHUNK_MAX_SIZE - feeder->len;
+        if (amount > len)
+            amount = len;
+
+        memcpy(feeder->buffer + feeder->len, data, amount);
+        feeder->len += amount;
+        OK_OR_RETURN(chunker_update(&feeder->chunker, data, amount));
+
+        data += amount;
+        len -= amount;
+    }
+    return 0;
+}
+
+int chunk_store_feeder_final(struct chunk_store_feeder *feeder)
+{
+    return chunker_final(&feeder->chunker);
+}
+
+void chunk_store_feeder_free(struct chunk_store_feeder *feeder)
+{
+    free(feeder->buffer);
+    feeder->buffer = NULL;
+}
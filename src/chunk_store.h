@@ -0,0 +1,53 @@
+/*
+ * Copyright 2026 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CHUNK_STORE_H
+#define CHUNK_STORE_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "chunks.h"
+
+#define CHUNK_STORE_DEFAULT_MAX_SIZE (1024LL * 1024 * 1024)
+
+struct chunk_store {
+    char *path;
+    off_t max_size;
+};
+
+int chunk_store_init(struct chunk_store *store, const char *path, off_t max_size);
+void chunk_store_free(struct chunk_store *store);
+
+bool chunk_store_has(struct chunk_store *store, const uint8_t *digest, size_t len);
+int chunk_store_read(struct chunk_store *store, const uint8_t *digest, uint8_t *buffer, size_t len);
+void chunk_store_add(struct chunk_store *store, const uint8_t *digest, const uint8_t *buffer, size_t len);
+void chunk_store_prune(struct chunk_store *store);
+
+// Split a stream of data into chunks and add them to the store
+struct chunk_store_feeder {
+    struct chunk_store *store;
+    struct chunker chunker;
+    uint8_t *buffer;
+    size_t len;
+};
+
+void chunk_store_feeder_init(struct chunk_store_feeder *feeder, struct chunk_store *store);
+int chunk_store_feed(struct chunk_store_feeder *feeder, const uint8_t *data, size_t len);
+int chunk_store_feeder_final(struct chunk_store_feeder *feeder);
+void chunk_store_feeder_free(struct chunk_store_feeder *feeder);
+
+#endif // CHUNK_STORE_H
@@ -0,0 +1,435 @@
+/*
+ * Copyright 2026 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "chunks.h"
+#include "chunk_store.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Chunked resources are split into variable sized pieces with boundaries
+ * determined by their contents. A resource built from an image that's mostly
+ * the same as what's on the device only needs to include the chunks that
+ * differ. The rest are found by scanning a region of the device. Since chunk
+ * boundaries follow the data, inserting or changing bytes only affects the
+ * chunks around the change, and the device doesn't need to hold an exact copy
+ * of the image used to create the update.
+ *
+ * Boundaries are found with a gear hash like FastCDC. Each chunk is identified
+ * by its BLAKE2b-256 digest.
+ */
+
+#define CHUNK_SCAN_READ_SIZE (128 * 1024)
+
+static uint64_t gear_table[256];
+static bool gear_table_initialized = false;
+
+static void init_gear_table()
+{
+    // Use splitmix64 with a fixed seed so that every build of fwup computes
+    // the same table.
+    uint64_t x = 0x6677757063646300ULL;
+    for (int i = 0; i < 256; i++) {
+        x += 0x9e3779b97f4a7c15ULL;
+        uint64_t z = x;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear_table[i] = z ^ (z >> 31);
+    }
+    gear_table_initialized = true;
+}
+
+static void start_chunk(struct chunker *c)
+{
+    c->gear = 0;
+    c->len = 0;
+    crypto_blake2b_general_init(&c->hash_state, FWUP_BLAKE2b_256_LEN, NULL, 0);
+}
+
+static int emit_chunk(struct chunker *c)
+{
+    uint8_t digest[FWUP_BLAKE2b_256_LEN];
+    crypto_blake2b_final(&c->hash_state, digest);
+
+    size_t len = c->len;
+    off_t offset = c->offset;
+    c->offset += len;
+    start_chunk(c);
+
+    return c->callback(c->cookie, offset, len, digest);
+}
+
+void chunker_init(struct chunker *c, chunker_callback *callback, void *cookie)
+{
+    if (!gear_table_initialized)
+        init_gear_table();
+
+    c->offset = 0;
+    c->callback = callback;
+    c->cookie = cookie;
+    start_chunk(c);
+}
+
+int chunker_update(struct chunker *c, const uint8_t *buf, size_t len)
+{
+    size_t start = 0;
+    size_t i = 0;
+    while (i < len) {
+        // The gear hash only depends on the last 64 bytes, so skip ahead
+        // to where it starts to matter.
+        if (c->len < CHUNK_MIN_SIZE - 64) {
+            size_t skip = CHUNK_MIN_SIZE - 64 - c->len;
+            if (skip > len - i)
+                skip = len - i;
+            c->len += skip;
+            i += skip;
+            continue;
+        }
+
+        c->gear = (c->gear << 1) + gear_table[buf[i]];
+        c->len++;
+        i++;
+
+        if ((c->len >= CHUNK_MIN_SIZE && (c->gear & CHUNK_CUT_MASK) == 0) ||
+                c->len == CHUNK_MAX_SIZE) {
+            crypto_blake2b_update(&c->hash_state, &buf[start], i - start);
+            start = i;
+            OK_OR_RETURN(emit_chunk(c));
+        }
+    }
+    crypto_blake2b_update(&c->hash_state, &buf[start], len - start);
+    return 0;
+}
+
+int chunker_final(struct chunker *c)
+{
+    if (c->len > 0)
+        return emit_chunk(c);
+    else
+        return 0;
+}
+
+void chunk_list_init(struct chunk_list *list)
+{
+    list->chunks = NULL;
+    list->count = 0;
+    list->capacity = 0;
+}
+
+void chunk_list_free(struct chunk_list *list)
+{
+    free(list->chunks);
+    chunk_list_init(list);
+}
+
+struct chunk_info *chunk_list_add(struct chunk_list *list)
+{
+    if (list->count == list->capacity) {
+        int new_capacity = list->capacity ? list->capacity * 2 : 64;
+        struct chunk_info *new_chunks = realloc(list->chunks, new_capacity * sizeof(struct chunk_info));
+        if (!new_chunks)
+            fwup_err(EXIT_FAILURE, "realloc");
+
+        list->chunks = new_chunks;
+        list->capacity = new_capacity;
+    }
+
+    struct chunk_info *ci = &list->chunks[list->count++];
+    memset(ci, 0, sizeof(*ci));
+    ci->source_offset = -1;
+    return ci;
+}
+
+/**
+ * @brief Read the chunk list from a file-resource
+ *
+ * Chunks are stored in the "chunks" list as "s:<length>:<blake2b-256>" for
+ * chunks in the archive and "d:<length>:<blake2b-256>" for chunks to be found
+ * on the device.
+ *
+ * @param resource the cfg_t * to the resource
+ * @param list where to store the chunks
+ * @return 0 if successful
+ */
+int chunk_list_get_from_resource(cfg_t *resource, struct chunk_list *list)
+{
+    chunk_list_free(list);
+
+    int count = cfg_size(resource, "chunks");
+    for (int i = 0; i < count; i++) {
+        const char *entry = cfg_getnstr(resource, "chunks", i);
+        struct chunk_info *ci = chunk_list_add(list);
+
+        if ((entry[0] != 's' && entry[0] != 'd') || entry[1] != ':')
+            goto bad_entry;
+        ci->stored = (entry[0] == 's');
+
+        char *endptr;
+        unsigned long len = strtoul(&entry[2], &endptr, 10);
+        if (*endptr != ':' || len == 0 || len > CHUNK_MAX_SIZE)
+            goto bad_entry;
+        ci->len = len;
+
+        if (strlen(endptr + 1) != FWUP_BLAKE2b_256_LEN * 2 ||
+                hex_to_bytes(endptr + 1, ci->digest, FWUP_BLAKE2b_256_LEN) < 0)
+            goto bad_entry;
+    }
+    return 0;
+
+bad_entry:
+    chunk_list_free(list);
+    ERR_RETURN("invalid chunk list for file-resource '%s'", cfg_title(resource));
+}
+
+/**
+ * @brief Store a chunk list in a file-resource
+ *
+ * @param resource the cfg_t * to the resource
+ * @param list the chunks
+ * @return 0 if successful
+ */
+int chunk_list_set_in_resource(cfg_t *resource, const struct chunk_list *list)
+{
+    for (int i = 0; i < list->count; i++) {
+        const struct chunk_info *ci = &list->chunks[i];
+        char entry[32 + FWUP_BLAKE2b_256_LEN * 2 + 1];
+        int n = snprintf(entry, sizeof(entry), "%c:%d:", ci->stored ? 's' : 'd', (int) ci->len);
+        bytes_to_hex(ci->digest, &entry[n], FWUP_BLAKE2b_256_LEN);
+        cfg_setnstr(resource, "chunks", entry, i);
+    }
+    return 0;
+}
+
+/**
+ * @brief Return how many bytes of the chunked resource are in the archive
+ */
+off_t chunk_list_stored_size(const struct chunk_list *list)
+{
+    off_t size = 0;
+    for (int i = 0; i < list->count; i++) {
+        if (list->chunks[i].stored)
+            size += list->chunks[i].len;
+    }
+    return size;
+}
+
+static int digestcompare(const void *pa, const void *pb)
+{
+    const struct chunk_info *a = *((const struct chunk_info **) pa);
+    const struct chunk_info *b = *((const struct chunk_info **) pb);
+
+    return memcmp(a->digest, b->digest, FWUP_BLAKE2b_256_LEN);
+}
+
+int chunks_init(struct chunks_state *cs,
+                cfg_t *resource,
+                chunks_read_archive_block *read_archive,
+                chunks_pread_source *pread_source,
+                void *cookie,
+                struct chunk_store *store)
+{
+    memset(cs, 0, sizeof(*cs));
+    chunk_list_init(&cs->list);
+    OK_OR_RETURN(chunk_list_get_from_resource(resource, &cs->list));
+
+    cs->read_archive = read_archive;
+    cs->pread_source = pread_source;
+    cs->cookie = cookie;
+    cs->store = store;
+
+    cs->needed = malloc((cs->list.count ? cs->list.count : 1) * sizeof(struct chunk_info *));
+    cs->buffer = malloc(CHUNK_MAX_SIZE);
+    if (!cs->needed || !cs->buffer)
+        fwup_err(EXIT_FAILURE, "malloc");
+
+    for (int i = 0; i < cs->list.count; i++) {
+        if (!cs->list.chunks[i].stored)
+            cs->needed[cs->needed_count++] = &cs->list.chunks[i];
+    }
+    qsort(cs->needed, cs->needed_count, sizeof(struct chunk_info *), digestcompare);
+
+    return 0;
+}
+
+void chunks_free(struct chunks_state *cs)
+{
+    chunk_list_free(&cs->list);
+    free(cs->needed);
+    free(cs->buffer);
+    cs->needed = NULL;
+    cs->buffer = NULL;
+}
+
+static int scan_callback(void *cookie, off_t offset, size_t len, const uint8_t *digest)
+{
+    struct chunks_state *cs = (struct chunks_state *) cookie;
+
+    // Find the first needed chunk with this digest
+    int lo = 0;
+    int hi = cs->needed_count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (memcmp(cs->needed[mid]->digest, digest, FWUP_BLAKE2b_256_LEN) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    // The same chunk can be used more than once in a resource.
+    for (int i = lo;
+         i < cs->needed_count && memcmp(cs->needed[i]->digest, digest, FWUP_BLAKE2b_256_LEN) == 0;
+         i++) {
+        struct chunk_info *ci = cs->needed[i];
+        if (ci->source_offset < 0 && !ci->in_store && ci->len == len) {
+            ci->source_offset = offset;
+            cs->found_count++;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Find the chunks that aren't in the archive
+ *
+ * The chunk store is checked first if there is one. Everything else has to be
+ * on the device.
+ *
+ * @param cs
+ * @param count the number of bytes to scan starting at offset 0 of the source
+ * @return 0 if all chunks were found
+ */
+int chunks_scan_source(struct chunks_state *cs, off_t count)
+{
+    if (cs->needed_count == 0)
+        return 0;
+
+    if (cs->store) {
+        for (int i = 0; i < cs->needed_count; i++) {
+            struct chunk_info *ci = cs->needed[i];
+            if (chunk_store_has(cs->store, ci->digest, ci->len)) {
+                ci->in_store = true;
+                cs->found_count++;
+            }
+        }
+    }
+
+    struct chunker c;
+    chunker_init(&c, scan_callback, cs);
+
+    // Stop as soon as everything is found
+    off_t offset = 0;
+    while (offset < count && cs->found_count < cs->needed_count) {
+        size_t len = CHUNK_SCAN_READ_SIZE;
+        if ((off_t) len > count - offset)
+            len = (size_t) (count - offset);
+
+        OK_OR_RETURN(cs->pread_source(cs->cookie, cs->buffer, len, offset));
+        OK_OR_RETURN(chunker_update(&c, cs->buffer, len));
+        offset += len;
+    }
+    if (offset == count)
+        OK_OR_RETURN(chunker_final(&c));
+
+    if (cs->found_count < cs->needed_count)
+        ERR_RETURN("%d of %d chunks not found on the device%s. The update was made for different contents.",
+                   cs->needed_count - cs->found_count, cs->needed_count,
+                   cs->store ? " or in the chunk store" : "");
+
+    return 0;
+}
+
+/**
+ * @brief Read the next part of the chunked resource
+ *
+ * @param cs
+ * @param buffer a pointer to the data. It is valid until the next call.
+ * @param count the number of bytes or 0 at the end
+ * @return 0 if successful
+ */
+int chunks_read(struct chunks_state *cs, const void **buffer, size_t *count)
+{
+    if (cs->index == cs->list.count) {
+        *buffer = NULL;
+        *count = 0;
+        return 0;
+    }
+
+    struct chunk_info *ci = &cs->list.chunks[cs->index];
+    if (ci->stored) {
+        if (cs->archive_leftover_len == 0) {
+            const void *data;
+            size_t len;
+            OK_OR_RETURN(cs->read_archive(cs->cookie, &data, &len));
+            if (len == 0)
+                ERR_RETURN("unexpected end of chunked resource data");
+
+            cs->archive_leftover = (const uint8_t *) data;
+            cs->archive_leftover_len = len;
+        }
+
+        size_t len = ci->len - cs->offset_in_chunk;
+        if (len > cs->archive_leftover_len)
+            len = cs->archive_leftover_len;
+
+        *buffer = cs->archive_leftover;
+        *count = len;
+
+        // Collect the whole chunk to add it to the store. It's only added
+        // if it's correct so that a bad archive can't poison the store.
+        if (cs->store)
+            memcpy(cs->buffer + cs->offset_in_chunk, cs->archive_leftover, len);
+
+        cs->archive_leftover += len;
+        cs->archive_leftover_len -= len;
+        cs->offset_in_chunk += len;
+        if (cs->offset_in_chunk == ci->len) {
+            if (cs->store) {
+                uint8_t digest[FWUP_BLAKE2b_256_LEN];
+                crypto_blake2b_general(digest, FWUP_BLAKE2b_256_LEN, NULL, 0, cs->buffer, ci->len);
+                if (memcmp(digest, ci->digest, FWUP_BLAKE2b_256_LEN) == 0)
+                    chunk_store_add(cs->store, ci->digest, cs->buffer, ci->len);
+            }
+            cs->index++;
+            cs->offset_in_chunk = 0;
+        }
+        return 0;
+    }
+
+    if (ci->in_store) {
+        OK_OR_RETURN(chunk_store_read(cs->store, ci->digest, cs->buffer, ci->len));
+    } else {
+        if (ci->source_offset < 0)
+            ERR_RETURN("chunk %d not found on the device", cs->index);
+
+        OK_OR_RETURN(cs->pread_source(cs->cookie, cs->buffer, ci->len, ci->source_offset));
+
+        // Check the chunk again in case the source was overwritten since the scan.
+        uint8_t digest[FWUP_BLAKE2b_256_LEN];
+        crypto_blake2b_general(digest, FWUP_BLAKE2b_256_LEN, NULL, 0, cs->buffer, ci->len);
+        if (memcmp(digest, ci->digest, FWUP_BLAKE2b_256_LEN) != 0)
+            ERR_RETURN("chunk at source offset %" PRId64 " changed. Is the destination overlapping the source?", ci->source_offset);
+
+        if (cs->store)
+            chunk_store_add(cs->store, ci->digest, cs->buffer, ci->len);
+    }
+
+    *buffer = cs->buffer;
+    *count = ci->len;
+    cs->index++;
+    return 0;
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright 2026 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CHUNKS_H
+#define CHUNKS_H
+
+#include <confuse.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "util.h"
+#include "monocypher.h"
+
+// Content-defined chunking parameters. These are part of the .fw format,
+// since chunk boundaries have to be found the same way when creating and
+// applying updates.
+#define CHUNK_MIN_SIZE  (16 * 1024)
+#define CHUNK_MAX_SIZE  (256 * 1024)
+#define CHUNK_CUT_MASK  0xffff000000000000ULL // ~64 KiB average past the minimum
+
+typedef int (chunker_callback)(void *cookie, off_t offset, size_t len, const uint8_t *digest);
+
+struct chunker {
+    uint64_t gear;
+    off_t offset; // Offset of the current chunk
+    size_t len;   // Bytes in the current chunk so far
+    crypto_blake2b_ctx hash_state;
+
+    chunker_callback *callback;
+    void *cookie;
+};
+
+void chunker_init(struct chunker *c, chunker_callback *callback, void *cookie);
+int chunker_update(struct chunker *c, const uint8_t *buf, size_t len);
+int chunker_final(struct chunker *c);
+
+struct chunk_info {
+    uint8_t digest[FWUP_BLAKE2b_256_LEN];
+    size_t len;
+
+    // True if the chunk is in the archive. Otherwise it's expected to be
+    // found on the device.
+    bool stored;
+
+    // Where the chunk was found on the device or -1 if not found
+    off_t source_offset;
+
+    // True if the chunk will be read from the chunk store
+    bool in_store;
+};
+
+struct chunk_list {
+    struct chunk_info *chunks;
+    int count;
+    int capacity;
+};
+
+void chunk_list_init(struct chunk_list *list);
+void chunk_list_free(struct chunk_list *list);
+struct chunk_info *chunk_list_add(struct chunk_list *list);
+int chunk_list_get_from_resource(cfg_t *resource, struct chunk_list *list);
+int chunk_list_set_in_resource(cfg_t *resource, const struct chunk_list *list);
+off_t chunk_list_stored_size(const struct chunk_list *list);
+
+// Reassembling a chunked resource from the archive and the device. The archive
+// read interface matches the zero-copy API of libarchive like in fwup_xdelta3.h.
+typedef int (chunks_read_archive_block)(void *cookie, const void **buffer, size_t *count);
+typedef int (chunks_pread_source)(void *cookie, void *buffer, size_t count, off_t offset);
+
+struct chunk_store;
+
+struct chunks_state {
+    struct chunk_list list;
+
+    // Chunks to find on the device sorted by digest
+    struct chunk_info **needed;
+    int needed_count;
+    int found_count;
+
+    chunks_read_archive_block *read_archive;
+    chunks_pread_source *pread_source;
+    void *cookie;
+
+    // Optional store of chunks from previous runs (NULL if not used)
+    struct chunk_store *store;
+
+    int index;
+    size_t offset_in_chunk;
+    const uint8_t *archive_leftover;
+    size_t archive_leftover_len;
+
+    uint8_t *buffer;
+};
+
+int chunks_init(struct chunks_state *cs, cfg_t *resource, chunks_read_archive_block *read_archive, chunks_pread_source *pread_source, void *cookie, struct chunk_store *store);
+int chunks_scan_source(struct chunks_state *cs, off_t count);
+int chunks_read(struct chunks_state *cs, const void **buffer, size_t *count);
+void chunks_free(struct chunks_state *cs);
+
+#endif // CHUNKS_H
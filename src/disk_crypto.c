@@ -35,9 +35,25 @@ static void aes_cbc_plain_encrypt(struct disk_crypto *dc, uint32_t lba, const ui
 
     AES_CBC_encrypt_buffer(&ctx, output, FWUP_BLOCK_SIZE);
 }
+
+static void aes_cbc_plain_decrypt(struct disk_crypto *dc, uint32_t lba, const uint8_t *input, uint8_t *output)
+{
+    uint8_t iv[AES_BLOCKLEN] = {0};
+    copy_le32(iv, lba);
+
+    struct AES_ctx ctx;
+    AES_init_ctx_iv(&ctx, dc->key, iv);
+
+    if (output != input)
+        memcpy(output, input, FWUP_BLOCK_SIZE);
+
+    AES_CBC_decrypt_buffer(&ctx, output, FWUP_BLOCK_SIZE);
+}
+
 static int aes_cbc_plain_init(struct disk_crypto *dc, const char *secret_key)
 {
     dc->encrypt = aes_cbc_plain_encrypt;
+    dc->decrypt = aes_cbc_plain_decrypt;
 
     if (secret_key) {
         if (hex_to_bytes(secret_key, dc->key, AES_KEYLEN) == 0)
@@ -95,6 +111,27 @@ void disk_crypto_encrypt(struct disk_crypto *dc, const uint8_t *input, uint8_t *
     }
 }
 
+/**
+ * @brief disk_crypto_decrypt
+ * @param dc session info
+ * @param input
+ * @param output
+ * @param count the number of bytes to decrypt
+ * @param offset where the bytes were read from
+ */
+void disk_crypto_decrypt(struct disk_crypto *dc, const uint8_t *input, uint8_t *output, size_t count, off_t offset)
+{
+    uint32_t lba = (uint32_t) ((offset - dc->base_offset)/ FWUP_BLOCK_SIZE);
+    uint32_t last_lba = lba + (uint32_t) (count / FWUP_BLOCK_SIZE);
+
+    while (lba < last_lba) {
+        dc->decrypt(dc, lba, input, output);
+        lba++;
+        input += FWUP_BLOCK_SIZE;
+        output += FWUP_BLOCK_SIZE;
+    }
+}
+
 /**
  * Free resources associated with a disk crypto session
  *
@@ -21,15 +21,18 @@
 
 struct disk_crypto;
 typedef void (disk_crypto_encrypt_fun)(struct disk_crypto *dc, uint32_t lba, const uint8_t *input, uint8_t *output);
+typedef void (disk_crypto_decrypt_fun)(struct disk_crypto *dc, uint32_t lba, const uint8_t *input, uint8_t *output);
 
 struct disk_crypto {
     disk_crypto_encrypt_fun *encrypt;
+    disk_crypto_decrypt_fun *decrypt;
     uint8_t key[32];
     off_t base_offset;
 };
 
 int disk_crypto_init(struct disk_crypto *dc, const char *mode, const char *secret, off_t base_offset);
 void disk_crypto_encrypt(struct disk_crypto *dc, const uint8_t *input, uint8_t *output, size_t count, off_t offset);
+void disk_crypto_decrypt(struct disk_crypto *dc, const uint8_t *input, uint8_t *output, size_t count, off_t offset);
 void disk_crypto_free(struct disk_crypto *dc);
 
 #endif // EVAL_MATH_H
@@ -73,9 +73,16 @@ static FRESULT fatfs_error(const char *context, const char *filename, FRESULT rc
     return rc;
 }
 
+// Remounts flush the FAT cache, so dry runs report how many there were
+static void count_mount(struct block_cache *output)
+{
+    if (output->stats)
+        output->stats->fat_mounts++;
+}
+
 #define CHECK(CONTEXT, FILENAME, CMD) do { if (fatfs_error(CONTEXT, FILENAME, CMD) != FR_OK) return -1; } while (0)
 #define CHECK_CLEANUP(CONTEXT, FILENAME, CMD) do { if (fatfs_error(CONTEXT, FILENAME, CMD) != FR_OK) { rc = -1; goto cleanup; } } while (0)
-#define MAYBE_MOUNT(BLOCK_CACHE, BLOCK_OFFSET) do { if (output_ != BLOCK_CACHE || block_offset_ != BLOCK_OFFSET) { output_ = BLOCK_CACHE; block_offset_ = BLOCK_OFFSET; CHECK("fat_mount", NULL, f_mount(&fs_, "", 0)); } } while (0)
+#define MAYBE_MOUNT(BLOCK_CACHE, BLOCK_OFFSET) do { if (output_ != BLOCK_CACHE || block_offset_ != BLOCK_OFFSET) { output_ = BLOCK_CACHE; block_offset_ = BLOCK_OFFSET; count_mount(output_); CHECK("fat_mount", NULL, f_mount(&fs_, "", 0)); } } while (0)
 #define CHECK_SYNC(FILENAME, FIL) CHECK("sync", FILENAME, f_sync(FIL))
 
 /**
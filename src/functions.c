@@ -26,6 +26,7 @@
 #include "sparse_file.h"
 #include "progress.h"
 #include "pad_to_block_writer.h"
+#include "readback.h"
 
 #include <assert.h>
 #include <errno.h>
@@ -39,16 +40,48 @@
 
 #include "monocypher.h"
 
+/**
+ * Where a function that reads the resource in an on-resource sends the data
+ *
+ * Functions make one of these with their open_sink call. The data is passed
+ * to pwrite_callback and final_hole_callback, and then close_callback is
+ * called even if there was an error.
+ */
+struct resource_sink {
+    // NOTE: count_holes must match the value passed to process_resource_compute_progress.
+    bool count_holes;
+
+    int (*pwrite_callback)(void *cookie, const void *buf, size_t count, off_t offset);
+    int (*final_hole_callback)(void *cookie, off_t hole_size, off_t file_size);
+
+    // Only used if this is the only sink. NULL if not supported.
+    fun_window_callback window_callback;
+
+    // Finish writing and free the cookie. rc is the result so far. This
+    // returns rc if it's an error or its own result if not.
+    int (*close_callback)(void *cookie, int rc);
+
+    void *cookie;
+
+    // Where progress was last reported up to when counting holes
+    off_t last_offset;
+};
+
 #define DECLARE_FUN(FUN) \
     static int FUN ## _validate(struct fun_context *fctx); \
     static int FUN ## _compute_progress(struct fun_context *fctx); \
     static int FUN ## _run(struct fun_context *fctx)
 
-DECLARE_FUN(raw_write);
+#define DECLARE_SINK_FUN(FUN) \
+    DECLARE_FUN(FUN); \
+    static int FUN ## _open_sink(struct fun_context *fctx, struct resource_sink *sink)
+
+DECLARE_SINK_FUN(raw_write);
 DECLARE_FUN(raw_memset);
+DECLARE_FUN(raw_copy);
 DECLARE_FUN(fat_attrib);
 DECLARE_FUN(fat_mkfs);
-DECLARE_FUN(fat_write);
+DECLARE_SINK_FUN(fat_write);
 DECLARE_FUN(fat_mv);
 DECLARE_FUN(fat_rm);
 DECLARE_FUN(fat_cp);
@@ -64,8 +97,8 @@ DECLARE_FUN(uboot_unsetenv);
 DECLARE_FUN(uboot_recover);
 DECLARE_FUN(error);
 DECLARE_FUN(info);
-DECLARE_FUN(path_write);
-DECLARE_FUN(pipe_write);
+DECLARE_SINK_FUN(path_write);
+DECLARE_SINK_FUN(pipe_write);
 DECLARE_FUN(execute);
 
 struct fun_info {
@@ -73,16 +106,21 @@ struct fun_info {
     int (*validate)(struct fun_context *fctx);
     int (*compute_progress)(struct fun_context *fctx);
     int (*run)(struct fun_context *fctx);
+
+    // Functions that read the resource can share it in an on-resource. NULL if not.
+    int (*open_sink)(struct fun_context *fctx, struct resource_sink *sink);
 };
 
-#define FUN_INFO(FUN) {#FUN, FUN ## _validate, FUN ## _compute_progress, FUN ## _run}
-#define FUN_BANG_INFO(FUN) {#FUN "!", FUN ## _validate, FUN ## _compute_progress, FUN ## _run}
+#define FUN_INFO(FUN) {#FUN, FUN ## _validate, FUN ## _compute_progress, FUN ## _run, NULL}
+#define FUN_BANG_INFO(FUN) {#FUN "!", FUN ## _validate, FUN ## _compute_progress, FUN ## _run, NULL}
+#define FUN_SINK_INFO(FUN) {#FUN, FUN ## _validate, FUN ## _compute_progress, FUN ## _run, FUN ## _open_sink}
 static struct fun_info fun_table[] = {
-    FUN_INFO(raw_write),
+    FUN_SINK_INFO(raw_write),
     FUN_INFO(raw_memset),
+    FUN_INFO(raw_copy),
     FUN_INFO(fat_attrib),
     FUN_INFO(fat_mkfs),
-    FUN_INFO(fat_write),
+    FUN_SINK_INFO(fat_write),
     FUN_INFO(fat_mv),
     FUN_BANG_INFO(fat_mv),
     FUN_INFO(fat_rm),
@@ -100,12 +138,12 @@ static struct fun_info fun_table[] = {
     FUN_INFO(uboot_recover),
     FUN_INFO(error),
     FUN_INFO(info),
-    FUN_INFO(path_write),
-    FUN_INFO(pipe_write),
+    FUN_SINK_INFO(path_write),
+    FUN_SINK_INFO(pipe_write),
     FUN_INFO(execute),
 };
 
-static struct fun_info *lookup(int argc, const char **argv)
+static const struct fun_info *lookup(int argc, const char **argv)
 {
     if (argc < 1) {
         set_last_error("Not enough parameters");
@@ -123,6 +161,15 @@ static struct fun_info *lookup(int argc, const char **argv)
     return 0;
 }
 
+static const struct fun_info *resolve(struct fun_context *fctx)
+{
+    // Use the function that was looked up ahead of time if there is one
+    if (fctx->fun)
+        return fctx->fun;
+    else
+        return lookup(fctx->argc, fctx->argv);
+}
+
 /**
  * @brief Validate the parameters passed to the function
  *
@@ -133,7 +180,7 @@ static struct fun_info *lookup(int argc, const char **argv)
  */
 int fun_validate(struct fun_context *fctx)
 {
-    struct fun_info *fun = lookup(fctx->argc, fctx->argv);
+    const struct fun_info *fun = resolve(fctx);
     if (!fun)
         return -1;
 
@@ -150,7 +197,7 @@ int fun_validate(struct fun_context *fctx)
  */
 int fun_compute_progress(struct fun_context *fctx)
 {
-    struct fun_info *fun = lookup(fctx->argc, fctx->argv);
+    const struct fun_info *fun = resolve(fctx);
     if (!fun)
         return -1;
 
@@ -167,49 +214,201 @@ int fun_compute_progress(struct fun_context *fctx)
  */
 int fun_run(struct fun_context *fctx)
 {
-    struct fun_info *fun = lookup(fctx->argc, fctx->argv);
+    const struct fun_info *fun = resolve(fctx);
     if (!fun)
         return -1;
 
     return fun->run(fctx);
 }
 
-
 /**
- * @brief Run all of the functions in a funlist
- * @param fctx the context to use (argc and argv will be updated in it)
- * @param funlist the list
- * @param fun the function to execute (either fun_run or fun_compute_progress)
+ * @brief Convert a funlist to an oplist
+ *
+ * The funlist is a flat list of strings with each function call's argc
+ * followed by its arguments. The oplist splits this into calls and looks up
+ * the functions so that this doesn't need to be done each time the funlist
+ * is used.
+ *
+ * @param funlist the list (NULL is ok)
+ * @param oplist the result. Free with fun_free_oplist().
  * @return 0 if ok
  */
-int fun_apply_funlist(struct fun_context *fctx, cfg_opt_t *funlist, int (*fun)(struct fun_context *fctx))
-{
-    int ix = 0;
-    char *aritystr;
-    while ((aritystr = cfg_opt_getnstr(funlist, ix++)) != NULL) {
-        fctx->argc = strtoul(aritystr, NULL, 0);
-        if (fctx->argc <= 0 || fctx->argc > FUN_MAX_ARGS) {
-            set_last_error("Unexpected argc value in funlist");
-            return -1;
+int fun_compile_funlist(cfg_opt_t *funlist, struct fun_oplist *oplist)
+{
+    oplist->ops = NULL;
+    oplist->count = 0;
+
+    unsigned int num_strings = funlist ? cfg_opt_size(funlist) : 0;
+    unsigned int ix = 0;
+    int capacity = 0;
+    while (ix < num_strings) {
+        if (oplist->count == capacity) {
+            capacity = capacity ? capacity * 2 : 8;
+            struct fun_op *new_ops = realloc(oplist->ops, capacity * sizeof(struct fun_op));
+            if (!new_ops)
+                fwup_err(EXIT_FAILURE, "realloc");
+            oplist->ops = new_ops;
         }
-        int i;
-        for (i = 0; i < fctx->argc; i++) {
-            fctx->argv[i] = cfg_opt_getnstr(funlist, ix++);
-            if (fctx->argv[i] == NULL) {
-                set_last_error("Unexpected error with funlist");
-                return -1;
-            }
+        struct fun_op *op = &oplist->ops[oplist->count++];
+        memset(op, 0, sizeof(*op));
+
+        op->argc = strtoul(cfg_opt_getnstr(funlist, ix++), NULL, 0);
+        if (op->argc <= 0 || op->argc > FUN_MAX_ARGS || ix + op->argc > num_strings) {
+            fun_free_oplist(oplist);
+            ERR_RETURN("Unexpected argc value in funlist");
         }
-        // Clear out the rest of the argv entries to avoid confusion when debugging.
-        for (; i < FUN_MAX_ARGS; i++)
-            fctx->argv[i] = 0;
 
-        if (fun(fctx) < 0)
+        for (int i = 0; i < op->argc; i++)
+            op->argv[i] = cfg_opt_getnstr(funlist, ix++);
+
+        op->fun = lookup(op->argc, op->argv);
+        if (!op->fun) {
+            fun_free_oplist(oplist);
             return -1;
+        }
     }
     return 0;
 }
 
+static bool is_sink(const struct fun_op *op)
+{
+    return op->fun->open_sink != NULL;
+}
+
+// Find the first and one past the last op that reads the resource. Both are
+// oplist->count if none do.
+static void find_sinks(const struct fun_oplist *oplist, int *first, int *end)
+{
+    *first = oplist->count;
+    *end = oplist->count;
+    for (int i = 0; i < oplist->count; i++) {
+        if (is_sink(&oplist->ops[i])) {
+            if (*first == oplist->count)
+                *first = i;
+            *end = i + 1;
+        }
+    }
+}
+
+static void copy_ops(struct fun_op *to, const struct fun_op *from, int count, cfg_t *on_event, cfg_t *resource)
+{
+    for (int i = 0; i < count; i++) {
+        to[i] = from[i];
+        if (on_event) {
+            to[i].on_event = on_event;
+            to[i].resource = resource;
+        }
+    }
+}
+
+/**
+ * @brief Merge the ops from another event's oplist
+ *
+ * This lets several on-resource events run as one when they all consume the
+ * same data. The merged ops switch fctx->on_event to on_event and
+ * fctx->resource to resource when run.
+ *
+ * The data is written when the last op that reads it runs, so the ops that
+ * come before or after those in each event are kept before or after all of
+ * them. Each event's ops still run in their original order.
+ *
+ * @param oplist the list to merge into
+ * @param from the ops to merge
+ * @param on_event the event that from was compiled from
+ * @param resource the file-resource for on_event or NULL if not known
+ */
+void fun_merge_oplist(struct fun_oplist *oplist, const struct fun_oplist *from, cfg_t *on_event, cfg_t *resource)
+{
+    int count = oplist->count + from->count;
+    struct fun_op *new_ops = malloc((count ? count : 1) * sizeof(struct fun_op));
+    if (!new_ops)
+        fwup_err(EXIT_FAILURE, "malloc");
+
+    int first, end, from_first, from_end;
+    find_sinks(oplist, &first, &end);
+    find_sinks(from, &from_first, &from_end);
+
+    struct fun_op *op = new_ops;
+    copy_ops(op, oplist->ops, first, NULL, NULL);
+    op += first;
+    copy_ops(op, from->ops, from_first, on_event, resource);
+    op += from_first;
+    copy_ops(op, &oplist->ops[first], end - first, NULL, NULL);
+    op += end - first;
+    copy_ops(op, &from->ops[from_first], from_end - from_first, on_event, resource);
+    op += from_end - from_first;
+    copy_ops(op, &oplist->ops[end], oplist->count - end, NULL, NULL);
+    op += oplist->count - end;
+    copy_ops(op, &from->ops[from_end], from->count - from_end, on_event, resource);
+
+    free(oplist->ops);
+    oplist->ops = new_ops;
+    oplist->count = count;
+}
+
+/**
+ * @brief Check that an on-resource's ops can run in their order
+ *
+ * When more than one op reads the resource, the data is written when the
+ * last one is reached. Anything between them would run before the earlier
+ * ones had written, so only messages are allowed there.
+ *
+ * @param oplist the list
+ * @param resource_name the resource for error messages
+ * @return 0 if ok
+ */
+int fun_check_resource_oplist(const struct fun_oplist *oplist, const char *resource_name)
+{
+    int first, end;
+    find_sinks(oplist, &first, &end);
+
+    for (int i = first; i < end; i++) {
+        const struct fun_op *op = &oplist->ops[i];
+        if (!is_sink(op) && op->fun->run != info_run && op->fun->run != error_run)
+            ERR_RETURN("%s can't be between functions that write '%s' since they write at the same time. Move it before the first or after the last.",
+                       op->argv[0], resource_name);
+    }
+    return 0;
+}
+
+void fun_free_oplist(struct fun_oplist *oplist)
+{
+    free(oplist->ops);
+    oplist->ops = NULL;
+    oplist->count = 0;
+}
+
+/**
+ * @brief Run all of the functions in an oplist
+ * @param fctx the context to use (argc and argv will be updated in it)
+ * @param oplist the list
+ * @param fun the function to execute (either fun_run or fun_compute_progress)
+ * @return 0 if ok
+ */
+int fun_apply_oplist(struct fun_context *fctx, const struct fun_oplist *oplist, int (*fun)(struct fun_context *fctx))
+{
+    int rc = 0;
+    for (int i = 0; i < oplist->count; i++) {
+        const struct fun_op *op = &oplist->ops[i];
+
+        // The unused argv entries are NULL in the op so copy them too
+        // to avoid confusion when debugging.
+        fctx->argc = op->argc;
+        memcpy(fctx->argv, op->argv, sizeof(fctx->argv));
+        fctx->fun = op->fun;
+        if (op->on_event) {
+            fctx->on_event = op->on_event;
+            fctx->resource = op->resource;
+        }
+
+        rc = fun(fctx);
+        if (rc < 0)
+            break;
+    }
+    fctx->fun = NULL;
+    return rc;
+}
+
 /**
  * Helper function that is paired with process_resource() to compute
  * progress.
@@ -234,6 +433,18 @@ static int process_resource_compute_progress(struct fun_context *fctx, bool coun
 
     return 0;
 }
+/**
+ * Return the file-resource for the current on-resource event. It's normally
+ * been looked up already when the task was compiled.
+ */
+static cfg_t *event_resource(struct fun_context *fctx)
+{
+    if (fctx->resource)
+        return fctx->resource;
+
+    return cfg_gettsec(fctx->cfg, "file-resource", fctx->on_event->title);
+}
+
 /**
  * This is a helper function for reading a resource out of a file and doing
  * something with it. (Like write it somewhere)
@@ -244,13 +455,14 @@ static int process_resource_compute_progress(struct fun_context *fctx, bool coun
  *   3. Handles sparse resources
  *   4. Checks nit-picky issues and returns errors when detected
  *
- * NOTE: count_holes must match the value passed to process_resource_compute_progress.
+ * The data is read once and passed to each sink in order.
+ *
+ * If there's only one sink, it has a window_callback and the context
+ * supports it, the resource is decompressed into memory supplied by
+ * window_callback. The data is hashed in place and then passed to
+ * pwrite_callback with the window as its buffer.
  */
-static int process_resource(struct fun_context *fctx,
-                            bool count_holes,
-                            int (*pwrite_callback)(void *cookie, const void *buf, size_t count, off_t offset),
-                            int (*final_hole_callback)(void *cookie, off_t hole_size, off_t file_size),
-                            void *cookie)
+static int process_resource(struct fun_context *fctx, struct resource_sink *sinks, int sink_count)
 {
     assert(fctx->type == FUN_CONTEXT_FILE);
     assert(fctx->on_event);
@@ -259,7 +471,7 @@ static int process_resource(struct fun_context *fctx,
     struct sparse_file_map sfm;
     sparse_file_init(&sfm);
 
-    cfg_t *resource = cfg_gettsec(fctx->cfg, "file-resource", fctx->on_event->title);
+    cfg_t *resource = event_resource(fctx);
     if (!resource)
         ERR_CLEANUP_MSG("%s can't find file-resource '%s'", fctx->argv[0], fctx->on_event->title);
 
@@ -275,13 +487,19 @@ static int process_resource(struct fun_context *fctx,
     crypto_blake2b_ctx hash_state;
     crypto_blake2b_general_init(&hash_state, FWUP_BLAKE2b_256_LEN, NULL, 0);
 
-    off_t last_offset = 0;
+    fun_window_callback window_callback = sink_count == 1 ? sinks[0].window_callback : NULL;
+    for (int i = 0; i < sink_count; i++)
+        sinks[i].last_offset = 0;
+
     for (;;) {
         off_t offset;
         size_t len;
         const void *buffer;
 
-        OK_OR_CLEANUP(fctx->read(fctx, &buffer, &len, &offset));
+        if (window_callback && fctx->read_direct)
+            OK_OR_CLEANUP(fctx->read_direct(fctx, window_callback, sinks[0].cookie, &buffer, &len, &offset));
+        else
+            OK_OR_CLEANUP(fctx->read(fctx, &buffer, &len, &offset));
 
         // Check if done.
         if (len == 0)
@@ -289,34 +507,39 @@ static int process_resource(struct fun_context *fctx,
 
         crypto_blake2b_update(&hash_state, (const uint8_t*) buffer, len);
 
-        OK_OR_CLEANUP(pwrite_callback(cookie, buffer, len, offset));
-
         total_data_read += len;
-        if (!count_holes) {
-            // If not counting holes for progress reporting, then report
-            // that we wrote exactly what was read.
-            progress_report(fctx->progress, len);
-        } else {
-            // If counting holes for progress reporting, then report
-            // everything since the last time.
-            off_t next_offset_to_write = offset + len;
-            progress_report(fctx->progress, next_offset_to_write - last_offset);
-            last_offset = next_offset_to_write;
+        for (int i = 0; i < sink_count; i++) {
+            struct resource_sink *sink = &sinks[i];
+            OK_OR_CLEANUP(sink->pwrite_callback(sink->cookie, buffer, len, offset));
+
+            if (!sink->count_holes) {
+                // If not counting holes for progress reporting, then report
+                // that we wrote exactly what was read.
+                progress_report(fctx->progress, len);
+            } else {
+                // If counting holes for progress reporting, then report
+                // everything since the last time.
+                off_t next_offset_to_write = offset + len;
+                progress_report(fctx->progress, next_offset_to_write - sink->last_offset);
+                sink->last_offset = next_offset_to_write;
+            }
         }
     }
 
     // Handle a final hole in a sparse file
     off_t ending_hole = sparse_ending_hole_size(&sfm);
     if (ending_hole > 0) {
-        OK_OR_CLEANUP(final_hole_callback(cookie, ending_hole, sparse_file_size(&sfm)));
+        for (int i = 0; i < sink_count; i++) {
+            OK_OR_CLEANUP(sinks[i].final_hole_callback(sinks[i].cookie, ending_hole, sparse_file_size(&sfm)));
 
-        if (count_holes)
-            progress_report(fctx->progress, ending_hole);
+            if (sinks[i].count_holes)
+                progress_report(fctx->progress, ending_hole);
+        }
     }
 
     if (total_data_read != expected_data_length) {
         if (total_data_read == 0)
-            ERR_CLEANUP_MSG("%s didn't write anything and was likely called twice in an on-resource for '%s'. Try a \"cp\" function.", fctx->argv[0], fctx->on_event->title);
+            ERR_CLEANUP_MSG("%s didn't get any data for '%s'", fctx->argv[0], fctx->on_event->title);
         else
             ERR_CLEANUP_MSG("%s wrote %" PRId64" bytes for '%s', but should have written %" PRId64, fctx->argv[0], total_data_read, fctx->on_event->title, expected_data_length);
     }
@@ -334,6 +557,97 @@ cleanup:
     return rc;
 }
 
+/**
+ * Run a function that reads the resource when it's the only one in the
+ * on-resource that does
+ */
+static int write_resource(struct fun_context *fctx, int (*open_sink)(struct fun_context *fctx, struct resource_sink *sink))
+{
+    struct resource_sink sink;
+    OK_OR_RETURN(open_sink(fctx, &sink));
+
+    int rc = process_resource(fctx, &sink, 1);
+    return sink.close_callback(sink.cookie, rc);
+}
+
+/**
+ * @brief Run the functions in an on-resource's oplist
+ *
+ * If more than one function reads the resource, it's only read once. Each of
+ * those functions gets ready for the data when it's reached in the list. The
+ * data is passed to all of them when the last one is reached. This makes it
+ * possible to write a resource to more than one place, like the A and B
+ * partitions, with one pass through the archive and one hash check. Only
+ * info() and error() can be between them. See fun_check_resource_oplist().
+ *
+ * @param fctx the context to use (argc and argv will be updated in it)
+ * @param oplist the list
+ * @return 0 if ok
+ */
+int fun_apply_resource_oplist(struct fun_context *fctx, const struct fun_oplist *oplist)
+{
+    int sink_count = 0;
+    int fat_write_count = 0;
+    for (int i = 0; i < oplist->count; i++) {
+        if (oplist->ops[i].fun->open_sink)
+            sink_count++;
+        if (oplist->ops[i].fun->open_sink == fat_write_open_sink)
+            fat_write_count++;
+    }
+
+    // fatfs only keeps one file open, so writes to two FAT files would
+    // close, reopen and seek through the cluster chain on every chunk.
+    if (fat_write_count > 1)
+        ERR_RETURN("Only one fat_write of '%s' is supported. Use fat_cp to make more copies.", fctx->on_event->title);
+
+    OK_OR_RETURN(fun_check_resource_oplist(oplist, fctx->on_event->title));
+
+    if (sink_count < 2)
+        return fun_apply_oplist(fctx, oplist, fun_run);
+
+    struct resource_sink *sinks = calloc(sink_count, sizeof(struct resource_sink));
+    if (!sinks)
+        fwup_err(EXIT_FAILURE, "calloc");
+
+    int rc = 0;
+    int open_count = 0;
+    for (int i = 0; i < oplist->count; i++) {
+        const struct fun_op *op = &oplist->ops[i];
+
+        fctx->argc = op->argc;
+        memcpy(fctx->argv, op->argv, sizeof(fctx->argv));
+        fctx->fun = op->fun;
+        if (op->on_event) {
+            fctx->on_event = op->on_event;
+            fctx->resource = op->resource;
+        }
+
+        if (!op->fun->open_sink) {
+            rc = op->fun->run(fctx);
+        } else {
+            rc = op->fun->open_sink(fctx, &sinks[open_count]);
+            if (rc == 0 && ++open_count == sink_count) {
+                rc = process_resource(fctx, sinks, sink_count);
+
+                // Finish the writes before running anything else
+                for (int j = 0; j < open_count; j++)
+                    rc = sinks[j].close_callback(sinks[j].cookie, rc);
+                open_count = 0;
+            }
+        }
+        if (rc < 0)
+            break;
+    }
+
+    // Clean up after errors
+    for (int j = 0; j < open_count; j++)
+        sinks[j].close_callback(sinks[j].cookie, rc);
+
+    free(sinks);
+    fctx->fun = NULL;
+    return rc;
+}
+
 struct raw_write_options {
     const char *cipher;
     const char *secret;
@@ -391,12 +705,59 @@ int raw_write_compute_progress(struct fun_context *fctx)
     return process_resource_compute_progress(fctx, false);
 }
 struct raw_write_cookie {
+    struct fun_context *fctx;
     off_t dest_offset;
     struct pad_to_block_writer ptbw;
+
+    struct disk_crypto dc_info;
+    struct disk_crypto *dc;
+
+    // Segment reserved in the block cache for direct decompression
+    uint8_t *window;
+    off_t window_offset;
 };
+static int raw_write_window_callback(void *cookie, off_t offset, size_t count, void **window, size_t *window_len)
+{
+    struct raw_write_cookie *rwc = (struct raw_write_cookie *) cookie;
+    off_t dest = rwc->dest_offset + offset;
+    size_t into_segment = dest & ~BLOCK_CACHE_SEGMENT_MASK;
+
+    *window = NULL;
+    if (into_segment != 0) {
+        // Read up to the next segment boundary so that the following
+        // reads can go directly into the cache.
+        *window_len = BLOCK_CACHE_SEGMENT_SIZE - into_segment;
+        return 0;
+    }
+
+    *window_len = BLOCK_CACHE_SEGMENT_SIZE;
+    if (count < BLOCK_CACHE_SEGMENT_SIZE)
+        return 0;
+
+    // Write out any partial block from before so that it doesn't get
+    // written after this segment.
+    OK_OR_RETURN(ptbw_flush(&rwc->ptbw));
+    OK_OR_RETURN(block_cache_reserve_segment(rwc->ptbw.output, dest, &rwc->window));
+    rwc->window_offset = dest;
+    *window = rwc->window;
+    return 0;
+}
 static int raw_write_pwrite_callback(void *cookie, const void *buf, size_t count, off_t offset)
 {
     struct raw_write_cookie *rwc = (struct raw_write_cookie *) cookie;
+
+    if (rwc->window && buf == rwc->window) {
+        // The data was decompressed directly into the cache.
+        rwc->window = NULL;
+        if (count != BLOCK_CACHE_SEGMENT_SIZE)
+            ERR_RETURN("raw_write: unexpected end of resource data");
+
+        if (rwc->ptbw.dc)
+            disk_crypto_encrypt(rwc->ptbw.dc, buf, (uint8_t *) buf, count, rwc->window_offset);
+
+        return block_cache_commit_segment(rwc->ptbw.output, rwc->window_offset);
+    }
+
     return ptbw_pwrite(&rwc->ptbw, buf, count, rwc->dest_offset + offset);
 }
 static int raw_write_final_hole_callback(void *cookie, off_t hole_size, off_t file_size)
@@ -413,43 +774,226 @@ static int raw_write_final_hole_callback(void *cookie, off_t hole_size, off_t fi
     off_t offset = file_size - to_write;
     return ptbw_pwrite(&rwc->ptbw, zeros, to_write, rwc->dest_offset + offset);
 }
-int raw_write_run(struct fun_context *fctx)
+
+// Copies and fills that bypass the cache are done in pieces this big so
+// that progress updates
+#define RAW_COPY_SIZE (BLOCK_CACHE_SEGMENT_SIZE * BLOCK_CACHE_NUM_SEGMENTS)
+
+struct stored_hash {
+    int fd;
+    off_t offset;
+    off_t count;
+
+    bool ok;
+    unsigned char hash[FWUP_BLAKE2b_256_LEN];
+};
+static void *stored_hash_run(void *arg)
+{
+    struct stored_hash *sh = (struct stored_hash *) arg;
+    uint8_t *buffer = malloc(BLOCK_CACHE_SEGMENT_SIZE);
+    if (!buffer)
+        fwup_err(EXIT_FAILURE, "malloc");
+
+    crypto_blake2b_ctx hash_state;
+    crypto_blake2b_general_init(&hash_state, FWUP_BLAKE2b_256_LEN, NULL, 0);
+
+    sh->ok = true;
+    off_t hashed = 0;
+    while (hashed < sh->count) {
+        size_t amount = sh->count - hashed < BLOCK_CACHE_SEGMENT_SIZE ? (size_t) (sh->count - hashed) : BLOCK_CACHE_SEGMENT_SIZE;
+        ssize_t amount_read = pread(sh->fd, buffer, amount, sh->offset + hashed);
+        if (amount_read < 0 && errno == EINTR)
+            continue;
+        if (amount_read <= 0) {
+            sh->ok = false;
+            break;
+        }
+
+        crypto_blake2b_update(&hash_state, buffer, amount_read);
+        hashed += amount_read;
+    }
+
+    crypto_blake2b_final(&hash_state, sh->hash);
+    free(buffer);
+    return NULL;
+}
+
+/**
+ * Copy a resource that's stored uncompressed in the archive straight to the
+ * destination
+ *
+ * The block cache lets the kernel move the data and another thread hashes
+ * it from the page cache at the same time. Like process_resource(), the hash
+ * is only known to be good after everything has been written.
+ *
+ * @param copied set to true if the resource was copied. If false, use process_resource().
+ */
+static int raw_write_stored(struct fun_context *fctx, struct raw_write_cookie *rwc, bool *copied)
 {
     int rc = 0;
+    *copied = false;
+
+    if (!fctx->stored_data || rwc->ptbw.dc)
+        return 0;
+
+    // Let process_resource() report errors in the metadata
+    cfg_t *resource = event_resource(fctx);
+    char *expected_hash = resource ? cfg_getstr(resource, "blake2b-256") : NULL;
+    if (!expected_hash || strlen(expected_hash) != FWUP_BLAKE2b_256_LEN * 2)
+        return 0;
+
+    struct sparse_file_map sfm;
+    sparse_file_init(&sfm);
+    if (sparse_file_get_map_from_resource(resource, &sfm) < 0) {
+        sparse_file_free(&sfm);
+        return 0;
+    }
+
+    // Everything before the last data needs to be in whole blocks so that
+    // the copies stay block aligned.
+    int last_data_ix = (sfm.map_len - 1) & ~1;
+    for (int i = 0; i < last_data_ix; i++) {
+        if (sfm.map[i] % FWUP_BLOCK_SIZE)
+            goto cleanup;
+    }
+
+    struct stored_hash sh;
+    if (!fctx->stored_data(fctx, &sh.fd, &sh.offset))
+        goto cleanup;
+
+    *copied = true;
+    sh.count = sparse_file_data_size(&sfm);
+#if USE_PTHREADS
+    pthread_t hash_thread;
+    if (pthread_create(&hash_thread, NULL, stored_hash_run, &sh))
+        fwup_errx(EXIT_FAILURE, "pthread_create");
+#endif
+
+    off_t in_offset = sh.offset;
+    off_t offset = 0;
+    for (int i = 0; rc == 0 && i < sfm.map_len; i += 2) {
+        off_t len = sfm.map[i];
+        off_t aligned_len = len & ~((off_t) FWUP_BLOCK_SIZE - 1);
+
+        for (off_t done = 0; rc == 0 && done < aligned_len; ) {
+            off_t amount = aligned_len - done < RAW_COPY_SIZE ? aligned_len - done : RAW_COPY_SIZE;
+            rc = block_cache_copy_from_fd(fctx->output, sh.fd, in_offset + done, amount, rwc->dest_offset + offset + done);
+            progress_report(fctx->progress, amount);
+            done += amount;
+        }
+
+        if (rc == 0 && len > aligned_len) {
+            // The end of the resource gets padded to a block by the pad_to_block_writer
+            uint8_t tail[FWUP_BLOCK_SIZE];
+            size_t tail_len = (size_t) (len - aligned_len);
+            if (pread(sh.fd, tail, tail_len, in_offset + aligned_len) != (ssize_t) tail_len) {
+                set_last_error("raw_write: unexpected end of resource data for '%s'", fctx->on_event->title);
+                rc = -1;
+            } else {
+                rc = ptbw_pwrite(&rwc->ptbw, tail, tail_len, rwc->dest_offset + offset + aligned_len);
+                progress_report(fctx->progress, tail_len);
+            }
+        }
+
+        in_offset += len;
+        offset += len;
+        if (i + 1 < sfm.map_len)
+            offset += sfm.map[i + 1];
+    }
+
+    off_t ending_hole = sparse_ending_hole_size(&sfm);
+    if (rc == 0 && ending_hole > 0)
+        rc = raw_write_final_hole_callback(rwc, ending_hole, sparse_file_size(&sfm));
+
+#if USE_PTHREADS
+    pthread_join(hash_thread, NULL);
+#else
+    stored_hash_run(&sh);
+#endif
+    if (rc < 0)
+        goto cleanup;
+
+    if (!sh.ok)
+        ERR_CLEANUP_MSG("%s couldn't read '%s' from the archive", fctx->argv[0], fctx->on_event->title);
+
+    char hash_str[FWUP_BLAKE2b_256_LEN * 2 + 1];
+    bytes_to_hex(sh.hash, hash_str, FWUP_BLAKE2b_256_LEN);
+    if (memcmp(hash_str, expected_hash, sizeof(hash_str)) != 0)
+        ERR_CLEANUP_MSG("%s detected blake2b mismatch on '%s'", fctx->argv[0], fctx->on_event->title);
+
+cleanup:
+    sparse_file_free(&sfm);
+    return rc;
+}
+static int raw_write_close_callback(void *cookie, int rc)
+{
+    struct raw_write_cookie *rwc = (struct raw_write_cookie *) cookie;
+    struct fun_context *fctx = rwc->fctx;
+
+    OK_OR_CLEANUP(rc);
+    OK_OR_CLEANUP(ptbw_flush(&rwc->ptbw));
 
+    if (fctx->readback) {
+        cfg_t *resource = event_resource(fctx);
+        if (!resource)
+            ERR_CLEANUP_MSG("%s can't find file-resource '%s'", fctx->argv[0], fctx->on_event->title);
+
+        rc = readback_add(fctx->readback, fctx->output, resource, rwc->dest_offset, rwc->dc);
+    }
+
+cleanup:
+    if (rwc->dc)
+        disk_crypto_free(rwc->dc);
+
+    free(rwc);
+    return rc;
+}
+int raw_write_open_sink(struct fun_context *fctx, struct resource_sink *sink)
+{
     // Raw write runs all writes through pad_to_block_writer to guarantee
     // block size writes to the caching code no matter how the input resources
     // get decompressed.
 
-    struct raw_write_cookie rwc;
-    rwc.dest_offset = strtoull(fctx->argv[1], NULL, 0) * FWUP_BLOCK_SIZE;
-
     struct raw_write_options options;
     OK_OR_RETURN(parse_raw_write_options(fctx, &options));
 
-    struct disk_crypto dc_info;
-    struct disk_crypto *dc = NULL;
+    struct raw_write_cookie *rwc = calloc(1, sizeof(struct raw_write_cookie));
+    if (!rwc)
+        fwup_err(EXIT_FAILURE, "calloc");
+
+    rwc->fctx = fctx;
+    rwc->dest_offset = strtoull(fctx->argv[1], NULL, 0) * FWUP_BLOCK_SIZE;
+    rwc->window = NULL;
+    rwc->window_offset = 0;
+
+    rwc->dc = NULL;
     if (options.cipher) {
         // Can't fail since checked above
-        disk_crypto_init(&dc_info, options.cipher, options.secret, rwc.dest_offset);
-        dc = &dc_info;
+        disk_crypto_init(&rwc->dc_info, options.cipher, options.secret, rwc->dest_offset);
+        rwc->dc = &rwc->dc_info;
     }
 
-    ptbw_init(&rwc.ptbw, fctx->output, dc);
-
-    OK_OR_CLEANUP(process_resource(fctx,
-                                  false,
-                                  raw_write_pwrite_callback,
-                                  raw_write_final_hole_callback,
-                                  &rwc));
+    ptbw_init(&rwc->ptbw, fctx->output, rwc->dc);
 
-    rc = ptbw_flush(&rwc.ptbw);
+    sink->count_holes = false;
+    sink->pwrite_callback = raw_write_pwrite_callback;
+    sink->final_hole_callback = raw_write_final_hole_callback;
+    sink->window_callback = raw_write_window_callback;
+    sink->close_callback = raw_write_close_callback;
+    sink->cookie = rwc;
+    return 0;
+}
+int raw_write_run(struct fun_context *fctx)
+{
+    struct resource_sink sink;
+    OK_OR_RETURN(raw_write_open_sink(fctx, &sink));
 
-cleanup:
-    if (dc)
-        disk_crypto_free(dc);
+    bool copied;
+    int rc = raw_write_stored(fctx, (struct raw_write_cookie *) sink.cookie, &copied);
+    if (rc == 0 && !copied)
+        rc = process_resource(fctx, &sink, 1);
 
-    return rc;
+    return sink.close_callback(sink.cookie, rc);
 }
 
 int raw_memset_validate(struct fun_context *fctx)
@@ -477,26 +1021,194 @@ int raw_memset_compute_progress(struct fun_context *fctx)
 }
 int raw_memset_run(struct fun_context *fctx)
 {
-    const size_t block_size = FWUP_BLOCK_SIZE;
-
     off_t dest_offset = strtoull(fctx->argv[1], NULL, 0) * FWUP_BLOCK_SIZE;
     off_t count = strtoull(fctx->argv[2], NULL, 0) * FWUP_BLOCK_SIZE;
     int value = strtol(fctx->argv[3], NULL, 0);
-    char buffer[block_size];
-    memset(buffer, value, sizeof(buffer));
 
-    off_t len_written = 0;
-    off_t offset;
-    for (offset = 0; offset < count; offset += block_size) {
-        OK_OR_RETURN_MSG(block_cache_pwrite(fctx->output, buffer, block_size, dest_offset + offset, true),
-                         "raw_memset couldn't write %d bytes to offset %" PRId64, block_size, dest_offset + offset);
+    // Zeros usually don't need to be sent to the destination
+    if (value == 0) {
+        bool zeroed = false;
+        off_t offset = 0;
+        while (offset < count) {
+            // Keep the pieces segment aligned so that only the ends are partial
+            off_t dest = dest_offset + offset;
+            off_t amount = (dest & BLOCK_CACHE_SEGMENT_MASK) + RAW_COPY_SIZE - dest;
+            if (amount > count - offset)
+                amount = count - offset;
+
+            OK_OR_RETURN_MSG(block_cache_zero(fctx->output, dest, amount, &zeroed),
+                             "raw_memset couldn't zero %" PRId64 " bytes at offset %" PRId64, amount, dest);
+            if (!zeroed) {
+                // Write what's left
+                dest_offset += offset;
+                count -= offset;
+                break;
+            }
+            offset += amount;
+            progress_report(fctx->progress, amount);
+        }
+        if (zeroed)
+            return 0;
+    }
+
+    // Write a segment at a time so that the block cache can hand whole
+    // segments to its writer.
+    uint8_t *buffer = malloc(BLOCK_CACHE_SEGMENT_SIZE);
+    if (!buffer)
+        fwup_err(EXIT_FAILURE, "malloc");
+    memset(buffer, value, BLOCK_CACHE_SEGMENT_SIZE);
 
-        len_written += block_size;
-        progress_report(fctx->progress, block_size);
+    int rc = 0;
+    off_t offset = 0;
+    while (offset < count) {
+        // Line up with the cache's segments after the first write
+        off_t dest = dest_offset + offset;
+        size_t amount = BLOCK_CACHE_SEGMENT_SIZE - (dest & ~BLOCK_CACHE_SEGMENT_MASK);
+        if ((off_t) amount > count - offset)
+            amount = count - offset;
+
+        if (block_cache_pwrite(fctx->output, buffer, amount, dest, true) < 0)
+            ERR_CLEANUP_MSG("raw_memset couldn't write %d bytes to offset %" PRId64, (int) amount, dest);
+
+        offset += amount;
+        progress_report(fctx->progress, amount);
+    }
+
+cleanup:
+    free(buffer);
+    return rc;
+}
+
+struct raw_copy_options {
+    const char *blake2b_256;
+};
+static int parse_raw_copy_options(const struct fun_context *fctx, struct raw_copy_options *options)
+{
+    memset(options, 0, sizeof(*options));
+
+    for (int i = 4; i < fctx->argc; i++) {
+        const char *key;
+        const char *value;
+
+        key = fctx->argv[i];
+        value = strchr(key, '=');
+        if (!value)
+            ERR_RETURN("Expecting '=' for optional raw_copy parameter");
+
+        value++;
+
+        if (strncmp(key, "blake2b-256=", 12) == 0)
+            options->blake2b_256 = value;
+        else
+            ERR_RETURN("Unexpected parameter to raw_copy: %s", key);
+    }
+    return 0;
+}
+int raw_copy_validate(struct fun_context *fctx)
+{
+    if (fctx->argc < 4)
+        ERR_RETURN("raw_copy requires a source block offset, destination block offset, and block count");
+
+    CHECK_ARG_UINT64(fctx->argv[1], "raw_copy requires a non-negative integer source block offset");
+    CHECK_ARG_UINT64(fctx->argv[2], "raw_copy requires a non-negative integer destination block offset");
+    CHECK_ARG_UINT64_RANGE(fctx->argv[3], 1, INT64_MAX / FWUP_BLOCK_SIZE, "raw_copy requires a positive integer block count");
+
+    off_t src_block = strtoull(fctx->argv[1], NULL, 0);
+    off_t dest_block = strtoull(fctx->argv[2], NULL, 0);
+    off_t block_count = strtoull(fctx->argv[3], NULL, 0);
+    if (src_block < dest_block + block_count && dest_block < src_block + block_count)
+        ERR_RETURN("raw_copy source and destination can't overlap");
+
+    struct raw_copy_options options;
+    OK_OR_RETURN(parse_raw_copy_options(fctx, &options));
+
+    if (options.blake2b_256) {
+        uint8_t hash[FWUP_BLAKE2b_256_LEN];
+        if (strlen(options.blake2b_256) != FWUP_BLAKE2b_256_LEN * 2 ||
+                hex_to_bytes(options.blake2b_256, hash, sizeof(hash)) < 0)
+            ERR_RETURN("raw_copy requires blake2b-256 to be a %d character hex string", FWUP_BLAKE2b_256_LEN * 2);
     }
 
     return 0;
 }
+int raw_copy_compute_progress(struct fun_context *fctx)
+{
+    off_t block_count = strtoull(fctx->argv[3], NULL, 0);
+
+    // Count each byte as a progress unit
+    fctx->progress->total_units += block_count * FWUP_BLOCK_SIZE;
+
+    return 0;
+}
+int raw_copy_run(struct fun_context *fctx)
+{
+    off_t src_offset = strtoull(fctx->argv[1], NULL, 0) * FWUP_BLOCK_SIZE;
+    off_t dest_offset = strtoull(fctx->argv[2], NULL, 0) * FWUP_BLOCK_SIZE;
+    off_t count = strtoull(fctx->argv[3], NULL, 0) * FWUP_BLOCK_SIZE;
+
+    struct raw_copy_options options;
+    OK_OR_RETURN(parse_raw_copy_options(fctx, &options));
+
+    int rc = 0;
+    uint8_t *buffer;
+    uint8_t *first_buffer = NULL;
+    size_t first_len = 0;
+    alloc_page_aligned((void **) &buffer, BLOCK_CACHE_SEGMENT_SIZE);
+
+    // The source is hashed as it's copied so that it's only read once. The
+    // first chunk is held back until the hash checks out, so a bad source
+    // doesn't leave something that looks like a valid header behind.
+    crypto_blake2b_ctx hash_state;
+    crypto_blake2b_general_init(&hash_state, FWUP_BLAKE2b_256_LEN, NULL, 0);
+    if (options.blake2b_256)
+        alloc_page_aligned((void **) &first_buffer, BLOCK_CACHE_SEGMENT_SIZE);
+
+    // Copy in segment-sized chunks that are aligned to the destination's
+    // segments. The reads are sequential so the block cache reads ahead
+    // and full segment writes are started asynchronously.
+    off_t offset = 0;
+    while (offset < count) {
+        size_t into_segment = (dest_offset + offset) & ~BLOCK_CACHE_SEGMENT_MASK;
+        size_t len = BLOCK_CACHE_SEGMENT_SIZE - into_segment;
+        if ((off_t) len > count - offset)
+            len = (size_t) (count - offset);
+
+        uint8_t *chunk = (offset == 0 && first_buffer) ? first_buffer : buffer;
+        OK_OR_CLEANUP_MSG(block_cache_pread(fctx->output, chunk, len, src_offset + offset),
+                          "raw_copy couldn't read %d bytes from offset %" PRId64, (int) len, src_offset + offset);
+
+        if (options.blake2b_256)
+            crypto_blake2b_update(&hash_state, chunk, len);
+
+        if (chunk == first_buffer)
+            first_len = len;
+        else
+            OK_OR_CLEANUP_MSG(block_cache_pwrite(fctx->output, chunk, len, dest_offset + offset, true),
+                              "raw_copy couldn't write %d bytes to offset %" PRId64, (int) len, dest_offset + offset);
+
+        offset += len;
+        progress_report(fctx->progress, len);
+    }
+
+    if (options.blake2b_256) {
+        uint8_t hash[FWUP_BLAKE2b_256_LEN];
+        uint8_t expected_hash[FWUP_BLAKE2b_256_LEN];
+        crypto_blake2b_final(&hash_state, hash);
+        OK_OR_CLEANUP(hex_to_bytes(options.blake2b_256, expected_hash, sizeof(expected_hash)));
+        if (memcmp(hash, expected_hash, sizeof(hash)) != 0)
+            ERR_CLEANUP_MSG("raw_copy detected blake2b mismatch on source blocks %s-%" PRId64,
+                            fctx->argv[1], (src_offset + count) / FWUP_BLOCK_SIZE - 1);
+
+        OK_OR_CLEANUP_MSG(block_cache_pwrite(fctx->output, first_buffer, first_len, dest_offset, true),
+                          "raw_copy couldn't write %d bytes to offset %" PRId64, (int) first_len, dest_offset);
+    }
+
+cleanup:
+    free_page_aligned(buffer);
+    if (first_buffer)
+        free_page_aligned(first_buffer);
+    return rc;
+}
 
 int fat_mkfs_validate(struct fun_context *fctx)
 {
@@ -583,13 +1295,14 @@ int fat_write_compute_progress(struct fun_context *fctx)
 struct fat_write_cookie {
     struct fun_context *fctx;
     off_t block_offset;
+    const char *filename;
 };
 static int fat_write_pwrite_callback(void *cookie, const void *buf, size_t count, off_t offset)
 {
     struct fat_write_cookie *fwc = (struct fat_write_cookie *) cookie;
     struct fun_context *fctx = fwc->fctx;
 
-    return fatfs_pwrite(fctx->output, fwc->block_offset, fctx->argv[2], (int) offset, buf, count);
+    return fatfs_pwrite(fctx->output, fwc->block_offset, fwc->filename, (int) offset, buf, count);
 }
 static int fat_write_final_hole_callback(void *cookie, off_t hole_size, off_t file_size)
 {
@@ -599,22 +1312,38 @@ static int fat_write_final_hole_callback(void *cookie, off_t hole_size, off_t fi
     struct fun_context *fctx = fwc->fctx;
 
     // If the file ends in a hole, fatfs_pwrite can be used to grow it.
-    return fatfs_pwrite(fctx->output, fwc->block_offset, fctx->argv[2], (int) file_size, NULL, 0);
+    return fatfs_pwrite(fctx->output, fwc->block_offset, fwc->filename, (int) file_size, NULL, 0);
 }
-int fat_write_run(struct fun_context *fctx)
+static int fat_write_close_callback(void *cookie, int rc)
+{
+    free(cookie);
+    return rc;
+}
+int fat_write_open_sink(struct fun_context *fctx, struct resource_sink *sink)
 {
-    struct fat_write_cookie fwc;
-    fwc.fctx = fctx;
-    fwc.block_offset = strtoull(fctx->argv[1], NULL, 0);
+    off_t block_offset = strtoull(fctx->argv[1], NULL, 0);
 
     // Enforce truncation semantics if the file exists
-    OK_OR_RETURN(fatfs_truncate(fctx->output, fwc.block_offset, fctx->argv[2]));
-
-    return process_resource(fctx,
-                            true,
-                            fat_write_pwrite_callback,
-                            fat_write_final_hole_callback,
-                            &fwc);
+    OK_OR_RETURN(fatfs_truncate(fctx->output, block_offset, fctx->argv[2]));
+
+    struct fat_write_cookie *fwc = malloc(sizeof(struct fat_write_cookie));
+    if (!fwc)
+        fwup_err(EXIT_FAILURE, "malloc");
+    fwc->fctx = fctx;
+    fwc->block_offset = block_offset;
+    fwc->filename = fctx->argv[2];
+
+    sink->count_holes = true;
+    sink->pwrite_callback = fat_write_pwrite_callback;
+    sink->final_hole_callback = fat_write_final_hole_callback;
+    sink->window_callback = NULL;
+    sink->close_callback = fat_write_close_callback;
+    sink->cookie = fwc;
+    return 0;
+}
+int fat_write_run(struct fun_context *fctx)
+{
+    return write_resource(fctx, fat_write_open_sink);
 }
 
 int fat_mv_validate(struct fun_context *fctx)
@@ -1114,27 +1843,40 @@ static int path_write_final_hole_callback(void *cookie, off_t hole_size, off_t f
     char zero = 0;
     return path_write_pwrite_callback(cookie, &zero, 1, file_size - 1);
 }
-int path_write_run(struct fun_context *fctx)
+static int path_write_close_callback(void *cookie, int rc)
 {
-    OK_OR_RETURN(check_unsafe(fctx));
-
-    struct path_write_cookie pwc;
-    pwc.output_filename = fctx->argv[1];
-    pwc.fp = fopen(pwc.output_filename, "wb");
-    if (pwc.fp == NULL)
-        ERR_RETURN("path_write can't open '%s'", pwc.output_filename);
+    struct path_write_cookie *pwc = (struct path_write_cookie *) cookie;
 
-    int rc = 0;
-    OK_OR_CLEANUP(process_resource(fctx,
-                            false,
-                            path_write_pwrite_callback,
-                            path_write_final_hole_callback,
-                            &pwc));
-
-cleanup:
-    fclose(pwc.fp);
+    fclose(pwc->fp);
+    free(pwc);
     return rc;
 }
+int path_write_open_sink(struct fun_context *fctx, struct resource_sink *sink)
+{
+    OK_OR_RETURN(check_unsafe(fctx));
+
+    FILE *fp = fopen(fctx->argv[1], "wb");
+    if (fp == NULL)
+        ERR_RETURN("path_write can't open '%s'", fctx->argv[1]);
+
+    struct path_write_cookie *pwc = malloc(sizeof(struct path_write_cookie));
+    if (!pwc)
+        fwup_err(EXIT_FAILURE, "malloc");
+    pwc->output_filename = fctx->argv[1];
+    pwc->fp = fp;
+
+    sink->count_holes = false;
+    sink->pwrite_callback = path_write_pwrite_callback;
+    sink->final_hole_callback = path_write_final_hole_callback;
+    sink->window_callback = NULL;
+    sink->close_callback = path_write_close_callback;
+    sink->cookie = pwc;
+    return 0;
+}
+int path_write_run(struct fun_context *fctx)
+{
+    return write_resource(fctx, path_write_open_sink);
+}
 
 int pipe_write_validate(struct fun_context *fctx)
 {
@@ -1188,33 +1930,48 @@ static int pipe_write_final_hole_callback(void *cookie, off_t hole_size, off_t f
     char zero = 0;
     return pipe_write_pwrite_callback(cookie, &zero, 1, file_size - 1);
 }
-int pipe_write_run(struct fun_context *fctx)
+static int pipe_write_close_callback(void *cookie, int rc)
+{
+    struct pipe_write_cookie *pwc = (struct pipe_write_cookie *) cookie;
+
+    if (pclose(pwc->fp) != 0 && rc == 0) {
+        set_last_error("command '%s' returned an error to pipe_write", pwc->pipe_command);
+        rc = -1;
+    }
+
+    free(pwc);
+    return rc;
+}
+int pipe_write_open_sink(struct fun_context *fctx, struct resource_sink *sink)
 {
     OK_OR_RETURN(check_unsafe(fctx));
 
-    struct pipe_write_cookie pwc;
-    pwc.pipe_command = fctx->argv[1];
-    pwc.last_offset = 0;
 #if defined(_WIN32) || defined(__CYGWIN__)
-    pwc.fp = popen(pwc.pipe_command, "wb");
+    FILE *fp = popen(fctx->argv[1], "wb");
 #else
-    pwc.fp = popen(pwc.pipe_command, "w");
+    FILE *fp = popen(fctx->argv[1], "w");
 #endif
-    if (!pwc.fp)
-        ERR_RETURN("pipe_write can't run '%s'", pwc.pipe_command);
-
-    int rc = 0;
-    OK_OR_CLEANUP(process_resource(fctx,
-                            true,
-                            pipe_write_pwrite_callback,
-                            pipe_write_final_hole_callback,
-                            &pwc));
-
-cleanup:
-    if (pclose(pwc.fp) != 0)
-        ERR_RETURN("command '%s' returned an error to pipe_write", pwc.pipe_command);
-
-    return rc;
+    if (!fp)
+        ERR_RETURN("pipe_write can't run '%s'", fctx->argv[1]);
+
+    struct pipe_write_cookie *pwc = malloc(sizeof(struct pipe_write_cookie));
+    if (!pwc)
+        fwup_err(EXIT_FAILURE, "malloc");
+    pwc->pipe_command = fctx->argv[1];
+    pwc->last_offset = 0;
+    pwc->fp = fp;
+
+    sink->count_holes = true;
+    sink->pwrite_callback = pipe_write_pwrite_callback;
+    sink->final_hole_callback = pipe_write_final_hole_callback;
+    sink->window_callback = NULL;
+    sink->close_callback = pipe_write_close_callback;
+    sink->cookie = pwc;
+    return 0;
+}
+int pipe_write_run(struct fun_context *fctx)
+{
+    return write_resource(fctx, pipe_write_open_sink);
 }
 
 int execute_validate(struct fun_context *fctx)
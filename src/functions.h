@@ -34,6 +34,10 @@ enum fun_context_type {
 struct archive;
 struct fwup_progress;
 struct block_cache;
+struct fun_info;
+struct readback_list;
+
+typedef int (*fun_window_callback)(void *cookie, off_t offset, size_t count, void **window, size_t *window_len);
 
 struct fun_context {
     // Context of where the function is called
@@ -43,6 +47,9 @@ struct fun_context {
     int argc;
     const char *argv[FUN_MAX_ARGS];
 
+    // The function for argv[0] if already looked up (NULL if not)
+    const struct fun_info *fun;
+
     // Root meta.conf configuration
     cfg_t *cfg;
 
@@ -52,6 +59,9 @@ struct fun_context {
     // When processing events (on-init, on-resource, on-finish, etc.) this is that configuration
     cfg_t *on_event;
 
+    // The file-resource for an on-resource event if already looked up (NULL if not)
+    cfg_t *resource;
+
     // Progress reporting
     struct fwup_progress *progress;
 
@@ -59,6 +69,22 @@ struct fun_context {
     // no more data is available. If <0, then there's an error.
     int (*read)(struct fun_context *fctx, const void **buffer, size_t *len, off_t *offset);
 
+    // Like read, but lets the caller pick the memory to decompress into. Before
+    // reading, window_callback is passed the offset of the next data and how
+    // many contiguous bytes are left. It can return a window to fill and/or
+    // limit the read size. If it returns a NULL window, an internal buffer is
+    // used. NULL if not supported.
+    int (*read_direct)(struct fun_context *fctx,
+                       fun_window_callback window_callback,
+                       void *cookie,
+                       const void **buffer, size_t *len, off_t *offset);
+
+    // If the resource is stored uncompressed in a regular file, this gets
+    // the file and where the data starts so that it can be copied without
+    // reading it through libarchive. The resource counts as read afterwards.
+    // Returns false if that's not possible. NULL if not supported.
+    bool (*stored_data)(struct fun_context *fctx, int *fd, off_t *offset);
+
     // Output location (NULL if not opened yet.)
     struct block_cache *output;
 
@@ -67,12 +93,38 @@ struct fun_context {
     off_t xd_source_offset;
     size_t xd_source_count;
 
+    // Resources to read back before on-finish (NULL if not checking)
+    struct readback_list *readback;
+
     void *cookie;
 };
 
 int fun_validate(struct fun_context *fctx);
 int fun_compute_progress(struct fun_context *fctx);
 int fun_run(struct fun_context *fctx);
-int fun_apply_funlist(struct fun_context *fctx, cfg_opt_t *funlist, int (*fun)(struct fun_context *fctx));
+
+// A funlist that has been split up into calls with the functions looked up
+struct fun_op {
+    const struct fun_info *fun;
+    int argc;
+    const char *argv[FUN_MAX_ARGS];
+
+    // The event that the op came from if it was merged from another
+    // event's oplist. NULL to leave fctx->on_event alone.
+    cfg_t *on_event;
+    cfg_t *resource;
+};
+
+struct fun_oplist {
+    struct fun_op *ops;
+    int count;
+};
+
+int fun_compile_funlist(cfg_opt_t *funlist, struct fun_oplist *oplist);
+void fun_merge_oplist(struct fun_oplist *oplist, const struct fun_oplist *from, cfg_t *on_event, cfg_t *resource);
+int fun_check_resource_oplist(const struct fun_oplist *oplist, const char *resource_name);
+void fun_free_oplist(struct fun_oplist *oplist);
+int fun_apply_oplist(struct fun_context *fctx, const struct fun_oplist *oplist, int (*fun)(struct fun_context *fctx));
+int fun_apply_resource_oplist(struct fun_context *fctx, const struct fun_oplist *oplist);
 
 #endif // FUNCTIONS_H
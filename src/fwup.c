@@ -30,6 +30,7 @@
 
 #include "3rdparty/base64.h"
 #include "block_cache.h"
+#include "chunk_store.h"
 #include "mmc.h"
 #include "util.h"
 #include "fwup_apply.h"
@@ -39,6 +40,7 @@
 #include "fwup_genkeys.h"
 #include "fwup_sign.h"
 #include "fwup_verify.h"
+#include "io_plan.h"
 #include "progress.h"
 #include "simple_string.h"
 #include "sparse_file.h"
@@ -49,6 +51,7 @@ bool fwup_verbose = false;
 bool fwup_framing = false;
 bool fwup_unsafe = false;
 bool fwup_handshake_on_exit = false;
+off_t fwup_max_meta_conf_size = FWUP_DEFAULT_MAX_META_CONF_SIZE;
 enum fwup_progress_option fwup_progress_mode = PROGRESS_MODE_OFF;
 
 static bool quiet = false;
@@ -83,11 +86,17 @@ static void print_usage()
     printf("\n");
     printf("Options:\n");
     printf("  -a, --apply   Apply the firmware update\n");
+    printf("  --bmap <path> Write a bmap file for bmaptool when applying to an image file\n");
     printf("  -c, --create  Create the firmware update\n");
-    printf("  -d <file> Device file for the memory card\n");
+    printf("  --chunk-store <dir> Keep chunks from applying updates in <dir> for use by chunked resources later\n");
+    printf("  --chunk-store-max-size <bytes> Maximum size of the chunk store (default is 1 GiB)\n");
+    printf("  -d <file> Device file for the memory card (specify more than once to program several at a time)\n");
     printf("  -D, --detect List attached SDCards or MMC devices and their sizes\n");
+    printf("  --dry-run Apply without writing to the destination and print the I/O plan and a time estimate\n");
+    printf("  --dry-run-speeds <read>,<write> Destination speeds in MB/s for the dry run estimate (default is 20,10)\n");
     printf("  -E, --eject Eject removable media after successfully writing firmware.\n");
     printf("  --no-eject Do not eject media after writing firmware\n");
+    printf("  --no-sparse-output Write zeros to regular files rather than leaving holes\n");
     printf("  --enable-trim Enable use of the hardware TRIM command\n");
     printf("  --exit-handshake Send a Ctrl+Z on exit and wait for stdin to close (Erlang)\n");
     printf("  -f <fwup.conf> Specify the firmware update configuration file\n");
@@ -96,14 +105,17 @@ static void print_usage()
     printf("  -i <input.fw> Specify the input firmware update file (Use - for stdin)\n");
     printf("  -l, --list   List the available tasks in a firmware update\n");
     printf("  -m, --metadata   Print metadata in the firmware update\n");
+    printf("  --max-meta-conf-size <bytes> Maximum size of meta.conf to accept (default is 16 MiB)\n");
     printf("  -n   Report numeric progress\n");
     printf("  -o <output.fw> Specify the output file when creating an update (Use - for stdout)\n");
+    printf("  --previous-fw <old.fw> Reuse compressed resources that haven't changed from a previous firmware update when creating\n");
     printf("  -p, --public-key-file <keyfile> A public key file for verifying firmware updates (can specify multiple times)\n");
     printf("  --private-key <key> A private key for signing firmware updates\n");
     printf("  --progress-low <number> When displaying progress, this is the lowest number (normally 0 for 0%%)\n");
     printf("  --progress-high <number> When displaying progress, this is the highest number (normally 100 for 100%%)\n");
     printf("  --public-key <key> A public key for verifying firmware updates (can specify multiple times)\n");
     printf("  -q, --quiet   Quiet\n");
+    printf("  --readback-check Read back everything written by raw_write and check its hash before running on-finish\n");
     printf("  -s, --private-key-file <keyfile> A private key file for signing firmware updates\n");
     printf("  -S, --sign Sign an existing firmware file (specify -i and -o)\n");
     printf("  --sparse-check <path> Check if the OS and file system supports sparse files at path\n");
@@ -177,15 +189,28 @@ enum fwup_long_option_only_value {
     OPTION_UNSAFE,
     OPTION_VERSION,
     OPTION_VERIFY_WRITES,
-    OPTION_NO_VERIFY_WRITES
+    OPTION_NO_VERIFY_WRITES,
+    OPTION_CHUNK_STORE,
+    OPTION_CHUNK_STORE_MAX_SIZE,
+    OPTION_MAX_META_CONF_SIZE,
+    OPTION_NO_SPARSE_OUTPUT,
+    OPTION_BMAP,
+    OPTION_READBACK_CHECK,
+    OPTION_DRY_RUN,
+    OPTION_DRY_RUN_SPEEDS,
+    OPTION_PREVIOUS_FW
 };
 
 static struct option long_options[] = {
     {"apply",    no_argument,       0, 'a'},
     {"create",   no_argument,       0, 'c'},
     {"detect",   no_argument,       0, 'D'},
+    {"dry-run",  no_argument,       0, OPTION_DRY_RUN},
+    {"dry-run-speeds", required_argument, 0, OPTION_DRY_RUN_SPEEDS},
     {"eject",    no_argument,       0, 'E'},
     {"no-eject", no_argument,       0, OPTION_NO_EJECT},
+    {"no-sparse-output", no_argument, 0, OPTION_NO_SPARSE_OUTPUT},
+    {"bmap",     required_argument, 0, OPTION_BMAP},
     {"enable-trim", no_argument,    0, OPTION_ENABLE_TRIM},
     {"exit-handshake", no_argument, 0, OPTION_EXIT_HANDSHAKE},
     {"framing",  no_argument,       0, 'F'},
@@ -193,6 +218,7 @@ static struct option long_options[] = {
     {"help",     no_argument,       0, 'h'},
     {"list",     no_argument,       0, 'l'},
     {"metadata", no_argument,       0, 'm'},
+    {"previous-fw", required_argument, 0, OPTION_PREVIOUS_FW},
     {"private-key", required_argument, 0, OPTION_PRIVATE_KEY},
     {"private-key-file", required_argument, 0, 's'},
     {"public-key", required_argument, 0, OPTION_PUBLIC_KEY},
@@ -200,6 +226,7 @@ static struct option long_options[] = {
     {"progress-low", required_argument, 0, OPTION_PROGRESS_LOW},
     {"progress-high", required_argument, 0, OPTION_PROGRESS_HIGH},
     {"quiet",    no_argument,       0, 'q'},
+    {"readback-check", no_argument, 0, OPTION_READBACK_CHECK},
     {"sparse-check", required_argument, 0, OPTION_SPARSE_CHECK},
     {"sparse-check-size", required_argument, 0, OPTION_SPARSE_CHECK_SIZE},
     {"sign",     no_argument,       0, 'S'},
@@ -211,6 +238,9 @@ static struct option long_options[] = {
     {"verify",   no_argument,       0, 'V'},
     {"verify-writes", no_argument,  0, OPTION_VERIFY_WRITES},
     {"no-verify-writes", no_argument,  0, OPTION_NO_VERIFY_WRITES},
+    {"chunk-store", required_argument, 0, OPTION_CHUNK_STORE},
+    {"chunk-store-max-size", required_argument, 0, OPTION_CHUNK_STORE_MAX_SIZE},
+    {"max-meta-conf-size", required_argument, 0, OPTION_MAX_META_CONF_SIZE},
     {"version",  no_argument,       0, OPTION_VERSION},
     {0,          0,                 0, 0 }
 };
@@ -365,11 +395,145 @@ static void print_detected_devices()
     free(s.str);
 }
 
+/**
+ * Open a destination for applying an update
+ *
+ * Errors opening the destination exit the program.
+ */
+static void open_output(const char *mmc_device_path, bool unmount_first, bool enable_trim, struct fwup_apply_output *output)
+{
+    // Check if the mmc_device_path is really a special device. If
+    // we're just creating an image file, then don't try to unmount
+    // everything using it.
+    bool is_regular_file = will_be_regular_file(mmc_device_path);
+    int output_fd = -1;
+    off_t end_offset = -1;
+    if (is_regular_file) {
+        // This is a regular file, so open it the regular way.
+        output_fd = open(mmc_device_path, O_RDWR | O_CREAT | O_WIN32_BINARY, 0644);
+
+        if (output_fd >= 0) {
+            // Get the original file length
+            // NOTE: this call is not so interesting. The interesting one is for real
+            //       media, but we need to do it anyway. <= 0 means unknown.
+            end_offset = lseek(output_fd, 0, SEEK_END);
+
+            struct stat st;
+            if (fstat(output_fd, &st) < 0 || (st.st_mode & 0222) == 0) {
+                // The file permissions are read-only, but the user was able to
+                // open it writable. Root can do this. This is almost certainly
+                // a mistake so error out. Changing file permissions to make it
+                // writable is the way to get around this and the error message
+                // below describes it.
+                close(output_fd);
+                output_fd = -1;
+            }
+        }
+        if (enable_trim) {
+            fwup_warnx("ignoring --enable_trim since operating on a regular file");
+            enable_trim = false;
+        }
+    } else {
+        // Attempt to unmount everything using the device to avoid corrupting partitions.
+        // For partial updates, this just unmounts everything that can be unmounted. Errors
+        // are ignored, which is an hacky way of making this do what's necessary automatically.
+        // NOTE: It is possible in the future to scan the config file and just unmount partitions
+        //       that overlap what will be written.
+        if (unmount_first) {
+            if (mmc_umount_all(mmc_device_path) < 0)
+                fwup_exit(EXIT_FAILURE);
+        }
+
+        if (mmc_device_size(mmc_device_path, &end_offset) < 0)
+            fwup_warnx("Error deterimining the size of %s", mmc_device_path);
+
+        // Call out to platform-specific code to obtain a filehandle
+        output_fd = mmc_open(mmc_device_path);
+    }
+
+    // Trim the detected image size down to a multiple of the block cache
+    // segment size (128 KB) since since fwup only writes full blocks. If
+    // this isn't done, it is possible to write beyond the end of file.
+    end_offset &= ~(BLOCK_CACHE_SEGMENT_SIZE - 1);
+
+    // Make sure that the output opened successfully and don't allow the
+    // filehandle to be passed to child processes.
+    if (output_fd < 0) {
+        fprintf(stderr, "\n");
+        if (file_exists(mmc_device_path)) {
+            fwup_errx(EXIT_FAILURE, "Cannot open '%s' for output.\nCheck file permissions or the read-only tab if this is an SD Card.",
+                 mmc_device_path);
+        } else {
+            fwup_errx(EXIT_FAILURE, "Cannot create '%s'.\nCheck the path and permissions on the containing directory.",
+                 mmc_device_path);
+        }
+    }
+#ifdef HAVE_FCNTL
+    (void) fcntl(output_fd, F_SETFD, FD_CLOEXEC);
+#endif
+
+    output->name = mmc_device_path;
+    output->fd = output_fd;
+    output->end_offset = end_offset;
+    output->is_regular_file = is_regular_file;
+    output->enable_trim = enable_trim;
+
+    // Verify writes by default if not a regular file.
+    output->verify_writes = !is_regular_file;
+
+    // Leave holes in image files rather than filling them with zeros.
+    output->sparse_output = is_regular_file;
+    output->bmap_path = NULL;
+    output->dry_run = false;
+    output->dry_run_stats = NULL;
+    output->failed = false;
+}
+
+/**
+ * Open a destination for a dry run
+ *
+ * Nothing will be written, so it's opened read-only and nothing is unmounted.
+ * An image file that doesn't exist yet reads as zeros.
+ */
+static void open_dry_run_output(const char *mmc_device_path, bool enable_trim, struct fwup_apply_output *output)
+{
+    bool is_regular_file = will_be_regular_file(mmc_device_path);
+    off_t end_offset = -1;
+    int output_fd = open(mmc_device_path, O_RDONLY | O_WIN32_BINARY);
+    if (output_fd >= 0) {
+        if (is_regular_file)
+            end_offset = lseek(output_fd, 0, SEEK_END);
+        else if (mmc_device_size(mmc_device_path, &end_offset) < 0)
+            fwup_warnx("Error deterimining the size of %s", mmc_device_path);
+#ifdef HAVE_FCNTL
+        (void) fcntl(output_fd, F_SETFD, FD_CLOEXEC);
+#endif
+    } else if (!is_regular_file || file_exists(mmc_device_path)) {
+        fwup_errx(EXIT_FAILURE, "Cannot open '%s' for reading.", mmc_device_path);
+    }
+
+    // See open_output()
+    end_offset &= ~(BLOCK_CACHE_SEGMENT_SIZE - 1);
+
+    output->name = mmc_device_path;
+    output->fd = output_fd;
+    output->end_offset = end_offset;
+    output->is_regular_file = is_regular_file;
+    output->enable_trim = enable_trim && !is_regular_file;
+    output->verify_writes = false;
+    output->sparse_output = is_regular_file;
+    output->bmap_path = NULL;
+    output->dry_run = true;
+    output->dry_run_stats = NULL;
+    output->failed = false;
+}
+
 int main(int argc, char **argv)
 {
     int command = CMD_NONE;
 
-    char *mmc_device_path = NULL;
+    char *mmc_device_paths[FWUP_MAX_OUTPUTS];
+    int num_devices = 0;
     const char *input_filename = NULL;
     const char *output_filename = NULL;
     const char *task = NULL;
@@ -378,6 +542,7 @@ int main(int argc, char **argv)
     const char *sparse_check = NULL;
     int sparse_check_size = 4096; // Arbitrary default.
     int compression_level = 9; // 1 - 9
+    const char *previous_fw = NULL;
     bool accept_found_device = false;
 #endif
     unsigned char *signing_key = NULL;
@@ -399,6 +564,14 @@ int main(int argc, char **argv)
     int progress_low = 0;    // 0%
     int progress_high = 100; // to 100%
     int verify_writes = -1; // Use default (yes unless writing to a regular file)
+    bool sparse_output = true;
+    const char *bmap_path = NULL;
+    bool readback_check = false;
+    bool dry_run = false;
+    struct io_plan_model dry_run_model;
+    io_plan_model_init(&dry_run_model);
+    const char *chunk_store_path = NULL;
+    off_t chunk_store_max_size = CHUNK_STORE_DEFAULT_MAX_SIZE;
 
     if (argc == 1) {
         print_usage();
@@ -462,9 +635,15 @@ int main(int argc, char **argv)
             signing_key = parse_signing_key(optarg, strlen(optarg));
             easy_mode = false;
             break;
+        case OPTION_PREVIOUS_FW: // --previous-fw
+            previous_fw = optarg;
+            easy_mode = false;
+            break;
 #endif
         case 'd':
-            mmc_device_path = optarg;
+            if (num_devices == FWUP_MAX_OUTPUTS)
+                fwup_errx(EXIT_FAILURE, "too many devices. The max is %d", FWUP_MAX_OUTPUTS);
+            mmc_device_paths[num_devices++] = optarg;
             break;
         case 'D': // --detect
             print_detected_devices();
@@ -565,6 +744,31 @@ int main(int argc, char **argv)
         case OPTION_NO_VERIFY_WRITES: // --no-verify-writes
             verify_writes = false;
             break;
+        case OPTION_CHUNK_STORE: // --chunk-store
+            chunk_store_path = optarg;
+            break;
+        case OPTION_CHUNK_STORE_MAX_SIZE: // --chunk-store-max-size
+            chunk_store_max_size = strtoll(optarg, 0, 0);
+            break;
+        case OPTION_MAX_META_CONF_SIZE: // --max-meta-conf-size
+            fwup_max_meta_conf_size = strtoll(optarg, 0, 0);
+            break;
+        case OPTION_NO_SPARSE_OUTPUT: // --no-sparse-output
+            sparse_output = false;
+            break;
+        case OPTION_BMAP: // --bmap
+            bmap_path = optarg;
+            break;
+        case OPTION_READBACK_CHECK: // --readback-check
+            readback_check = true;
+            break;
+        case OPTION_DRY_RUN: // --dry-run
+            dry_run = true;
+            break;
+        case OPTION_DRY_RUN_SPEEDS: // --dry-run-speeds
+            if (io_plan_parse_speeds(&dry_run_model, optarg) < 0)
+                fwup_errx(EXIT_FAILURE, "%s", last_error());
+            break;
         default: /* '?' */
             print_usage();
             fwup_exit(EXIT_FAILURE);
@@ -612,9 +816,9 @@ int main(int argc, char **argv)
         if (!task)
             fwup_errx(EXIT_FAILURE, "specify a task (-t)");
 
-        if (!mmc_device_path) {
+        if (num_devices == 0) {
 #ifndef FWUP_MINIMAL
-            mmc_device_path = autoselect_and_confirm_mmc_device(accept_found_device, input_filename);
+            mmc_device_paths[num_devices++] = autoselect_and_confirm_mmc_device(accept_found_device, input_filename);
 #else
             fwup_errx(EXIT_FAILURE, "autodetection compiled out. specify a device (-d)");
 #endif
@@ -630,105 +834,84 @@ int main(int argc, char **argv)
         struct fwup_progress progress;
         progress_init(&progress, progress_low, progress_high);
 
-        // Check if the mmc_device_path is really a special device. If
-        // we're just creating an image file, then don't try to unmount
-        // everything using it.
-        bool is_regular_file = will_be_regular_file(mmc_device_path);
-        int output_fd = -1;
-        off_t end_offset = -1;
-        if (is_regular_file) {
-            // This is a regular file, so open it the regular way.
-            output_fd = open(mmc_device_path, O_RDWR | O_CREAT | O_WIN32_BINARY, 0644);
-
-            if (output_fd >= 0) {
-                // Get the original file length
-                // NOTE: this call is not so interesting. The interesting one is for real
-                //       media, but we need to do it anyway. <= 0 means unknown.
-                end_offset = lseek(output_fd, 0, SEEK_END);
-
-                struct stat st;
-                if (fstat(output_fd, &st) < 0 || (st.st_mode & 0222) == 0) {
-                    // The file permissions are read-only, but the user was able to
-                    // open it writable. Root can do this. This is almost certainly
-                    // a mistake so error out. Changing file permissions to make it
-                    // writable is the way to get around this and the error message
-                    // below describes it.
-                    close(output_fd);
-                    output_fd = -1;
-                }
-            }
-            if (enable_trim) {
-                fwup_warnx("ignoring --enable_trim since operating on a regular file");
-                enable_trim = false;
-            }
-        } else {
-            // Attempt to unmount everything using the device to avoid corrupting partitions.
-            // For partial updates, this just unmounts everything that can be unmounted. Errors
-            // are ignored, which is an hacky way of making this do what's necessary automatically.
-            // NOTE: It is possible in the future to scan the config file and just unmount partitions
-            //       that overlap what will be written.
-            if (unmount_first) {
-                if (mmc_umount_all(mmc_device_path) < 0)
-                    fwup_exit(EXIT_FAILURE);
-            }
+        // Dry runs only work when the block cache is the only thing that
+        // would change.
+        if (dry_run && (bmap_path || readback_check || chunk_store_path || fwup_unsafe))
+            fwup_errx(EXIT_FAILURE, "--dry-run can't be used with --bmap, --readback-check, --chunk-store, or --unsafe");
+
+        struct fwup_apply_output outputs[FWUP_MAX_OUTPUTS];
+        struct block_cache_stats dry_run_stats;
+        for (int i = 0; i < num_devices; i++) {
+            if (dry_run) {
+                // Everything gets the same writes, so only the first
+                // destination's plan is reported.
+                open_dry_run_output(mmc_device_paths[i], enable_trim, &outputs[i]);
+                if (i == 0)
+                    outputs[i].dry_run_stats = &dry_run_stats;
+            } else {
+                open_output(mmc_device_paths[i], unmount_first, enable_trim, &outputs[i]);
 
-            if (mmc_device_size(mmc_device_path, &end_offset) < 0)
-                fwup_warnx("Error deterimining the size of %s", mmc_device_path);
+                // If verify_writes wasn't set, then verify if not a regular file.
+                if (verify_writes >= 0)
+                    outputs[i].verify_writes = verify_writes;
+            }
 
-            // Call out to platform-specific code to obtain a filehandle
-            output_fd = mmc_open(mmc_device_path);
+            if (!sparse_output)
+                outputs[i].sparse_output = false;
         }
 
-        // Trim the detected image size down to a multiple of the block cache
-        // segment size (128 KB) since since fwup only writes full blocks. If
-        // this isn't done, it is possible to write beyond the end of file.
-        end_offset &= ~(BLOCK_CACHE_SEGMENT_SIZE - 1);
-
-        // Make sure that the output opened successfully and don't allow the
-        // filehandle to be passed to child processes.
-        if (output_fd < 0) {
-            fprintf(stderr, "\n");
-            if (file_exists(mmc_device_path)) {
-                fwup_errx(EXIT_FAILURE, "Cannot open '%s' for output.\nCheck file permissions or the read-only tab if this is an SD Card.",
-                     mmc_device_path);
-            } else {
-                fwup_errx(EXIT_FAILURE, "Cannot create '%s'.\nCheck the path and permissions on the containing directory.",
-                     mmc_device_path);
-            }
+        if (bmap_path) {
+            if (num_devices != 1 || !outputs[0].is_regular_file)
+                fwup_errx(EXIT_FAILURE, "--bmap only works when applying to one image file");
+            outputs[0].bmap_path = bmap_path;
         }
-#ifdef HAVE_FCNTL
-        (void) fcntl(output_fd, F_SETFD, FD_CLOEXEC);
-#endif
-
-        // If verify_writes wasn't set, then verify if not a regular file.
-        if (verify_writes < 0)
-            verify_writes = !is_regular_file;
 
         if (fwup_apply(input_filename,
                        task,
-                       output_fd,
-                       end_offset,
+                       outputs,
+                       num_devices,
                        &progress,
                        public_keys,
-                       enable_trim,
-                       verify_writes) < 0) {
+                       chunk_store_path,
+                       chunk_store_max_size,
+                       readback_check) < 0) {
             if (!quiet)
                 fprintf(stderr, "\n");
             fwup_errx(EXIT_FAILURE, "%s", last_error());
         }
 
-        if (!is_regular_file && eject_on_success) {
-            // On OSX, at least, the system complains bitterly if you don't eject the device when done.
-            // This just does whatever is needed so that the device can be removed.
-            mmc_eject(mmc_device_path);
+        int num_failed = 0;
+        for (int i = 0; i < num_devices; i++) {
+            if (outputs[i].failed) {
+                num_failed++;
+                continue;
+            }
+
+            if (!outputs[i].is_regular_file && eject_on_success && !dry_run) {
+                // On OSX, at least, the system complains bitterly if you don't eject the device when done.
+                // This just does whatever is needed so that the device can be removed.
+                mmc_eject(outputs[i].name);
+            }
+        }
+        if (num_failed > 0)
+            fwup_errx(EXIT_FAILURE, "%d of %d devices failed", num_failed, num_devices);
+
+        if (dry_run) {
+            struct simple_string plan;
+            simple_string_init(&plan);
+            io_plan_format(&plan, &dry_run_stats, outputs[0].end_offset, &dry_run_model);
+            fwup_output(FRAMING_TYPE_SUCCESS, 0, plan.str);
+            free(plan.str);
+            block_cache_stats_free(&dry_run_stats);
+        } else {
+            fwup_output(FRAMING_TYPE_SUCCESS, 0, "");
         }
-        fwup_output(FRAMING_TYPE_SUCCESS, 0, "");
         break;
     }
 
 #ifndef FWUP_MINIMAL
     case CMD_CREATE:
-        if (fwup_create(configfile, output_filename, signing_key, compression_level) < 0)
+        if (fwup_create(configfile, output_filename, signing_key, compression_level, previous_fw) < 0)
             fwup_errx(EXIT_FAILURE, "%s", last_error());
 
         break;
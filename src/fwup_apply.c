@@ -41,6 +41,11 @@
 #include "resources.h"
 #include "block_cache.h"
 #include "fwup_xdelta3.h"
+#include "chunks.h"
+#include "chunk_store.h"
+#include "bmap.h"
+#include "readback.h"
+#include "zip_splice.h"
 
 static bool deprecated_task_is_applicable(cfg_t *task, struct block_cache *output)
 {
@@ -99,24 +104,212 @@ static cfg_t *find_task(struct fun_context *fctx, const char *task_prefix)
     return 0;
 }
 
-static int apply_event(struct fun_context *fctx, cfg_t *task, const char *event_type, const char *event_parameter, int (*fun)(struct fun_context *fctx))
+/**
+ * Before anything is run, the task's events are looked up and their funlists
+ * are compiled so that the functions don't need to be found each time.
+ */
+struct event_plan {
+    cfg_t *on_event; // NULL if the task doesn't handle the event
+    cfg_t *resource; // The file-resource for on-resource events
+    struct fun_oplist ops;
+};
+
+struct task_plan {
+    struct event_plan on_init;
+    struct event_plan on_finish;
+    struct event_plan on_error;
+
+    // Sorted by resource name
+    struct event_plan *on_resource;
+    int on_resource_count;
+
+    // The on-resource events for resources that were stored as duplicates
+    // of another resource. Sorted by the name of the one with the data.
+    struct duplicate_event *duplicates;
+    int duplicate_count;
+};
+
+struct duplicate_event {
+    const char *original;
+    const struct event_plan *event;
+};
+
+static int compile_event(cfg_t *on_event, struct event_plan *event)
 {
-    if (event_parameter)
-        fctx->on_event = cfg_gettsec(task, event_type, event_parameter);
-    else
-        fctx->on_event = cfg_getsec(task, event_type);
-
-    if (fctx->on_event) {
-        cfg_opt_t *funlist = cfg_getopt(fctx->on_event, "funlist");
-        if (funlist) {
-            if (fun_apply_funlist(fctx, funlist, fun) < 0) {
-                fctx->on_event = NULL;
-                return -1;
-            }
+    event->on_event = on_event;
+    event->resource = NULL;
+    return fun_compile_funlist(on_event ? cfg_getopt(on_event, "funlist") : NULL, &event->ops);
+}
+
+static int event_titlecompare(const void *pa, const void *pb)
+{
+    const struct event_plan *a = (const struct event_plan *) pa;
+    const struct event_plan *b = (const struct event_plan *) pb;
+
+    return strcmp(cfg_title(a->on_event), cfg_title(b->on_event));
+}
+
+static int duplicate_compare(const void *pa, const void *pb)
+{
+    const struct duplicate_event *a = (const struct duplicate_event *) pa;
+    const struct duplicate_event *b = (const struct duplicate_event *) pb;
+
+    return strcmp(a->original, b->original);
+}
+
+static void free_task_plan(struct task_plan *plan)
+{
+    fun_free_oplist(&plan->on_init.ops);
+    fun_free_oplist(&plan->on_finish.ops);
+    fun_free_oplist(&plan->on_error.ops);
+    for (int i = 0; i < plan->on_resource_count; i++)
+        fun_free_oplist(&plan->on_resource[i].ops);
+    free(plan->on_resource);
+    free(plan->duplicates);
+    memset(plan, 0, sizeof(*plan));
+}
+
+static int compile_task(cfg_t *cfg, cfg_t *task, struct task_plan *plan)
+{
+    int rc = 0;
+    struct resource_table all_resources;
+    rlist_init(&all_resources);
+    memset(plan, 0, sizeof(*plan));
+
+    OK_OR_CLEANUP(compile_event(cfg_getsec(task, "on-init"), &plan->on_init));
+    OK_OR_CLEANUP(compile_event(cfg_getsec(task, "on-finish"), &plan->on_finish));
+    OK_OR_CLEANUP(compile_event(cfg_getsec(task, "on-error"), &plan->on_error));
+
+    OK_OR_CLEANUP(rlist_get_all(cfg, &all_resources));
+
+    int count = cfg_size(task, "on-resource");
+    plan->on_resource = calloc(count + 1, sizeof(struct event_plan));
+    if (!plan->on_resource)
+        fwup_err(EXIT_FAILURE, "calloc");
+
+    for (int i = 0; i < count; i++) {
+        cfg_t *on_resource = cfg_getnsec(task, "on-resource", i);
+        struct event_plan *event = &plan->on_resource[plan->on_resource_count];
+        OK_OR_CLEANUP(compile_event(on_resource, event));
+        plan->on_resource_count++;
+
+        struct resource_list *item = rlist_find_by_name(&all_resources, cfg_title(on_resource));
+        event->resource = item ? item->resource : NULL;
+    }
+    qsort(plan->on_resource, plan->on_resource_count, sizeof(struct event_plan), event_titlecompare);
+
+    plan->duplicates = calloc(count + 1, sizeof(struct duplicate_event));
+    if (!plan->duplicates)
+        fwup_err(EXIT_FAILURE, "calloc");
+    for (int i = 0; i < plan->on_resource_count; i++) {
+        const struct event_plan *event = &plan->on_resource[i];
+        const char *original = event->resource ? cfg_getstr(event->resource, "duplicate-of") : NULL;
+        if (original) {
+            plan->duplicates[plan->duplicate_count].original = original;
+            plan->duplicates[plan->duplicate_count].event = event;
+            plan->duplicate_count++;
         }
     }
+    qsort(plan->duplicates, plan->duplicate_count, sizeof(struct duplicate_event), duplicate_compare);
+
+cleanup:
+    rlist_free(&all_resources);
+    if (rc < 0)
+        free_task_plan(plan);
+    return rc;
+}
+
+static const struct event_plan *find_resource_event(const struct task_plan *plan, const char *resource_name)
+{
+    int lo = 0;
+    int hi = plan->on_resource_count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(cfg_title(plan->on_resource[mid].on_event), resource_name);
+        if (cmp == 0)
+            return &plan->on_resource[mid];
+        else if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return NULL;
+}
+
+/**
+ * Resources that were stored as duplicates of another one get written when
+ * the other one's data is read. Their on-resource events are merged into its
+ * event so that the data only needs to be decompressed once.
+ *
+ * item and event are for resource_name and are NULL if the task doesn't use
+ * it. They're updated to the first duplicate if that's the case.
+ */
+static const struct event_plan *merge_duplicate_events(const struct task_plan *plan,
+                                                       const struct resource_table *resources,
+                                                       const char *resource_name,
+                                                       struct resource_list **item,
+                                                       const struct event_plan *event,
+                                                       struct event_plan *merged)
+{
+    // Find the first duplicate of resource_name in the sorted table
+    int lo = 0;
+    int hi = plan->duplicate_count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (strcmp(plan->duplicates[mid].original, resource_name) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (int i = lo; i < plan->duplicate_count && strcmp(plan->duplicates[i].original, resource_name) == 0; i++) {
+        const struct event_plan *duplicate_event = plan->duplicates[i].event;
+        struct resource_list *r = rlist_find_by_name(resources, cfg_title(duplicate_event->on_event));
+        if (r == NULL)
+            continue;
+
+        r->processed = true;
+        if (*item == NULL) {
+            *item = r;
+            event = duplicate_event;
+            continue;
+        }
+
+        if (event != merged) {
+            merged->on_event = event->on_event;
+            merged->resource = event->resource;
+            fun_merge_oplist(&merged->ops, &event->ops, event->on_event, event->resource);
+            event = merged;
+        }
+        fun_merge_oplist(&merged->ops, &duplicate_event->ops, duplicate_event->on_event, duplicate_event->resource);
+    }
+    return event;
+}
+
+static int apply_event(struct fun_context *fctx, const struct event_plan *event, int (*fun)(struct fun_context *fctx))
+{
+    if (!event || !event->on_event)
+        return 0;
+
+    fctx->on_event = event->on_event;
+    fctx->resource = event->resource;
+    int rc = fun_apply_oplist(fctx, &event->ops, fun);
     fctx->on_event = NULL;
-    return 0;
+    fctx->resource = NULL;
+    return rc;
+}
+
+static int apply_resource_event(struct fun_context *fctx, const struct event_plan *event)
+{
+    if (!event || !event->on_event)
+        return 0;
+
+    fctx->on_event = event->on_event;
+    fctx->resource = event->resource;
+    int rc = fun_apply_resource_oplist(fctx, &event->ops);
+    fctx->on_event = NULL;
+    fctx->resource = NULL;
+    return rc;
 }
 
 struct fwup_apply_data
@@ -124,6 +317,13 @@ struct fwup_apply_data
     struct archive *a;
     bool reading_stdin;
 
+    // The .fw file for reading stored resources directly (-1 if not a regular file)
+    int fw_fd;
+
+    // Where the current resource's data starts in fw_fd if it can be read
+    // directly (-1 if not)
+    off_t stored_offset;
+
     // Sparse file handling
     struct sparse_file_map sfm;
     int sparse_map_ix;
@@ -131,8 +331,41 @@ struct fwup_apply_data
     off_t actual_offset;
     const void *sparse_leftover;
     off_t sparse_leftover_len;
+
+    // Used by read_callback_direct() when the caller doesn't supply memory
+    uint8_t *direct_buffer;
+
+    // Chunked resource processing (NULL if not in use)
+    struct chunks_state *chunks;
+    off_t chunk_source_offset;
+    off_t chunk_source_count;
+
+    // Store of chunks from previous runs (NULL if not in use)
+    struct chunk_store *store;
+    struct chunk_store_feeder *feeder;
+
+    struct task_plan plan;
 };
 
+#define DIRECT_BUFFER_SIZE BLOCK_CACHE_SEGMENT_SIZE
+
+static void advance_sparse_offset(struct fwup_apply_data *p, off_t len)
+{
+    p->actual_offset += len;
+    p->sparse_block_offset += len;
+    if (p->sparse_block_offset == p->sfm.map[p->sparse_map_ix]) {
+        // Advance over hole (unless this is the end)
+        p->sparse_map_ix++;
+        p->sparse_block_offset = 0;
+        if (p->sparse_map_ix != p->sfm.map_len) {
+            p->actual_offset += p->sfm.map[p->sparse_map_ix];
+
+            // Advance to next data block
+            p->sparse_map_ix++;
+        }
+    }
+}
+
 static int read_callback_normal(struct fun_context *fctx, const void **buffer, size_t *len, off_t *offset)
 {
     struct fwup_apply_data *p = (struct fwup_apply_data *) fctx->cookie;
@@ -164,19 +397,7 @@ static int read_callback_normal(struct fun_context *fctx, const void **buffer, s
 
         p->sparse_leftover += *len;
         p->sparse_leftover_len -= *len;
-        p->actual_offset += *len;
-        p->sparse_block_offset += *len;
-        if (p->sparse_block_offset == sparse_file_chunk_len) {
-            // Advance over hole (unless this is the end)
-            p->sparse_map_ix++;
-            p->sparse_block_offset = 0;
-            if (p->sparse_map_ix != p->sfm.map_len) {
-                p->actual_offset += p->sfm.map[p->sparse_map_ix];
-
-                // Advance to next data block
-                p->sparse_map_ix++;
-            }
-        }
+        advance_sparse_offset(p, *len);
         return 0;
     }
 
@@ -196,28 +417,76 @@ static int read_callback_normal(struct fun_context *fctx, const void **buffer, s
 
     if (remaining_data_in_sparse_file_chunk > (off_t) *len) {
         // The amount decompressed doesn't cross a sparse file hole
-        p->actual_offset += *len;
-        p->sparse_block_offset += *len;
+        advance_sparse_offset(p, *len);
     } else {
         // The amount decompressed crosses a hole in a sparse file,
         // so return the contiguous chunk and save the leftovers.
-        p->actual_offset += remaining_data_in_sparse_file_chunk;
         p->sparse_leftover_len = *len - remaining_data_in_sparse_file_chunk;
         p->sparse_leftover = *buffer + remaining_data_in_sparse_file_chunk;
 
         *len = remaining_data_in_sparse_file_chunk;
+        advance_sparse_offset(p, *len);
+    }
 
-        // Advance over hole (unless this is the end)
-        p->sparse_map_ix++;
-        p->sparse_block_offset = 0;
-        if (p->sparse_map_ix != p->sfm.map_len) {
-            p->actual_offset += p->sfm.map[p->sparse_map_ix];
+    return 0;
+}
 
-            // Advance to next data block
-            p->sparse_map_ix++;
+static int read_callback_direct_normal(struct fun_context *fctx,
+                                       fun_window_callback window_callback,
+                                       void *cookie,
+                                       const void **buffer, size_t *len, off_t *offset)
+{
+    struct fwup_apply_data *p = (struct fwup_apply_data *) fctx->cookie;
+
+    // Leftovers only exist if read_callback_normal() was used on this resource.
+    if (p->sparse_leftover_len > 0)
+        return read_callback_normal(fctx, buffer, len, offset);
+
+    if (p->sparse_map_ix == p->sfm.map_len) {
+        // End of file
+        *len = 0;
+        *buffer = NULL;
+        *offset = 0;
+        return 0;
+    }
+
+    // Never read across a hole so that the caller's window is contiguous
+    size_t remaining_data_in_sparse_file_chunk =
+            (size_t) (p->sfm.map[p->sparse_map_ix] - p->sparse_block_offset);
+
+    void *window;
+    size_t window_len = 0;
+    OK_OR_RETURN(window_callback(cookie, p->actual_offset, remaining_data_in_sparse_file_chunk, &window, &window_len));
+    if (window == NULL) {
+        if (!p->direct_buffer) {
+            p->direct_buffer = malloc(DIRECT_BUFFER_SIZE);
+            if (!p->direct_buffer)
+                fwup_err(EXIT_FAILURE, "malloc");
         }
+        window = p->direct_buffer;
+        if (window_len == 0 || window_len > DIRECT_BUFFER_SIZE)
+            window_len = DIRECT_BUFFER_SIZE;
     }
+    if (window_len == 0 || window_len > remaining_data_in_sparse_file_chunk)
+        window_len = remaining_data_in_sparse_file_chunk;
+
+    // archive_read_data() copies straight from the decompressor's output
+    // into the window. Once it's used on an entry, archive_read_data_block()
+    // can't be, since archive_read_data() may hold on to part of a block.
+    ssize_t amount_read = archive_read_data(p->a, window, window_len);
+    if (amount_read < 0)
+        ERR_RETURN(archive_error_string(p->a));
 
+    *buffer = window;
+    *len = (size_t) amount_read;
+    *offset = p->actual_offset;
+    if (amount_read == 0) {
+        // Truncated. Let the caller report the length mismatch.
+        *offset = 0;
+        return 0;
+    }
+
+    advance_sparse_offset(p, amount_read);
     return 0;
 }
 
@@ -253,6 +522,61 @@ static int xdelta_read_source_callback(void *cookie, void *buf, size_t count, of
     return block_cache_pread(fctx->output, buf, count, fctx->xd_source_offset + offset);
 }
 
+/**
+ * Check that the xdelta3 source on the device is what the patch was made
+ * against. Otherwise, the mismatch wouldn't be found until after the patched
+ * output had been written.
+ */
+static int check_delta_source(struct fun_context *fctx, cfg_t *resource, const char *resource_name)
+{
+    const char *expected_hash_str = cfg_getstr(resource, "delta-source-blake2b-256");
+    if (!expected_hash_str)
+        return 0;
+
+#if (SIZEOF_INT == 4 && SIZEOF_OFF_T > 4)
+    off_t length = (off_t) cfg_getfloat(resource, "delta-source-length");
+#else
+    off_t length = cfg_getint(resource, "delta-source-length");
+#endif
+    if (length > (off_t) fctx->xd_source_count)
+        ERR_RETURN("The xdelta3 source for '%s' is %" PRId64 " bytes, but delta-source-raw-count only has room for %" PRId64,
+                   resource_name, length, (off_t) fctx->xd_source_count);
+
+    uint8_t expected_hash[FWUP_BLAKE2b_256_LEN];
+    if (hex_to_bytes(expected_hash_str, expected_hash, sizeof(expected_hash)) < 0)
+        ERR_RETURN("invalid delta-source-blake2b-256 for '%s'", resource_name);
+
+    crypto_blake2b_ctx hash_state;
+    crypto_blake2b_general_init(&hash_state, FWUP_BLAKE2b_256_LEN, NULL, 0);
+
+    // Segment-sized sequential reads let the block cache read ahead while
+    // hashing. The source is read again while patching, so some of it
+    // will still be cached then.
+    int rc = 0;
+    uint8_t *buffer;
+    alloc_page_aligned((void **) &buffer, BLOCK_CACHE_SEGMENT_SIZE);
+
+    off_t offset = 0;
+    while (offset < length) {
+        size_t len = BLOCK_CACHE_SEGMENT_SIZE;
+        if ((off_t) len > length - offset)
+            len = (size_t) (length - offset);
+
+        OK_OR_CLEANUP(block_cache_pread(fctx->output, buffer, len, fctx->xd_source_offset + offset));
+        crypto_blake2b_update(&hash_state, buffer, len);
+        offset += len;
+    }
+
+    uint8_t hash[FWUP_BLAKE2b_256_LEN];
+    crypto_blake2b_final(&hash_state, hash);
+    if (memcmp(hash, expected_hash, sizeof(hash)) != 0)
+        ERR_CLEANUP_MSG("The xdelta3 source for '%s' isn't what the patch was made from. Check delta-source-raw-offset or use a full update.", resource_name);
+
+cleanup:
+    free_page_aligned(buffer);
+    return rc;
+}
+
 static int read_callback_xdelta(struct fun_context *fctx, const void **buffer, size_t *len, off_t *offset)
 {
     struct fwup_apply_data *p = (struct fwup_apply_data *) fctx->cookie;
@@ -270,12 +594,128 @@ static int read_callback_xdelta(struct fun_context *fctx, const void **buffer, s
     return 0;
 }
 
+static int chunks_read_archive_callback(void *cookie, const void **buffer, size_t *len)
+{
+    // Same as reading an xdelta patch
+    return xdelta_read_patch_callback(cookie, buffer, len);
+}
+
+static int chunks_pread_source_callback(void *cookie, void *buf, size_t count, off_t offset)
+{
+    struct fun_context *fctx = (struct fun_context *) cookie;
+    struct fwup_apply_data *p = (struct fwup_apply_data *) fctx->cookie;
+
+    if (offset < 0 ||
+        offset + (off_t) count > p->chunk_source_count)
+        ERR_RETURN("chunk outside of allowed byte range (0-%" PRId64 "): offset: %" PRId64 ", count: %d", p->chunk_source_count, offset, (int) count);
+
+    return block_cache_pread(fctx->output, buf, count, p->chunk_source_offset + offset);
+}
+
+static int read_callback_chunks(struct fun_context *fctx, const void **buffer, size_t *len, off_t *offset)
+{
+    struct fwup_apply_data *p = (struct fwup_apply_data *) fctx->cookie;
+
+    OK_OR_RETURN(chunks_read(p->chunks, buffer, len));
+
+    // Chunked resources have no holes
+    *offset = p->actual_offset;
+    p->actual_offset += *len;
+
+    return 0;
+}
+
 static int read_callback(struct fun_context *fctx, const void **buffer, size_t *len, off_t *offset)
 {
+    struct fwup_apply_data *p = (struct fwup_apply_data *) fctx->cookie;
+    p->stored_offset = -1;
+
     if (fctx->xd)
-        return read_callback_xdelta(fctx, buffer, len, offset);
+        OK_OR_RETURN(read_callback_xdelta(fctx, buffer, len, offset));
+    else if (p->chunks)
+        return read_callback_chunks(fctx, buffer, len, offset);
     else
-        return read_callback_normal(fctx, buffer, len, offset);
+        OK_OR_RETURN(read_callback_normal(fctx, buffer, len, offset));
+
+    if (p->feeder)
+        OK_OR_RETURN(chunk_store_feed(p->feeder, *buffer, *len));
+    return 0;
+}
+
+static int read_callback_direct(struct fun_context *fctx,
+                                fun_window_callback window_callback,
+                                void *cookie,
+                                const void **buffer, size_t *len, off_t *offset)
+{
+    struct fwup_apply_data *p = (struct fwup_apply_data *) fctx->cookie;
+    p->stored_offset = -1;
+
+    if (fctx->xd)
+        OK_OR_RETURN(read_callback_xdelta(fctx, buffer, len, offset));
+    else if (p->chunks)
+        return read_callback_chunks(fctx, buffer, len, offset);
+    else
+        OK_OR_RETURN(read_callback_direct_normal(fctx, window_callback, cookie, buffer, len, offset));
+
+    if (p->feeder)
+        OK_OR_RETURN(chunk_store_feed(p->feeder, *buffer, *len));
+    return 0;
+}
+
+static bool stored_data_callback(struct fun_context *fctx, int *fd, off_t *offset)
+{
+    struct fwup_apply_data *p = (struct fwup_apply_data *) fctx->cookie;
+
+    if (p->stored_offset < 0)
+        return false;
+
+    *fd = p->fw_fd;
+    *offset = p->stored_offset;
+
+    // Nothing is left for the read callbacks
+    p->stored_offset = -1;
+    p->sparse_map_ix = p->sfm.map_len;
+    return true;
+}
+
+/**
+ * Find where an entry's data is in the .fw file if it's stored without
+ * compression or encryption
+ *
+ * @return the offset or -1 if the entry needs to be read through libarchive
+ */
+static off_t find_stored_data(struct fwup_apply_data *p, struct archive_entry *ae)
+{
+    off_t header_offset = archive_read_header_position(p->a);
+    if (header_offset < 0)
+        return -1;
+
+    // See APPNOTE.TXT section 4.3.7 for the local file header
+    uint8_t header[30];
+    if (pread(p->fw_fd, header, sizeof(header), header_offset) != sizeof(header) ||
+            memcmp(header, "PK\003\004", 4) != 0)
+        return -1;
+
+    uint16_t flags = header[6] | (header[7] << 8);
+    uint16_t method = header[8] | (header[9] << 8);
+    uint16_t name_len = header[26] | (header[27] << 8);
+    uint16_t extra_len = header[28] | (header[29] << 8);
+    if (method != ZIP_METHOD_STORE || (flags & 1))
+        return -1;
+
+    if (archive_entry_size_is_set(ae) && archive_entry_size(ae) != sparse_file_data_size(&p->sfm))
+        return -1;
+
+    // Make sure that libarchive's idea of the position is right
+    const char *name = archive_entry_pathname(ae);
+    char header_name[FWFILE_MAX_ARCHIVE_PATH];
+    if (name_len != strlen(name) ||
+            name_len >= sizeof(header_name) ||
+            pread(p->fw_fd, header_name, name_len, header_offset + sizeof(header)) != name_len ||
+            memcmp(header_name, name, name_len) != 0)
+        return -1;
+
+    return header_offset + sizeof(header) + name_len + extra_len;
 }
 
 static void initialize_timestamps()
@@ -296,44 +736,61 @@ static void initialize_timestamps()
     fatfs_set_time(&tmp);
 }
 
-static int compute_progress(struct fun_context *fctx)
+static int compute_progress(struct fun_context *fctx, const struct task_plan *plan)
 {
     fctx->type = FUN_CONTEXT_INIT;
-    OK_OR_RETURN(apply_event(fctx, fctx->task, "on-init", NULL, fun_compute_progress));
+    OK_OR_RETURN(apply_event(fctx, &plan->on_init, fun_compute_progress));
 
     fctx->type = FUN_CONTEXT_FILE;
-    cfg_t *sec;
-    int i = 0;
-    while ((sec = cfg_getnsec(fctx->task, "on-resource", i++)) != NULL) {
-        cfg_t *resource = cfg_gettsec(fctx->cfg, "file-resource", sec->title);
-        if (!resource) {
+    for (int i = 0; i < plan->on_resource_count; i++) {
+        const struct event_plan *event = &plan->on_resource[i];
+        if (!event->resource) {
             // This really shouldn't happen, but failing to calculate
             // progress for a missing file-resource seems harsh.
-            INFO("Can't find file-resource for %s", sec->title);
+            INFO("Can't find file-resource for %s", cfg_title(event->on_event));
             continue;
         }
 
-        OK_OR_RETURN(apply_event(fctx, fctx->task, "on-resource", sec->title, fun_compute_progress));
+        OK_OR_RETURN(apply_event(fctx, event, fun_compute_progress));
     }
 
     fctx->type = FUN_CONTEXT_FINISH;
-    OK_OR_RETURN(apply_event(fctx, fctx->task, "on-finish", NULL, fun_compute_progress));
+    OK_OR_RETURN(apply_event(fctx, &plan->on_finish, fun_compute_progress));
 
     return 0;
 }
 
+static void free_chunks(struct fwup_apply_data *pd)
+{
+    if (pd->chunks) {
+        chunks_free(pd->chunks);
+        free(pd->chunks);
+        pd->chunks = NULL;
+    }
+    if (pd->feeder) {
+        chunk_store_feeder_free(pd->feeder);
+        free(pd->feeder);
+        pd->feeder = NULL;
+    }
+}
+
 static int run_task(struct fun_context *fctx, struct fwup_apply_data *pd)
 {
     int rc = 0;
 
-    struct resource_list *resources = NULL;
+    struct resource_table resources;
+    rlist_init(&resources);
+    struct event_plan merged;
+    memset(&merged, 0, sizeof(merged));
     OK_OR_CLEANUP(rlist_get_from_task(fctx->cfg, fctx->task, &resources));
 
     fctx->type = FUN_CONTEXT_INIT;
-    OK_OR_CLEANUP(apply_event(fctx, fctx->task, "on-init", NULL, fun_run));
+    OK_OR_CLEANUP(apply_event(fctx, &pd->plan.on_init, fun_run));
 
     fctx->type = FUN_CONTEXT_FILE;
     fctx->read = read_callback;
+    fctx->read_direct = read_callback_direct;
+    fctx->stored_data = stored_data_callback;
     struct archive_entry *ae;
     while (archive_read_next_header(pd->a, &ae) == ARCHIVE_OK) {
         const char *filename = archive_entry_pathname(ae);
@@ -348,8 +805,15 @@ static int run_task(struct fun_context *fctx, struct fwup_apply_data *pd)
         if (resource_name[0] == '\0')
             continue;
 
-        // See if this resource is used by this task
-        struct resource_list *item = rlist_find_by_name(resources, resource_name);
+        // See if this resource is used by this task. Duplicates don't have
+        // their own data and are handled with the resource they duplicate.
+        struct resource_list *item = rlist_find_by_name(&resources, resource_name);
+        if (item && item->resource && cfg_getstr(item->resource, "duplicate-of"))
+            item = NULL;
+
+        const struct event_plan *event = item ? find_resource_event(&pd->plan, resource_name) : NULL;
+        if (pd->plan.duplicate_count > 0)
+            event = merge_duplicate_events(&pd->plan, &resources, resource_name, &item, event, &merged);
         if (item == NULL)
             continue;
 
@@ -381,8 +845,22 @@ static int run_task(struct fun_context *fctx, struct fwup_apply_data *pd)
 
 // MOVE ME!!!
 {
-    cfg_t *on_resource = cfg_gettsec(fctx->task, "on-resource", resource_name);
-    if (on_resource) {
+    cfg_t *on_resource = event ? event->on_event : NULL;
+    if (on_resource && cfg_size(item->resource, "chunks") > 0) {
+        const char *source_raw_offset_str = cfg_getstr(on_resource, "chunk-source-raw-offset");
+        int source_raw_count = cfg_getint(on_resource, "chunk-source-raw-count");
+        if (source_raw_count <= 0 || source_raw_offset_str == NULL)
+            ERR_CLEANUP_MSG("File '%s' is chunked. Add chunk-source-raw-offset and chunk-source-raw-count to its on-resource to say where to find the chunks.", resource_name);
+
+        pd->chunk_source_offset = strtoul(source_raw_offset_str, NULL, 0) * FWUP_BLOCK_SIZE;
+        pd->chunk_source_count = (off_t) source_raw_count * FWUP_BLOCK_SIZE;
+
+        pd->chunks = malloc(sizeof(struct chunks_state));
+        if (!pd->chunks)
+            fwup_err(EXIT_FAILURE, "malloc");
+        OK_OR_CLEANUP(chunks_init(pd->chunks, item->resource, chunks_read_archive_callback, chunks_pread_source_callback, fctx, pd->store));
+        OK_OR_CLEANUP(chunks_scan_source(pd->chunks, pd->chunk_source_count));
+    } else if (on_resource) {
         off_t size_in_archive = archive_entry_size(ae);
         off_t expected_size_in_archive = sparse_file_data_size(&pd->sfm);
 
@@ -396,16 +874,41 @@ static int run_task(struct fun_context *fctx, struct fwup_apply_data *pd)
                 xdelta_init(fctx->xd, xdelta_read_patch_callback, xdelta_read_source_callback, fctx);
                 fctx->xd_source_offset = source_raw_offset * FWUP_BLOCK_SIZE;
                 fctx->xd_source_count = source_raw_count * FWUP_BLOCK_SIZE;
+                OK_OR_CLEANUP(check_delta_source(fctx, item->resource, resource_name));
+
+                // With the source checked, a bad patch is still caught by the
+                // final hash, so the patch's checksums are only extra work.
+                if (cfg_getstr(item->resource, "delta-source-blake2b-256"))
+                    xdelta_skip_checksums(fctx->xd);
             } else {
                 ERR_CLEANUP_MSG("File '%s' isn't expected size (%d vs %d) and xdelta3 patch support not enabled on it. (Add delta-source-raw-offset or delta-source-raw-count at least)", resource_name, (int) size_in_archive, (int) expected_size_in_archive);
             }
         }
     }
 }
-        OK_OR_CLEANUP(apply_event(fctx, fctx->task, "on-resource", resource_name, fun_run));
+
+        // Sparse resources are skipped since the chunks of their data
+        // won't line up with those of a complete image.
+        if (pd->store && !pd->chunks && pd->sfm.map_len == 1) {
+            pd->feeder = malloc(sizeof(struct chunk_store_feeder));
+            if (!pd->feeder)
+                fwup_err(EXIT_FAILURE, "malloc");
+            chunk_store_feeder_init(pd->feeder, pd->store);
+        }
+
+        // Stored resources can be copied without going through libarchive
+        pd->stored_offset = -1;
+        if (pd->fw_fd >= 0 && !fctx->xd && !pd->chunks && !pd->feeder)
+            pd->stored_offset = find_stored_data(pd, ae);
+
+        OK_OR_CLEANUP(apply_resource_event(fctx, event));
+
+        if (pd->feeder)
+            OK_OR_CLEANUP(chunk_store_feeder_final(pd->feeder));
 
         item->processed = true;
         sparse_file_free(&pd->sfm);
+        fun_free_oplist(&merged.ops);
 
 { // MOVE ME!!!
     if (fctx->xd) {
@@ -414,10 +917,11 @@ static int run_task(struct fun_context *fctx, struct fwup_apply_data *pd)
         fctx->xd = NULL;
     }
 }
+        free_chunks(pd);
     }
 
     // Make sure that all "on-resource" blocks have been run.
-    for (const struct resource_list *r = resources; r != NULL; r = r->next) {
+    for (const struct resource_list *r = resources.list; r != NULL; r = r->next) {
         if (!r->processed)
             ERR_CLEANUP_MSG("Resource %s not found in archive", cfg_title(r->resource));
     }
@@ -429,10 +933,23 @@ static int run_task(struct fun_context *fctx, struct fwup_apply_data *pd)
     // needs to be flushed here.
     fatfs_closefs();
 
+    // Make everything written so far durable before on-finish commits to
+    // it. Otherwise, a power loss right after an A/B swap could leave the
+    // swap on the media without the data that it points to.
+    if (cfg_getbool(fctx->task, "durability-barrier"))
+        OK_OR_CLEANUP(block_cache_barrier(fctx->output));
+
+    // Prove that the resources made it to the destination before on-finish
+    // commits to them.
+    if (fctx->readback)
+        OK_OR_CLEANUP(readback_check(fctx->readback, fctx->output));
+
     fctx->type = FUN_CONTEXT_FINISH;
-    OK_OR_CLEANUP(apply_event(fctx, fctx->task, "on-finish", NULL, fun_run));
+    OK_OR_CLEANUP(apply_event(fctx, &pd->plan.on_finish, fun_run));
 
 cleanup:
+    free_chunks(pd);
+    fun_free_oplist(&merged.ops);
     if (rc != 0) {
         // Do a best attempt at running any error handling code
         fctx->type = FUN_CONTEXT_ERROR;
@@ -442,31 +959,183 @@ cleanup:
         fatfs_closefs();
         block_cache_reset(fctx->output);
 
-        if (apply_event(fctx, fctx->task, "on-error", NULL, fun_run) < 0) {
+        if (apply_event(fctx, &pd->plan.on_error, fun_run) < 0) {
             // Yet another error so throw out the cache again.
             fatfs_closefs();
             block_cache_reset(fctx->output);
         }
     }
-    rlist_free(resources);
+    rlist_free(&resources);
     return rc;
 }
 
+/**
+ * When programming more than one destination, reads only go to the first one.
+ * That's fine for what the update wrote itself, but not for what was there
+ * before since the other destinations could have started out differently.
+ * Anything read from them would be written back over the other destinations.
+ */
+struct initialized_list {
+    const char **names; // U-Boot environment names
+    int count;
+};
+
+struct initialized_fats {
+    off_t *block_offsets;
+    int count;
+};
+
+static void initialized_fat_add(struct initialized_fats *list, off_t block_offset)
+{
+    off_t *new_offsets = realloc(list->block_offsets, (list->count + 1) * sizeof(off_t));
+    if (!new_offsets)
+        fwup_err(EXIT_FAILURE, "realloc");
+    list->block_offsets = new_offsets;
+    list->block_offsets[list->count++] = block_offset;
+}
+
+static bool initialized_fat_find(const struct initialized_fats *list, off_t block_offset)
+{
+    for (int i = 0; i < list->count; i++) {
+        if (list->block_offsets[i] == block_offset)
+            return true;
+    }
+    return false;
+}
+
+static void initialized_add(struct initialized_list *list, const char *name)
+{
+    const char **new_names = realloc(list->names, (list->count + 1) * sizeof(const char *));
+    if (!new_names)
+        fwup_err(EXIT_FAILURE, "realloc");
+    list->names = new_names;
+    list->names[list->count++] = name;
+}
+
+static bool initialized_find(const struct initialized_list *list, const char *name)
+{
+    for (int i = 0; i < list->count; i++) {
+        if (strcmp(list->names[i], name) == 0)
+            return true;
+    }
+    return false;
+}
+
+static int check_oplist_for_multiple_outputs(const struct fun_oplist *oplist,
+                                             struct initialized_fats *fats,
+                                             struct initialized_list *uboot_envs)
+{
+    for (int i = 0; i < oplist->count; i++) {
+        const struct fun_op *op = &oplist->ops[i];
+        const char *name = op->argv[0];
+
+        // Compare FAT offsets the way the fat_* functions parse them so
+        // that 0x800 and 2048 are the same filesystem.
+        bool is_fat = strncmp(name, "fat_", 4) == 0;
+        off_t fat_block_offset = is_fat ? (off_t) strtoull(op->argv[1], NULL, 0) : 0;
+
+        if (strcmp(name, "fat_mkfs") == 0) {
+            initialized_fat_add(fats, fat_block_offset);
+        } else if (strcmp(name, "uboot_clearenv") == 0) {
+            initialized_add(uboot_envs, op->argv[1]);
+        } else if (strcmp(name, "raw_copy") == 0 || strcmp(name, "uboot_recover") == 0) {
+            ERR_RETURN("%s reads the destination, so it can only be used with one device at a time", name);
+        } else if (is_fat && !initialized_fat_find(fats, fat_block_offset)) {
+            ERR_RETURN("%s reads the FAT filesystem at block %s, so it can only be used with one device at a time unless fat_mkfs creates it first", name, op->argv[1]);
+        } else if (strncmp(name, "uboot_", 6) == 0 && !initialized_find(uboot_envs, op->argv[1])) {
+            ERR_RETURN("%s reads the U-Boot environment '%s', so it can only be used with one device at a time unless uboot_clearenv creates it first", name, op->argv[1]);
+        }
+    }
+    return 0;
+}
+
+static int check_task_for_multiple_outputs(cfg_t *task, const struct task_plan *plan)
+{
+    int rc = 0;
+    struct initialized_fats fats;
+    struct initialized_list uboot_envs;
+    memset(&fats, 0, sizeof(fats));
+    memset(&uboot_envs, 0, sizeof(uboot_envs));
+
+    // Requirements that only look at the host are fine
+    cfg_opt_t *reqlist = cfg_getopt(task, "reqlist");
+    const char *aritystr;
+    unsigned int ix = 0;
+    while (reqlist && (aritystr = cfg_opt_getnstr(reqlist, ix)) != NULL) {
+        const char *name = cfg_opt_getnstr(reqlist, ix + 1);
+        if (name &&
+                strcmp(name, "require-path-on-device") != 0 &&
+                strcmp(name, "require-path-at-offset") != 0)
+            ERR_CLEANUP_MSG("Task '%s' uses %s, so it can only be applied to one device at a time", cfg_title(task), name);
+        ix += strtoul(aritystr, NULL, 0) + 1;
+    }
+    if (cfg_getint(task, "require-partition1-offset") >= 0)
+        ERR_CLEANUP_MSG("Task '%s' uses require-partition1-offset, so it can only be applied to one device at a time", cfg_title(task));
+
+    OK_OR_CLEANUP(check_oplist_for_multiple_outputs(&plan->on_init.ops, &fats, &uboot_envs));
+
+    // on-resource events run in archive order, so only what on-init
+    // created counts for them.
+    int init_fat_count = fats.count;
+    int init_uboot_env_count = uboot_envs.count;
+    for (int i = 0; i < plan->on_resource_count; i++) {
+        const struct event_plan *event = &plan->on_resource[i];
+        if (cfg_getstr(event->on_event, "delta-source-raw-offset") ||
+                cfg_getstr(event->on_event, "chunk-source-raw-offset"))
+            ERR_CLEANUP_MSG("on-resource %s reads its delta or chunk source from the destination, so it can only be applied to one device at a time", cfg_title(event->on_event));
+
+        OK_OR_CLEANUP(check_oplist_for_multiple_outputs(&event->ops, &fats, &uboot_envs));
+        fats.count = init_fat_count;
+        uboot_envs.count = init_uboot_env_count;
+    }
+
+    OK_OR_CLEANUP(check_oplist_for_multiple_outputs(&plan->on_finish.ops, &fats, &uboot_envs));
+    OK_OR_CLEANUP(check_oplist_for_multiple_outputs(&plan->on_error.ops, &fats, &uboot_envs));
+
+cleanup:
+    free(fats.block_offsets);
+    free(uboot_envs.names);
+    return rc;
+}
+
+static void free_outputs(struct block_cache *caches, int count, struct fwup_apply_output *outputs)
+{
+    for (int i = 0; i < count; i++) {
+        // Only followers have errors. Anything wrong with the first output
+        // fails the whole update.
+        if (caches[i].error) {
+            fwup_warnx("%s: %s", outputs[i].name, caches[i].error);
+            outputs[i].failed = true;
+        }
+        block_cache_free(&caches[i]);
+        close(outputs[i].fd);
+    }
+    free(caches);
+}
+
 int fwup_apply(const char *fw_filename,
                const char *task_prefix,
-               int output_fd,
-               off_t end_offset,
+               struct fwup_apply_output *outputs,
+               int num_outputs,
                struct fwup_progress *progress,
                unsigned char *const*public_keys,
-               bool enable_trim,
-               bool verify_writes)
+               const char *chunk_store_path,
+               off_t chunk_store_max_size,
+               bool readback_check)
 {
     int rc = 0;
+    struct block_cache *caches = NULL;
+    int num_caches = 0;
     unsigned char *meta_conf_signature = NULL;
     struct fun_context fctx;
     memset(&fctx, 0, sizeof(fctx));
     fctx.progress = progress;
 
+    struct readback_list readback;
+    readback_init(&readback);
+    if (readback_check)
+        fctx.readback = &readback;
+
     // Report 0 progress before doing anything
     progress_report(fctx.progress, 0);
 
@@ -474,12 +1143,29 @@ int fwup_apply(const char *fw_filename,
     memset(&pd, 0, sizeof(pd));
     fctx.cookie = &pd;
     pd.a = archive_read_new();
+    pd.fw_fd = -1;
+    pd.stored_offset = -1;
+
+    struct chunk_store store;
+    if (chunk_store_path) {
+        pd.store = &store;
+        OK_OR_CLEANUP(chunk_store_init(&store, chunk_store_path, chunk_store_max_size));
+    }
 
     archive_read_support_format_zip(pd.a);
     int arc = fwup_archive_open_filename(pd.a, fw_filename, progress);
     if (arc != ARCHIVE_OK)
         ERR_CLEANUP_MSG("%s", archive_error_string(pd.a));
 
+    if (fw_filename && fw_filename[0] != '\0') {
+        struct stat st;
+        pd.fw_fd = open(fw_filename, O_RDONLY | O_WIN32_BINARY);
+        if (pd.fw_fd >= 0 && (fstat(pd.fw_fd, &st) < 0 || !S_ISREG(st.st_mode))) {
+            close(pd.fw_fd);
+            pd.fw_fd = -1;
+        }
+    }
+
     struct archive_entry *ae;
     arc = archive_read_next_header(pd.a, &ae);
     if (arc != ARCHIVE_OK)
@@ -507,29 +1193,75 @@ int fwup_apply(const char *fw_filename,
 
     // Initialize the output. Nothing should have been written before now
     // and waiting to initialize the output until now forces the point.
-    fctx.output = (struct block_cache *) malloc(sizeof(struct block_cache));
-    OK_OR_CLEANUP(block_cache_init(fctx.output, output_fd, end_offset, enable_trim, verify_writes));
+    //
+    // When programming more than one destination, the first one is used for
+    // reads and the rest follow along with everything that's written.
+    caches = (struct block_cache *) calloc(num_outputs, sizeof(struct block_cache));
+    if (!caches)
+        fwup_err(EXIT_FAILURE, "calloc");
+
+    // Partition tables and trims use the first destination's size
+    for (int i = 1; i < num_outputs; i++) {
+        if (outputs[i].end_offset != outputs[0].end_offset)
+            ERR_CLEANUP_MSG("%s is %" PRId64 " bytes, but %s is %" PRId64 " bytes. Devices programmed at the same time must be the same size.",
+                            outputs[i].name, outputs[i].end_offset, outputs[0].name, outputs[0].end_offset);
+    }
+    for (; num_caches < num_outputs; num_caches++) {
+        struct fwup_apply_output *output = &outputs[num_caches];
+        OK_OR_CLEANUP(block_cache_init(&caches[num_caches], output->fd, output->end_offset, output->enable_trim, output->verify_writes, output->sparse_output));
+        if (output->dry_run)
+            OK_OR_CLEANUP(block_cache_dry_run(&caches[num_caches], output->dry_run_stats));
+        if (num_caches > 0)
+            block_cache_add_follower(&caches[0], &caches[num_caches]);
+    }
+    fctx.output = &caches[0];
+
+    // The readback check needs to know if a resource was changed after
+    // raw_write wrote it
+    if (fctx.readback)
+        block_cache_track_changes(fctx.output);
+
+    // The bmap needs to include the zeros that were written on purpose even
+    // though they may be holes in the image
+    for (int i = 0; i < num_caches; i++) {
+        if (outputs[i].bmap_path)
+            block_cache_track_written(&caches[i]);
+    }
 
     // Go through all of the tasks and find a matcher
     fctx.task = find_task(&fctx, task_prefix);
     if (fctx.task == 0)
         ERR_CLEANUP_MSG("Couldn't find applicable task '%s'. If task is available, the task's requirements may not be met.", task_prefix);
 
+    // Look up everything that the task runs
+    OK_OR_CLEANUP(compile_task(fctx.cfg, fctx.task, &pd.plan));
+    if (num_outputs > 1)
+        OK_OR_CLEANUP(check_task_for_multiple_outputs(fctx.task, &pd.plan));
+
     // Compute the total progress units
-    OK_OR_CLEANUP(compute_progress(&fctx));
+    OK_OR_CLEANUP(compute_progress(&fctx, &pd.plan));
 
     // Run
     OK_OR_CLEANUP(run_task(&fctx, &pd));
 
-    // Flush everything
+    // Flush everything. The barrier makes sure that what on-finish wrote is
+    // on the media before reporting success.
     fatfs_closefs();
-    OK_OR_CLEANUP(block_cache_flush(fctx.output));
+    if (cfg_getbool(fctx.task, "durability-barrier"))
+        OK_OR_CLEANUP(block_cache_barrier(fctx.output));
+    else
+        OK_OR_CLEANUP(block_cache_flush(fctx.output));
+
+    // Everything is in the image files now, so their block maps can be made.
+    for (int i = 0; i < num_caches; i++) {
+        if (outputs[i].bmap_path && !caches[i].error)
+            OK_OR_CLEANUP(bmap_write(outputs[i].bmap_path, &caches[i]));
+    }
 
     // Close everything before reporting 100% just in case the OS blocks on the close call.
-    block_cache_free(fctx.output);
-    free(fctx.output);
+    free_outputs(caches, num_caches, outputs);
+    caches = NULL;
     fctx.output = NULL;
-    close(output_fd);
 
     // Success -> report 100%
     progress_report_complete(fctx.progress);
@@ -542,16 +1274,24 @@ cleanup:
         // handled with the on-error call.
         fatfs_closefs();
         block_cache_flush(fctx.output); // Ignore errors
-
-        block_cache_free(fctx.output);
-        free(fctx.output);
         fctx.output = NULL;
-        close(output_fd);
     }
+    if (caches)
+        free_outputs(caches, num_caches, outputs);
 
     sparse_file_free(&pd.sfm);
+    free(pd.direct_buffer);
+    readback_free(&readback);
+    free_task_plan(&pd.plan);
+
+    if (pd.store) {
+        chunk_store_prune(pd.store);
+        chunk_store_free(pd.store);
+    }
 
     archive_read_free(pd.a);
+    if (pd.fw_fd >= 0)
+        close(pd.fw_fd);
 
     if (meta_conf_signature)
         free(meta_conf_signature);
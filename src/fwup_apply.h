@@ -21,13 +21,36 @@
 
 struct fwup_progress;
 
+// Max number of destinations that can be programmed at the same time
+#define FWUP_MAX_OUTPUTS 64
+
+struct fwup_apply_output {
+    const char *name;
+    int fd;
+    off_t end_offset; // Size of the destination or <= 0 if unknown
+    bool is_regular_file;
+    bool enable_trim;
+    bool verify_writes;
+    bool sparse_output;
+    const char *bmap_path; // Write a bmap file here if not NULL
+
+    // Don't write to the destination. If dry_run_stats isn't NULL, record
+    // what would have been done there.
+    bool dry_run;
+    struct block_cache_stats *dry_run_stats;
+
+    // Set by fwup_apply if writing failed and the other outputs kept going
+    bool failed;
+};
+
 int fwup_apply(const char *fw_filename,
                const char *task,
-               int output_fd,
-               off_t end_offset,
+               struct fwup_apply_output *outputs,
+               int num_outputs,
                struct fwup_progress *progress,
                unsigned char *const* public_keys,
-               bool enable_trim,
-               bool verify_writes);
+               const char *chunk_store_path,
+               off_t chunk_store_max_size,
+               bool readback_check);
 
 #endif // FWUP_APPLY_H
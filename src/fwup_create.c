@@ -19,8 +19,11 @@
 #include "util.h"
 #include "fwfile.h"
 #include "sparse_file.h"
+#include "chunks.h"
+#include "zip_splice.h"
 #include "config.h"
 
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -31,6 +34,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <unistd.h>
 
 #ifndef FWUP_MINIMAL
 
@@ -91,6 +95,78 @@ static int write_file_to_archive(int fd, void *cookie)
     return 0;
 }
 
+struct write_chunks_state
+{
+    struct archive *a;
+    const struct chunk_list *chunks;
+    int index;
+    size_t offset_in_chunk;
+};
+
+static int write_chunks_to_archive(int fd, void *cookie)
+{
+    struct write_chunks_state *state = (struct write_chunks_state *) cookie;
+
+    for (;;) {
+        uint8_t buffer[4096];
+        ssize_t len = read(fd, buffer, sizeof(buffer));
+        if (len < 0)
+            ERR_RETURN("error reading file: %s", strerror(errno));
+        if (len == 0)
+            break;
+
+        // Only write out the stored chunks
+        size_t pos = 0;
+        while (pos < (size_t) len) {
+            if (state->index == state->chunks->count)
+                ERR_RETURN("file changed while creating archive");
+
+            const struct chunk_info *ci = &state->chunks->chunks[state->index];
+            size_t to_write = ci->len - state->offset_in_chunk;
+            if (to_write > (size_t) len - pos)
+                to_write = (size_t) len - pos;
+
+            if (ci->stored) {
+                ssize_t written = archive_write_data(state->a, &buffer[pos], to_write);
+                if (written != (ssize_t) to_write)
+                    ERR_RETURN("error writing to archive");
+            }
+
+            pos += to_write;
+            state->offset_in_chunk += to_write;
+            if (state->offset_in_chunk == ci->len) {
+                state->index++;
+                state->offset_in_chunk = 0;
+            }
+        }
+    }
+    return 0;
+}
+
+struct calc_delta_source_state
+{
+    off_t length;
+    crypto_blake2b_ctx hash_state;
+};
+
+static int calc_delta_source_hash(int fd, void *cookie)
+{
+    struct calc_delta_source_state *state = (struct calc_delta_source_state *) cookie;
+
+    for (;;) {
+        uint8_t buffer[4096];
+        ssize_t len = read(fd, buffer, sizeof(buffer));
+        if (len < 0)
+            ERR_RETURN("error reading file: %s", strerror(errno));
+        if (len == 0)
+            break;
+
+        crypto_blake2b_update(&state->hash_state, buffer, len);
+        state->length += len;
+    }
+    return 0;
+}
+
 static int run_on_each_path(cfg_t *sec, const char *paths, int (*func)(int, void*), void *cookie)
 {
     int rc = 0;
@@ -114,6 +190,356 @@ static int run_on_each_path(cfg_t *sec, const char *paths, int (*func)(int, void
     return rc;
 }
 
+struct calc_chunks_state
+{
+    struct chunker chunker;
+    struct chunk_list seed;
+    struct chunk_list chunks;
+};
+
+static int chunk_digest_compare(const void *pa, const void *pb)
+{
+    const struct chunk_info *a = (const struct chunk_info *) pa;
+    const struct chunk_info *b = (const struct chunk_info *) pb;
+
+    return memcmp(a->digest, b->digest, FWUP_BLAKE2b_256_LEN);
+}
+
+static int add_seed_chunk(void *cookie, off_t offset, size_t len, const uint8_t *digest)
+{
+    struct calc_chunks_state *state = (struct calc_chunks_state *) cookie;
+    (void) offset;
+
+    struct chunk_info *ci = chunk_list_add(&state->seed);
+    memcpy(ci->digest, digest, FWUP_BLAKE2b_256_LEN);
+    ci->len = len;
+    return 0;
+}
+
+static int add_resource_chunk(void *cookie, off_t offset, size_t len, const uint8_t *digest)
+{
+    struct calc_chunks_state *state = (struct calc_chunks_state *) cookie;
+    (void) offset;
+
+    struct chunk_info *ci = chunk_list_add(&state->chunks);
+    memcpy(ci->digest, digest, FWUP_BLAKE2b_256_LEN);
+    ci->len = len;
+
+    // Only store chunks that can't be found in the seed.
+    ci->stored = bsearch(ci, state->seed.chunks, state->seed.count, sizeof(struct chunk_info), chunk_digest_compare) == NULL;
+    return 0;
+}
+
+static int feed_chunker(int fd, void *cookie)
+{
+    struct calc_chunks_state *state = (struct calc_chunks_state *) cookie;
+
+    for (;;) {
+        uint8_t buffer[16384];
+        ssize_t len = read(fd, buffer, sizeof(buffer));
+        if (len < 0)
+            ERR_RETURN("error reading file: %s", strerror(errno));
+        if (len == 0)
+            break;
+
+        OK_OR_RETURN(chunker_update(&state->chunker, buffer, len));
+    }
+    return 0;
+}
+
+static int compute_chunks(cfg_t *sec, const char *paths, const char *seed_paths)
+{
+    int rc = 0;
+    struct calc_chunks_state state;
+    chunk_list_init(&state.seed);
+    chunk_list_init(&state.chunks);
+
+    // Index the chunks in the seed
+    chunker_init(&state.chunker, add_seed_chunk, &state);
+    OK_OR_CLEANUP(run_on_each_path(sec, seed_paths, feed_chunker, &state));
+    OK_OR_CLEANUP(chunker_final(&state.chunker));
+    qsort(state.seed.chunks, state.seed.count, sizeof(struct chunk_info), chunk_digest_compare);
+
+    // Split the resource and mark what needs to be stored
+    chunker_init(&state.chunker, add_resource_chunk, &state);
+    OK_OR_CLEANUP(run_on_each_path(sec, paths, feed_chunker, &state));
+    OK_OR_CLEANUP(chunker_final(&state.chunker));
+
+    OK_OR_CLEANUP(chunk_list_set_in_resource(sec, &state.chunks));
+
+cleanup:
+    chunk_list_free(&state.seed);
+    chunk_list_free(&state.chunks);
+    return rc;
+}
+
+/**
+ * Record the length and hash of what an xdelta3 patch for this resource will
+ * be made against. That's the resource's contents in the firmware update
+ * that's on the device now. This lets the source be checked before patching.
+ */
+static int compute_delta_source(cfg_t *sec, const char *paths)
+{
+    struct calc_delta_source_state state;
+    state.length = 0;
+    crypto_blake2b_general_init(&state.hash_state, FWUP_BLAKE2b_256_LEN, NULL, 0);
+    OK_OR_RETURN(run_on_each_path(sec, paths, calc_delta_source_hash, &state));
+
+    unsigned char hash[FWUP_BLAKE2b_256_LEN];
+    crypto_blake2b_final(&state.hash_state, hash);
+
+    char hash_str[sizeof(hash) * 2 + 1];
+    bytes_to_hex(hash, hash_str, sizeof(hash));
+    cfg_setstr(sec, "delta-source-blake2b-256", hash_str);
+#if (SIZEOF_INT == 4 && SIZEOF_OFF_T > 4)
+    // See cfgfile.c for why we have to do this.
+    cfg_setfloat(sec, "delta-source-length", state.length);
+#else
+    cfg_setint(sec, "delta-source-length", state.length);
+#endif
+    return 0;
+}
+
+static int count_fat_writes(cfg_t *on_resource)
+{
+    cfg_opt_t *funlist = cfg_getopt(on_resource, "funlist");
+    unsigned int num_strings = funlist ? cfg_opt_size(funlist) : 0;
+    unsigned int ix = 0;
+    int count = 0;
+    while (ix < num_strings) {
+        unsigned int argc = strtoul(cfg_opt_getnstr(funlist, ix++), NULL, 0);
+        if (argc == 0 || ix + argc > num_strings)
+            break;
+
+        if (strcmp(cfg_opt_getnstr(funlist, ix), "fat_write") == 0)
+            count++;
+        ix += argc;
+    }
+    return count;
+}
+
+// A task that does a fat_write of a resource
+struct fat_write_use {
+    const char *resource_name;
+    int task;
+};
+
+// A file-resource whose contents are stored in the archive. Resources with
+// the same contents become duplicates of it.
+struct dedup_entry {
+    struct dedup_entry *next;
+    cfg_t *resource;
+    const char *hash;
+    struct sparse_file_map sfm;
+
+    // Tasks that fat_write this resource or one of its duplicates
+    int *fat_write_tasks;
+    int fat_write_task_count;
+};
+
+struct dedup_table {
+    // Hashed by blake2b-256
+    struct dedup_entry **buckets;
+    size_t bucket_count;
+
+    // Sorted by resource name
+    struct fat_write_use *fat_writes;
+    int fat_write_count;
+};
+
+static int fat_write_use_compare(const void *pa, const void *pb)
+{
+    const struct fat_write_use *a = (const struct fat_write_use *) pa;
+    const struct fat_write_use *b = (const struct fat_write_use *) pb;
+
+    return strcmp(a->resource_name, b->resource_name);
+}
+
+static void dedup_init(cfg_t *cfg, struct dedup_table *table)
+{
+    // Use a power of two number of buckets with at most half of them used.
+    unsigned int resource_count = cfg_size(cfg, "file-resource");
+    table->bucket_count = 16;
+    while (table->bucket_count < 2 * (size_t) resource_count)
+        table->bucket_count *= 2;
+    table->buckets = (struct dedup_entry **) calloc(table->bucket_count, sizeof(struct dedup_entry *));
+    if (!table->buckets)
+        fwup_err(EXIT_FAILURE, "calloc");
+
+    // Merging duplicates puts all of their on-resource functions in one
+    // event and only one fat_write per event is supported when applying.
+    // Find every fat_write up front so that this can be checked.
+    table->fat_writes = NULL;
+    table->fat_write_count = 0;
+    int capacity = 0;
+    int task_count = cfg_size(cfg, "task");
+    for (int t = 0; t < task_count; t++) {
+        cfg_t *task = cfg_getnsec(cfg, "task", t);
+        int on_resource_count = cfg_size(task, "on-resource");
+        for (int i = 0; i < on_resource_count; i++) {
+            cfg_t *on_resource = cfg_getnsec(task, "on-resource", i);
+            if (count_fat_writes(on_resource) == 0)
+                continue;
+
+            if (table->fat_write_count == capacity) {
+                capacity = capacity ? capacity * 2 : 16;
+                table->fat_writes = (struct fat_write_use *) realloc(table->fat_writes, capacity * sizeof(struct fat_write_use));
+                if (!table->fat_writes)
+                    fwup_err(EXIT_FAILURE, "realloc");
+            }
+            table->fat_writes[table->fat_write_count].resource_name = cfg_title(on_resource);
+            table->fat_writes[table->fat_write_count].task = t;
+            table->fat_write_count++;
+        }
+    }
+    qsort(table->fat_writes, table->fat_write_count, sizeof(struct fat_write_use), fat_write_use_compare);
+}
+
+static void dedup_free(struct dedup_table *table)
+{
+    for (size_t i = 0; i < table->bucket_count; i++) {
+        struct dedup_entry *entry = table->buckets[i];
+        while (entry) {
+            struct dedup_entry *next = entry->next;
+            sparse_file_free(&entry->sfm);
+            free(entry->fat_write_tasks);
+            free(entry);
+            entry = next;
+        }
+    }
+    free(table->buckets);
+    free(table->fat_writes);
+}
+
+static size_t dedup_bucket(const struct dedup_table *table, const char *hash)
+{
+    // The hash is already well distributed, so use its first bytes.
+    char prefix[9];
+    strncpy(prefix, hash, sizeof(prefix) - 1);
+    prefix[sizeof(prefix) - 1] = '\0';
+    return strtoul(prefix, NULL, 16) & (table->bucket_count - 1);
+}
+
+/**
+ * Return the range of fat_write uses for a resource
+ */
+static const struct fat_write_use *find_fat_writes(const struct dedup_table *table, const char *resource_name, int *count)
+{
+    int lo = 0;
+    int hi = table->fat_write_count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (strcmp(table->fat_writes[mid].resource_name, resource_name) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    int end = lo;
+    while (end < table->fat_write_count && strcmp(table->fat_writes[end].resource_name, resource_name) == 0)
+        end++;
+
+    *count = end - lo;
+    return &table->fat_writes[lo];
+}
+
+static bool fat_writes_conflict(const struct dedup_entry *entry, const struct fat_write_use *uses, int use_count)
+{
+    for (int i = 0; i < use_count; i++) {
+        for (int j = 0; j < entry->fat_write_task_count; j++) {
+            if (entry->fat_write_tasks[j] == uses[i].task)
+                return true;
+        }
+    }
+    return false;
+}
+
+static void add_fat_write_tasks(struct dedup_entry *entry, const struct fat_write_use *uses, int use_count)
+{
+    if (use_count == 0)
+        return;
+
+    entry->fat_write_tasks = (int *) realloc(entry->fat_write_tasks, (entry->fat_write_task_count + use_count) * sizeof(int));
+    if (!entry->fat_write_tasks)
+        fwup_err(EXIT_FAILURE, "realloc");
+    for (int i = 0; i < use_count; i++)
+        entry->fat_write_tasks[entry->fat_write_task_count++] = uses[i].task;
+}
+
+/**
+ * Point a file-resource at an earlier one with the same contents so that
+ * the contents are only stored in the archive once. Otherwise, add it to
+ * the table so that later resources can refer to it.
+ */
+static int deduplicate_resource(struct dedup_table *table, cfg_t *sec)
+{
+    // Chunked resources don't store all of their contents
+    if (cfg_size(sec, "chunks") > 0)
+        return 0;
+
+    struct dedup_entry *new_entry = (struct dedup_entry *) calloc(1, sizeof(struct dedup_entry));
+    if (!new_entry)
+        fwup_err(EXIT_FAILURE, "calloc");
+    new_entry->resource = sec;
+    new_entry->hash = cfg_getstr(sec, "blake2b-256");
+    sparse_file_init(&new_entry->sfm);
+    if (sparse_file_get_map_from_resource(sec, &new_entry->sfm) < 0) {
+        sparse_file_free(&new_entry->sfm);
+        free(new_entry);
+        return -1;
+    }
+
+    int use_count;
+    const struct fat_write_use *uses = find_fat_writes(table, cfg_title(sec), &use_count);
+
+    size_t bucket = dedup_bucket(table, new_entry->hash);
+    if (cfg_getbool(sec, "deduplicate")) {
+        for (struct dedup_entry *entry = table->buckets[bucket]; entry != NULL; entry = entry->next) {
+            if (strcmp(entry->hash, new_entry->hash) != 0 ||
+                    entry->sfm.map_len != new_entry->sfm.map_len ||
+                    memcmp(entry->sfm.map, new_entry->sfm.map, entry->sfm.map_len * sizeof(off_t)) != 0)
+                continue;
+
+            if (fat_writes_conflict(entry, uses, use_count)) {
+                INFO("'%s' has the same contents as '%s', but both are written with fat_write in one task so it will be stored again", cfg_title(sec), cfg_title(entry->resource));
+                continue;
+            }
+
+            INFO("'%s' has the same contents as '%s' so it won't be stored again", cfg_title(sec), cfg_title(entry->resource));
+            cfg_setstr(sec, "duplicate-of", cfg_title(entry->resource));
+            add_fat_write_tasks(entry, uses, use_count);
+
+            sparse_file_free(&new_entry->sfm);
+            free(new_entry);
+            return 0;
+        }
+    }
+
+    // Keep the buckets in order so that the earliest match is found first
+    add_fat_write_tasks(new_entry, uses, use_count);
+    struct dedup_entry **tail = &table->buckets[bucket];
+    while (*tail)
+        tail = &(*tail)->next;
+    *tail = new_entry;
+    return 0;
+}
+
+static int deduplicate_resources(cfg_t *cfg)
+{
+    int rc = 0;
+    struct dedup_table table;
+    dedup_init(cfg, &table);
+
+    cfg_t *sec;
+    int i = 0;
+    while ((sec = cfg_getnsec(cfg, "file-resource", i++)) != NULL)
+        OK_OR_CLEANUP(deduplicate_resource(&table, sec));
+
+cleanup:
+    dedup_free(&table);
+    return rc;
+}
+
 static int compute_file_metadata(cfg_t *cfg)
 {
     cfg_t *sec;
@@ -140,10 +566,21 @@ static int compute_file_metadata(cfg_t *cfg)
             OK_OR_RETURN(run_on_each_path(sec, paths, calc_hash, &state));
 
             crypto_blake2b_final(&state.hash_state, hash);
+
+            // Split into chunks if there's a seed to compare against
+            const char *seed_paths = cfg_getstr(sec, "chunk-seed-host-path");
+            if (seed_paths) {
+                if (state.sfm.map_len != 1)
+                    ERR_RETURN("file-resource '%s' can't skip holes and use chunk-seed-host-path", cfg_title(sec));
+
+                OK_OR_RETURN(compute_chunks(sec, paths, seed_paths));
+            }
             sparse_file_free(&state.sfm);
         } else {
             const char *contents = cfg_getstr(sec, "contents");
             assert(contents); // config file verification guarantees either paths or contents are defined
+            if (cfg_getstr(sec, "chunk-seed-host-path"))
+                ERR_RETURN("file-resource '%s' needs a host-path to use chunk-seed-host-path", cfg_title(sec));
             size_t len = strlen(contents);
 #if (SIZEOF_INT == 4 && SIZEOF_OFF_T > 4)
             // See cfgfile.c for why we have to do this.
@@ -157,9 +594,14 @@ static int compute_file_metadata(cfg_t *cfg)
         char hash_str[sizeof(hash) * 2 + 1];
         bytes_to_hex(hash, hash_str, sizeof(hash));
         cfg_setstr(sec, "blake2b-256", hash_str);
+
+        const char *delta_source_paths = cfg_getstr(sec, "delta-source-host-path");
+        if (delta_source_paths)
+            OK_OR_RETURN(compute_delta_source(sec, delta_source_paths));
+
     }
 
-    return 0;
+    return deduplicate_resources(cfg);
 }
 
 static int resource_name_to_archive_path(const char *resource_name, char *archive_path)
@@ -195,11 +637,184 @@ static int resource_name_to_archive_path(const char *resource_name, char *archiv
     return 0;
 }
 
+// Look at this many evenly spaced parts of each file to decide whether
+// it's worth compressing
+#define COMPRESSION_SAMPLE_COUNT 16
+#define COMPRESSION_SAMPLE_SIZE  4096
+
+struct compression_sample_state
+{
+    uint64_t histogram[256];
+    uint64_t total;
+};
+
+static int sample_for_compression(int fd, void *cookie)
+{
+    struct compression_sample_state *state = (struct compression_sample_state *) cookie;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        ERR_RETURN("can't stat file: %s", strerror(errno));
+
+    // Compressed kernels and filesystem images often start with headers
+    // or loaders that aren't compressed, so don't just look at the start.
+    off_t stride = st.st_size / COMPRESSION_SAMPLE_COUNT;
+    for (int i = 0; i < COMPRESSION_SAMPLE_COUNT; i++) {
+        uint8_t buffer[COMPRESSION_SAMPLE_SIZE];
+        ssize_t len = pread(fd, buffer, sizeof(buffer), i * stride);
+        if (len < 0)
+            ERR_RETURN("error reading file: %s", strerror(errno));
+
+        for (ssize_t j = 0; j < len; j++)
+            state->histogram[buffer[j]]++;
+        state->total += len;
+
+        if (stride < COMPRESSION_SAMPLE_SIZE)
+            break;
+    }
+    return 0;
+}
+
+static bool looks_incompressible(const struct compression_sample_state *state)
+{
+    // Small resources don't gain much from being stored.
+    if (state->total < COMPRESSION_SAMPLE_SIZE)
+        return false;
+
+    // Compressed and encrypted data have nearly evenly distributed byte
+    // values. Compare the sum of the squared counts to what it would be if
+    // they were perfectly even. This is within a few percent for random
+    // data and well over for anything that deflate can shrink.
+    uint64_t sum_of_squares = 0;
+    for (int i = 0; i < 256; i++)
+        sum_of_squares += state->histogram[i] * state->histogram[i];
+
+    return sum_of_squares * 256 * 100 < state->total * state->total * 108;
+}
+
+static int select_compression_method(cfg_t *sec, const char *paths, uint16_t *method)
+{
+    const char *compression = cfg_getstr(sec, "compression");
+    if (strcmp(compression, "store") == 0) {
+        *method = ZIP_METHOD_STORE;
+    } else if (strcmp(compression, "deflate") == 0) {
+        *method = ZIP_METHOD_DEFLATE;
+    } else {
+        struct compression_sample_state state;
+        memset(&state, 0, sizeof(state));
+        OK_OR_RETURN(run_on_each_path(sec, paths, sample_for_compression, &state));
+
+        if (looks_incompressible(&state)) {
+            INFO("Storing '%s' uncompressed since it doesn't look compressible", cfg_title(sec));
+            *method = ZIP_METHOD_STORE;
+        } else {
+            *method = ZIP_METHOD_DEFLATE;
+        }
+    }
+    return 0;
+}
+
+/**
+ * A previous version of the firmware update can be passed in so that
+ * resources that haven't changed don't need to be compressed again. Any
+ * resource in it with the same BLAKE2b-256 hash has the same data in the
+ * archive, so its compressed entry is copied over as is. Since libarchive
+ * can't write compressed data directly, these resources get empty
+ * placeholders when the archive is created and then the previous entries
+ * are spliced in.
+ */
+struct previous_firmware
+{
+    cfg_t *cfg;
+    struct zip_index index;
+
+    // The placeholders and the entries that replace them
+    char **names;
+    const struct zip_index_entry **entries;
+    int count;
+};
+
+static void previous_firmware_init(struct previous_firmware *prev)
+{
+    memset(prev, 0, sizeof(struct previous_firmware));
+    zip_index_init(&prev->index);
+}
+
+static int previous_firmware_open(struct previous_firmware *prev, const char *filename)
+{
+    // The previous firmware is only used as a cache, so its signature
+    // doesn't matter. Entries are only used if their hashes match.
+    unsigned char *no_public_keys[] = { NULL };
+    OK_OR_RETURN(cfgfile_parse_fw_meta_conf(filename, &prev->cfg, no_public_keys));
+    return zip_index_open(&prev->index, filename);
+}
+
+static const struct zip_index_entry *previous_firmware_find(const struct previous_firmware *prev,
+                                                             cfg_t *sec,
+                                                             off_t data_len,
+                                                             const struct chunk_list *chunks,
+                                                             uint16_t method)
+{
+    // Chunked resources only store what's not in their seed, so the hash
+    // doesn't say what's in the archive.
+    if (!prev || chunks->count > 0)
+        return NULL;
+
+    const char *hash = cfg_getstr(sec, "blake2b-256");
+    cfg_t *prev_sec;
+    int i = 0;
+    while ((prev_sec = cfg_getnsec(prev->cfg, "file-resource", i++)) != NULL) {
+        const char *prev_hash = cfg_getstr(prev_sec, "blake2b-256");
+        if (!prev_hash || strcmp(prev_hash, hash) != 0 || cfg_size(prev_sec, "chunks") > 0)
+            continue;
+
+        char archive_path[FWFILE_MAX_ARCHIVE_PATH];
+        if (resource_name_to_archive_path(cfg_title(prev_sec), archive_path) < 0)
+            continue;
+
+        // The level isn't recorded, so only the method can be checked.
+        const struct zip_index_entry *entry = zip_index_find(&prev->index, archive_path);
+        if (entry &&
+                entry->method == method &&
+                entry->uncompressed_size == data_len)
+            return entry;
+    }
+    return NULL;
+}
+
+static void previous_firmware_add(struct previous_firmware *prev, const char *archive_path, const struct zip_index_entry *entry)
+{
+    prev->names = realloc(prev->names, (prev->count + 1) * sizeof(char *));
+    prev->entries = realloc(prev->entries, (prev->count + 1) * sizeof(struct zip_index_entry *));
+    if (!prev->names || !prev->entries)
+        fwup_err(EXIT_FAILURE, "realloc");
+
+    prev->names[prev->count] = strdup(archive_path);
+    if (!prev->names[prev->count])
+        fwup_err(EXIT_FAILURE, "strdup");
+    prev->entries[prev->count] = entry;
+    prev->count++;
+}
+
+static void previous_firmware_free(struct previous_firmware *prev)
+{
+    for (int i = 0; i < prev->count; i++)
+        free(prev->names[i]);
+    free(prev->names);
+    free(prev->entries);
+    zip_index_close(&prev->index);
+    if (prev->cfg)
+        cfgfile_free(prev->cfg);
+    previous_firmware_init(prev);
+}
+
 static int add_file_resource(cfg_t *sec,
                              struct archive *a,
                              const char *local_paths,
                              const struct sparse_file_map *sfm,
-                             const struct fwfile_assertions *assertions)
+                             const struct chunk_list *chunks,
+                             const struct fwfile_assertions *assertions,
+                             struct previous_firmware *prev)
 {
     int rc = 0;
     struct archive_entry *entry = archive_entry_new();
@@ -223,7 +838,18 @@ static int add_file_resource(cfg_t *sec,
     char archive_path[FWFILE_MAX_ARCHIVE_PATH];
     OK_OR_CLEANUP(resource_name_to_archive_path(cfg_title(sec), archive_path));
 
-    off_t data_len = sparse_file_data_size(sfm);
+    // Chunked resources only include what's not on the device already
+    off_t data_len = chunks->count > 0 ? chunk_list_stored_size(chunks) : sparse_file_data_size(sfm);
+
+    uint16_t method;
+    OK_OR_CLEANUP(select_compression_method(sec, local_paths, &method));
+
+    const struct zip_index_entry *previous_entry = previous_firmware_find(prev, sec, data_len, chunks, method);
+    if (previous_entry) {
+        INFO("Reusing '%s' from the previous firmware", cfg_title(sec));
+        previous_firmware_add(prev, archive_path, previous_entry);
+        data_len = 0;
+    }
 
     archive_entry_set_pathname(entry, archive_path);
     archive_entry_set_size(entry, data_len);
@@ -232,12 +858,29 @@ static int add_file_resource(cfg_t *sec,
     archive_entry_set_ctime(entry, get_creation_time_t(), 0);
     archive_entry_set_mtime(entry, get_creation_time_t(), 0);
     archive_entry_set_atime(entry, get_creation_time_t(), 0);
-    archive_write_header(a, entry);
 
-    struct write_file_state state;
-    state.a = a;
-    sparse_file_start_read(sfm, &state.read_iterator);
-    OK_OR_CLEANUP(run_on_each_path(sec, local_paths, write_file_to_archive, &state));
+    // libarchive picks up the compression method when the header is
+    // written. Everything else is deflated.
+    if (method == ZIP_METHOD_STORE)
+        archive_write_zip_set_compression_store(a);
+    archive_write_header(a, entry);
+    archive_write_zip_set_compression_deflate(a);
+
+    if (previous_entry) {
+        // Spliced in later
+    } else if (chunks->count > 0) {
+        struct write_chunks_state state;
+        state.a = a;
+        state.chunks = chunks;
+        state.index = 0;
+        state.offset_in_chunk = 0;
+        OK_OR_CLEANUP(run_on_each_path(sec, local_paths, write_chunks_to_archive, &state));
+    } else {
+        struct write_file_state state;
+        state.a = a;
+        sparse_file_start_read(sfm, &state.read_iterator);
+        OK_OR_CLEANUP(run_on_each_path(sec, local_paths, write_file_to_archive, &state));
+    }
 
 cleanup:
     archive_entry_free(entry);
@@ -275,7 +918,7 @@ cleanup:
     return rc;
 }
 
-static int add_file_resources(cfg_t *cfg, struct archive *a)
+static int add_file_resources(cfg_t *cfg, struct archive *a, struct previous_firmware *prev)
 {
     cfg_t *sec;
     int i = 0;
@@ -283,8 +926,14 @@ static int add_file_resources(cfg_t *cfg, struct archive *a)
 
     struct sparse_file_map sfm;
     sparse_file_init(&sfm);
+    struct chunk_list chunks;
+    chunk_list_init(&chunks);
 
     while ((sec = cfg_getnsec(cfg, "file-resource", i++)) != NULL) {
+        // Duplicates are written from the resource that they duplicate
+        if (cfg_getstr(sec, "duplicate-of"))
+            continue;
+
         const char *hostpath = cfg_getstr(sec, "host-path");
         if (hostpath) {
             struct fwfile_assertions assertions;
@@ -292,8 +941,9 @@ static int add_file_resources(cfg_t *cfg, struct archive *a)
             assertions.assert_gte = cfg_getint(sec, "assert-size-gte") * FWUP_BLOCK_SIZE;
 
             OK_OR_CLEANUP(sparse_file_get_map_from_resource(sec, &sfm));
+            OK_OR_CLEANUP(chunk_list_get_from_resource(sec, &chunks));
 
-            OK_OR_CLEANUP(add_file_resource(sec, a, hostpath, &sfm, &assertions));
+            OK_OR_CLEANUP(add_file_resource(sec, a, hostpath, &sfm, &chunks, &assertions, prev));
         } else {
             const char *contents = cfg_getstr(sec, "contents");
             OK_OR_CLEANUP(add_string_resource(a, cfg_title(sec), contents));
@@ -302,10 +952,11 @@ static int add_file_resources(cfg_t *cfg, struct archive *a)
 
 cleanup:
     sparse_file_free(&sfm);
+    chunk_list_free(&chunks);
     return rc;
 }
 
-static int create_archive(cfg_t *cfg, const char *filename, const unsigned char *signing_key, int compression_level)
+static int create_archive(cfg_t *cfg, const char *filename, const unsigned char *signing_key, int compression_level, struct previous_firmware *prev)
 {
     int rc = 0;
     struct archive *a = archive_write_new();
@@ -323,7 +974,7 @@ static int create_archive(cfg_t *cfg, const char *filename, const unsigned char
 
     OK_OR_CLEANUP(fwfile_add_meta_conf(cfg, a, signing_key));
 
-    OK_OR_CLEANUP(add_file_resources(cfg, a));
+    OK_OR_CLEANUP(add_file_resources(cfg, a, prev));
 
 cleanup:
     archive_write_close(a);
@@ -332,10 +983,75 @@ cleanup:
     return rc;
 }
 
+static char *temp_filename_for(const char *filename, const char *suffix)
+{
+    size_t len = strlen(filename) + strlen(suffix) + 1;
+    char *temp_filename = malloc(len);
+    if (!temp_filename)
+        fwup_err(EXIT_FAILURE, "malloc");
+    snprintf(temp_filename, len, "%s%s", filename, suffix);
+    return temp_filename;
+}
+
+static int create_archive_from_previous(cfg_t *cfg,
+                                        const char *filename,
+                                        const unsigned char *signing_key,
+                                        int compression_level,
+                                        const char *previous_firmware)
+{
+    if (!filename)
+        ERR_RETURN("specify an output file with -o to reuse a previous firmware update");
+
+    int rc = 0;
+    struct previous_firmware prev;
+    previous_firmware_init(&prev);
+    struct zip_index placeholders;
+    zip_index_init(&placeholders);
+
+    // The output can be the previous firmware, so it's only replaced at the end.
+    char *placeholder_filename = temp_filename_for(filename, ".tmp");
+    char *spliced_filename = temp_filename_for(filename, ".spliced.tmp");
+
+    OK_OR_CLEANUP(previous_firmware_open(&prev, previous_firmware));
+
+    // Compress everything that changed and leave placeholders for the rest
+    OK_OR_CLEANUP(create_archive(cfg, placeholder_filename, signing_key, compression_level, &prev));
+
+    OK_OR_CLEANUP(zip_index_open(&placeholders, placeholder_filename));
+    OK_OR_CLEANUP(zip_splice(&placeholders,
+                             &prev.index,
+                             (const char * const *) prev.names,
+                             prev.entries,
+                             prev.count,
+                             spliced_filename));
+
+    // Close everything before renaming for Windows.
+    zip_index_close(&placeholders);
+    previous_firmware_free(&prev);
+
+#ifdef _WIN32
+    // On Windows, the output file must not exist or the rename fails.
+    if (unlink(filename) < 0 && errno != ENOENT)
+        ERR_CLEANUP_MSG("Error overwriting '%s': %s", filename, strerror(errno));
+#endif
+    if (rename(spliced_filename, filename) < 0)
+        ERR_CLEANUP_MSG("Error updating '%s': %s", filename, strerror(errno));
+
+cleanup:
+    zip_index_close(&placeholders);
+    previous_firmware_free(&prev);
+    unlink(placeholder_filename);
+    unlink(spliced_filename);
+    free(placeholder_filename);
+    free(spliced_filename);
+    return rc;
+}
+
 int fwup_create(const char *configfile,
                 const char *output_firmware,
                 const unsigned char *signing_key,
-                int compression_level)
+                int compression_level,
+                const char *previous_firmware)
 {
     cfg_t *cfg = NULL;
     int rc = 0;
@@ -347,7 +1063,10 @@ int fwup_create(const char *configfile,
     OK_OR_CLEANUP(compute_file_metadata(cfg));
 
     // Create the archive
-    OK_OR_CLEANUP(create_archive(cfg, output_firmware, signing_key, compression_level));
+    if (previous_firmware)
+        OK_OR_CLEANUP(create_archive_from_previous(cfg, output_firmware, signing_key, compression_level, previous_firmware));
+    else
+        OK_OR_CLEANUP(create_archive(cfg, output_firmware, signing_key, compression_level, NULL));
 
 cleanup:
     if (cfg)
@@ -22,6 +22,7 @@
 #include <archive.h>
 #include <archive_entry.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -86,11 +87,13 @@ int fwup_sign(const char *input_filename, const char *output_filename, const uns
                 ERR_CLEANUP_MSG("Invalid firmware. More than one meta.conf found");
 
             off_t configtxt_len;
-            if (archive_read_all_data(in, in_ae, &configtxt, 50000, &configtxt_len) < 0)
+            if (archive_read_all_data(in, in_ae, &configtxt, fwup_max_meta_conf_size + 1, &configtxt_len) < 0)
                 ERR_CLEANUP_MSG("Error reading meta.conf from archive.");
 
-            if (configtxt_len < 10 || configtxt_len >= 50000)
-                ERR_CLEANUP_MSG("Unexpected meta.conf size: %d", configtxt_len);
+            if (configtxt_len < 10)
+                ERR_CLEANUP_MSG("Unexpected meta.conf size: %d", (int) configtxt_len);
+            if (configtxt_len > fwup_max_meta_conf_size)
+                ERR_CLEANUP_MSG("meta.conf is bigger than %" PRId64 " bytes. Try increasing --max-meta-conf-size.", (int64_t) fwup_max_meta_conf_size);
 
             OK_OR_CLEANUP(fwfile_add_meta_conf_str(configtxt, configtxt_len, out, signing_key));
         } else {
@@ -29,6 +29,7 @@
 #include <stdlib.h>
 #include "monocypher.h"
 #include "fwup_xdelta3.h"
+#include "chunks.h"
 
 #define VERIFICATION_CHUNK_SIZE (64 * 1024)
 
@@ -141,9 +142,79 @@ static int check_xdelta3_resource(struct resource_list *item, const char *file_r
     return 0;
 }
 
-static int check_resource(struct resource_list *list, const char *file_resource_name, struct archive *a, struct archive_entry *ae)
+static int check_chunked_resource(struct resource_list *item, const char *file_resource_name, struct archive *a, struct archive_entry *ae)
 {
-    struct resource_list *item = rlist_find_by_name(list, file_resource_name);
+    // Only the chunks that aren't expected on the device are in the archive,
+    // so check each of those against its digest.
+    const char *expected_hash;
+    OK_OR_RETURN(get_expected_hash(item, file_resource_name, &expected_hash));
+
+    int rc = 0;
+    struct chunk_list chunks;
+    chunk_list_init(&chunks);
+    OK_OR_CLEANUP(chunk_list_get_from_resource(item->resource, &chunks));
+
+    off_t archive_length = archive_entry_size(ae);
+    if (archive_entry_size_is_set(ae) && archive_length != chunk_list_stored_size(&chunks))
+        ERR_CLEANUP_MSG("ZIP local header length mismatch for %s", file_resource_name);
+
+    int index = 0;
+    size_t offset_in_chunk = 0;
+    crypto_blake2b_ctx hash_state;
+    for (;;) {
+        const void *buffer;
+        size_t len;
+        int64_t ignored;
+        int arc = fwup_archive_read_data_block(a, &buffer, &len, &ignored);
+        if (arc == ARCHIVE_EOF)
+            break;
+        else if (arc != ARCHIVE_OK)
+            ERR_CLEANUP_MSG("%s", archive_error_string(a));
+
+        const uint8_t *data = (const uint8_t *) buffer;
+        while (len > 0) {
+            while (index < chunks.count && !chunks.chunks[index].stored)
+                index++;
+            if (index == chunks.count)
+                ERR_CLEANUP_MSG("Too much data for chunked resource %s", file_resource_name);
+
+            const struct chunk_info *ci = &chunks.chunks[index];
+            if (offset_in_chunk == 0)
+                crypto_blake2b_general_init(&hash_state, FWUP_BLAKE2b_256_LEN, NULL, 0);
+
+            size_t to_hash = ci->len - offset_in_chunk;
+            if (to_hash > len)
+                to_hash = len;
+            crypto_blake2b_update(&hash_state, data, to_hash);
+            data += to_hash;
+            len -= to_hash;
+            offset_in_chunk += to_hash;
+
+            if (offset_in_chunk == ci->len) {
+                uint8_t hash[FWUP_BLAKE2b_256_LEN];
+                crypto_blake2b_final(&hash_state, hash);
+                if (memcmp(hash, ci->digest, sizeof(hash)) != 0)
+                    ERR_CLEANUP_MSG("Detected blake2b digest mismatch in chunk %d of %s", index, file_resource_name);
+
+                index++;
+                offset_in_chunk = 0;
+            }
+        }
+    }
+
+    while (index < chunks.count && !chunks.chunks[index].stored)
+        index++;
+    if (index != chunks.count)
+        ERR_CLEANUP_MSG("ZIP data length mismatch for %s", file_resource_name);
+
+cleanup:
+    chunk_list_free(&chunks);
+    return rc;
+}
+
+static int check_resource(const struct resource_table *resources, const char *file_resource_name, struct archive *a, struct archive_entry *ae)
+{
+    struct resource_list *item = rlist_find_by_name(resources, file_resource_name);
     if (!item)
         ERR_RETURN("Can't find file-resource for %s", file_resource_name);
 
@@ -164,7 +235,10 @@ static int check_resource(struct resource_list *list, const char *file_resource_
     if (archive_length < 0)
         ERR_RETURN("Missing file length in archive for %s", file_resource_name);
 
-    if (sparse_segments == 1 && archive_entry_size_is_set(ae) && archive_length != expected_length) {
+    if (cfg_size(item->resource, "chunks") > 0) {
+        // Chunked resource
+        return check_chunked_resource(item, file_resource_name, a, ae);
+    } else if (sparse_segments == 1 && archive_entry_size_is_set(ae) && archive_length != expected_length) {
         // Possible xdelta3 patch
         return check_xdelta3_resource(item, file_resource_name, a, ae);
     } else {
@@ -177,6 +251,25 @@ static int check_resource(struct resource_list *list, const char *file_resource_
     }
 }
 
+static int check_duplicate_resource(const struct resource_table *resources, struct resource_list *item)
+{
+    const char *file_resource_name = cfg_title(item->resource);
+    const char *original_name = cfg_getstr(item->resource, "duplicate-of");
+    const struct resource_list *original = rlist_find_by_name(resources, original_name);
+    if (!original || !original->processed)
+        ERR_RETURN("Resource %s is a duplicate of %s, but %s not found in archive", file_resource_name, original_name, original_name);
+
+    // The original's data was checked against its hash, so the duplicate
+    // only needs to describe the same data.
+    const char *hash = cfg_getstr(item->resource, "blake2b-256");
+    const char *original_hash = cfg_getstr(original->resource, "blake2b-256");
+    if (!hash || !original_hash || strcmp(hash, original_hash) != 0)
+        ERR_RETURN("Resource %s doesn't have the same contents as %s. Archive is corrupt.", file_resource_name, original_name);
+
+    item->processed = true;
+    return 0;
+}
+
 /**
  * @brief Verify that the firmware archive is ok
  * @param input_filename the firmware update filename
@@ -186,10 +279,11 @@ static int check_resource(struct resource_list *list, const char *file_resource_
 int fwup_verify(const char *input_filename, unsigned char * const *public_keys)
 {
     unsigned char *meta_conf_signature = NULL;
-    struct resource_list *all_resources = NULL;
+    struct resource_table all_resources;
     cfg_t *cfg = NULL;
     int rc = 0;
 
+    rlist_init(&all_resources);
     struct archive *a = archive_read_new();
     archive_read_support_format_zip(a);
 
@@ -230,11 +324,13 @@ int fwup_verify(const char *input_filename, unsigned char * const *public_keys)
         char resource_name[FWFILE_MAX_ARCHIVE_PATH];
 
         OK_OR_CLEANUP(archive_filename_to_resource(filename, resource_name, sizeof(resource_name)));
-        OK_OR_CLEANUP(check_resource(all_resources, resource_name, a, ae));
+        OK_OR_CLEANUP(check_resource(&all_resources, resource_name, a, ae));
     }
 
     // Check that all resources have been validated
-    for (struct resource_list *r = all_resources; r != NULL; r = r->next) {
+    for (struct resource_list *r = all_resources.list; r != NULL; r = r->next) {
+        if (!r->processed && cfg_getstr(r->resource, "duplicate-of"))
+            OK_OR_CLEANUP(check_duplicate_resource(&all_resources, r));
         if (!r->processed)
             ERR_CLEANUP_MSG("Resource %s not found in archive", cfg_title(r->resource));
     }
@@ -250,7 +346,7 @@ int fwup_verify(const char *input_filename, unsigned char * const *public_keys)
     fwup_output(FRAMING_TYPE_SUCCESS, 0, success_message);
 
 cleanup:
-    rlist_free(all_resources);
+    rlist_free(&all_resources);
     archive_read_close(a);
     archive_read_free(a);
 
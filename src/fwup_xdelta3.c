@@ -17,7 +17,6 @@ void xdelta_init(struct xdelta_state *xd, xdelta_read_patch_block *read_patch, x
     xd3_config_stream(&xd->stream, &config);
 
     xd->source.blksize = READ_SIZE;
-    xd->source.curblk = malloc(READ_SIZE);
 
     xd->read_patch = read_patch;
     xd->pread_source = pread_source;
@@ -27,7 +26,10 @@ void xdelta_init(struct xdelta_state *xd, xdelta_read_patch_block *read_patch, x
 
 void xdelta_free(struct xdelta_state *xd)
 {
-    free((void*) xd->source.curblk);
+    for (int i = 0; i < XDELTA_SOURCE_BLOCKS; i++) {
+        free(xd->source_blocks[i].data);
+        xd->source_blocks[i].data = NULL;
+    }
     xd->source.curblk = 0;
 
     xd3_close_stream(&xd->stream);
@@ -64,13 +66,45 @@ static int xdelta_read_more(struct xdelta_state *xd)
 
 static int xdelta_read_source_block(struct xdelta_state *xd, xoff_t blkno)
 {
-    int rc = xd->pread_source(xd->cookie,
-                              (void *) xd->source.curblk,
-                              xd->source.blksize,
-                              xd->source.blksize * blkno);
-    if (rc)
-        return -1;
+    // Look for the block and pick the least recently used one to replace
+    // if it's not there.
+    struct xdelta_source_block *block = NULL;
+    struct xdelta_source_block *victim = &xd->source_blocks[0];
+    for (int i = 0; i < XDELTA_SOURCE_BLOCKS; i++) {
+        struct xdelta_source_block *b = &xd->source_blocks[i];
+        if (b->data && b->blkno == blkno) {
+            block = b;
+            break;
+        }
+        if (victim->data && (!b->data || b->last_used < victim->last_used))
+            victim = b;
+    }
+
+    if (!block) {
+        block = victim;
+        if (!block->data) {
+            block->data = malloc(READ_SIZE);
+            if (!block->data)
+                fwup_err(EXIT_FAILURE, "malloc");
+        }
+
+        int rc = xd->pread_source(xd->cookie,
+                                  block->data,
+                                  xd->source.blksize,
+                                  xd->source.blksize * blkno);
+        if (rc) {
+            // Don't leave a partially read block to be found later
+            if (xd->source.curblk == block->data)
+                xd->source.curblk = NULL;
+            free(block->data);
+            block->data = NULL;
+            return -1;
+        }
+        block->blkno = blkno;
+    }
+    block->last_used = ++xd->source_block_clock;
 
+    xd->source.curblk = block->data;
     xd->source.onblk = xd->source.blksize;
     xd->source.curblkno = blkno;
 
@@ -108,6 +142,17 @@ static int xdelta_read_impl(struct xdelta_state *xd, const void **buffer, size_t
     }
 }
 
+/**
+ * Don't verify the Adler32 checksums in the patch
+ *
+ * Call this when the source has already been checked. The output's hash is
+ * checked either way, so this only saves the time spent on checksums.
+ */
+void xdelta_skip_checksums(struct xdelta_state *xd)
+{
+    xd3_set_flags(&xd->stream, XD3_ADLER32_NOVER | xd->stream.flags);
+}
+
 /**
  * Read from an xdelta-encoded source
  *
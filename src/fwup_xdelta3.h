@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 // Force XD3 defines to avoid compiling extra code.
 #define XD3_ENCODER 0
@@ -19,10 +20,23 @@
 typedef int (xdelta_read_patch_block)(void *cookie, const void **buffer, size_t *count);
 typedef int (xdelta_pread_source)(void *cookie, void *buffer, size_t count, off_t offset);
 
+// Copies in a window often jump between a few places in the source, so
+// recently used source blocks are kept rather than read again.
+#define XDELTA_SOURCE_BLOCKS 16
+
+struct xdelta_source_block {
+    uint8_t *data; // NULL until used
+    xoff_t blkno;
+    unsigned int last_used;
+};
+
 struct xdelta_state {
     xd3_stream stream;
     xd3_source source;
 
+    struct xdelta_source_block source_blocks[XDELTA_SOURCE_BLOCKS];
+    unsigned int source_block_clock;
+
     xdelta_read_patch_block *read_patch;
     xdelta_pread_source *pread_source;
     void *cookie;
@@ -32,6 +46,7 @@ struct xdelta_state {
 void xdelta_init(struct xdelta_state *xd, xdelta_read_patch_block *read_patch, xdelta_pread_source *pread_source, void *cookie);
 int xdelta_read(struct xdelta_state *xd, const void **buffer, size_t *count);
 int xdelta_read_header(struct xdelta_state *xd);
+void xdelta_skip_checksums(struct xdelta_state *xd);
 void xdelta_free(struct xdelta_state *xd);
 
 #endif
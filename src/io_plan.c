@@ -0,0 +1,107 @@
+/*
+ * Copyright 2026 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "io_plan.h"
+#include "block_cache.h"
+#include "simple_string.h"
+#include "util.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+
+/**
+ * The I/O plan is what a dry run reports. It lists every range that would
+ * have been written, read, or trimmed on the destination, totals for each,
+ * and an estimate of how long it would take. Reads and writes are in whole
+ * block cache segments since that's what really goes to the destination.
+ * Comparing bytes-written to bytes-requested shows write amplification.
+ */
+
+void io_plan_model_init(struct io_plan_model *model)
+{
+    model->read_speed = IO_PLAN_DEFAULT_READ_SPEED;
+    model->write_speed = IO_PLAN_DEFAULT_WRITE_SPEED;
+    model->sync_time = IO_PLAN_DEFAULT_SYNC_TIME;
+}
+
+/**
+ * @brief Set the read and write speeds from a string
+ *
+ * @param model the model to update
+ * @param speeds "<read MB/s>,<write MB/s>"
+ * @return 0 if successful
+ */
+int io_plan_parse_speeds(struct io_plan_model *model, const char *speeds)
+{
+    char *end;
+    double read_speed = strtod(speeds, &end);
+    if (*end != ',')
+        ERR_RETURN("expecting <read MB/s>,<write MB/s> for the speeds, but got '%s'", speeds);
+
+    double write_speed = strtod(end + 1, &end);
+    if (*end != '\0' || read_speed <= 0 || write_speed <= 0)
+        ERR_RETURN("expecting positive speeds in <read MB/s>,<write MB/s>, but got '%s'", speeds);
+
+    model->read_speed = read_speed * 1024 * 1024;
+    model->write_speed = write_speed * 1024 * 1024;
+    return 0;
+}
+
+static off_t format_ranges(struct simple_string *s, const char *op, const struct block_cache_range_set *set, off_t end_offset)
+{
+    off_t total = 0;
+    for (size_t i = 0; i < set->count; i++) {
+        const struct block_cache_range *range = &set->ranges[i];
+        if (range->end == BLOCK_CACHE_MAX_OFFSET) {
+            // Trimming to the end. Only count what's on the destination.
+            ssprintf(s, "%s %" PRId64 "-end\n", op, (int64_t) range->start);
+            if (end_offset > range->start)
+                total += end_offset - range->start;
+        } else {
+            ssprintf(s, "%s %" PRId64 "-%" PRId64 "\n", op, (int64_t) range->start, (int64_t) range->end);
+            total += range->end - range->start;
+        }
+    }
+    return total;
+}
+
+/**
+ * @brief Format what a dry run found
+ *
+ * @param s where to put the plan
+ * @param stats what was recorded on the dry run
+ * @param end_offset the size of the destination or <= 0 if unknown
+ * @param model how fast the destination is
+ */
+void io_plan_format(struct simple_string *s, const struct block_cache_stats *stats, off_t end_offset, const struct io_plan_model *model)
+{
+    format_ranges(s, "write", &stats->written, end_offset);
+    format_ranges(s, "read", &stats->read, end_offset);
+    off_t bytes_trimmed = format_ranges(s, "trim", &stats->trimmed, end_offset);
+
+    double seconds = stats->bytes_read / model->read_speed +
+                     stats->bytes_written / model->write_speed +
+                     stats->syncs * model->sync_time;
+
+    ssprintf(s, "bytes-requested=%" PRId64 "\n", (int64_t) stats->bytes_requested);
+    ssprintf(s, "bytes-written=%" PRId64 "\n", (int64_t) stats->bytes_written);
+    ssprintf(s, "bytes-read=%" PRId64 "\n", (int64_t) stats->bytes_read);
+    ssprintf(s, "bytes-trimmed=%" PRId64 "\n", (int64_t) bytes_trimmed);
+    ssprintf(s, "syncs=%d\n", stats->syncs);
+    ssprintf(s, "fat-mounts=%d\n", stats->fat_mounts);
+    ssprintf(s, "uboot-env-writes=%d\n", stats->uboot_env_writes);
+    ssprintf(s, "estimated-seconds=%.1f\n", seconds);
+}
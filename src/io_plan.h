@@ -0,0 +1,42 @@
+/*
+ * Copyright 2026 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef IO_PLAN_H
+#define IO_PLAN_H
+
+#include <sys/types.h>
+
+struct block_cache_stats;
+struct simple_string;
+
+// Conservative defaults for an SDCard or eMMC
+#define IO_PLAN_DEFAULT_READ_SPEED  (20 * 1024 * 1024) // bytes/second
+#define IO_PLAN_DEFAULT_WRITE_SPEED (10 * 1024 * 1024) // bytes/second
+#define IO_PLAN_DEFAULT_SYNC_TIME   0.1                // seconds
+
+// A simple throughput model of the destination for estimating how long an
+// update will take
+struct io_plan_model {
+    double read_speed;
+    double write_speed;
+    double sync_time;
+};
+
+void io_plan_model_init(struct io_plan_model *model);
+int io_plan_parse_speeds(struct io_plan_model *model, const char *speeds);
+void io_plan_format(struct simple_string *s, const struct block_cache_stats *stats, off_t end_offset, const struct io_plan_model *model);
+
+#endif // IO_PLAN_H
@@ -122,4 +122,13 @@ int mmc_is_path_at_device_offset(const char *file_path, off_t block_offset);
  */
 int mmc_trim(int fd, off_t offset, off_t count);
 
+/**
+ * @brief Have the device zero a range without sending it the data
+ * @param fd
+ * @param offset
+ * @param count
+ * @return 0 if the range reads back as zeros; -1 if not supported
+ */
+int mmc_zeroout(int fd, off_t offset, off_t count);
+
 #endif // MMC_H
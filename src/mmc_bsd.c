@@ -207,4 +207,13 @@ int mmc_trim(int fd, off_t offset, off_t count)
     return 0;
 }
 
+int mmc_zeroout(int fd, off_t offset, off_t count)
+{
+    // Not implemented
+    (void) fd;
+    (void) offset;
+    (void) count;
+    return -1;
+}
+
 #endif // __FreeBSD__
@@ -41,6 +41,9 @@
 #ifndef BLKDISCARD
 #define BLKDISCARD _IO(0x12,119)
 #endif
+#ifndef BLKZEROOUT
+#define BLKZEROOUT _IO(0x12,127)
+#endif
 
 struct mmc_device_info
 {
@@ -445,5 +448,13 @@ int mmc_trim(int fd, off_t offset, off_t count)
     return 0;
 }
 
+int mmc_zeroout(int fd, off_t offset, off_t count)
+{
+    uint64_t range[2] = {offset, count};
+
+    // This fails on regular files and on kernels without it. The caller
+    // writes zeros instead.
+    return ioctl(fd, BLKZEROOUT, &range) == 0 ? 0 : -1;
+}
 
 #endif // __linux__
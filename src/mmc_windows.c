@@ -321,4 +321,13 @@ int mmc_trim(int fd, off_t offset, off_t count)
     (void) count;
     return 0;
 }
+
+int mmc_zeroout(int fd, off_t offset, off_t count)
+{
+    // Not implemented
+    (void) fd;
+    (void) offset;
+    (void) count;
+    return -1;
+}
 #endif // defined(_WIN32) || defined(__CYGWIN__)
@@ -51,16 +51,40 @@ static int encrypt_and_pwrite(struct pad_to_block_writer *ptbw, uint8_t *buf, si
 
 static int encrypt_and_pwrite_const(struct pad_to_block_writer *ptbw, const uint8_t *buf, size_t count, off_t offset, bool streamed)
 {
-    if (ptbw->dc) {
-        // If encrypting and we can't encrypt in-place, then encrypt to a temporary buffer.
-        uint8_t *tmp = malloc(count);
-        disk_crypto_encrypt(ptbw->dc, buf, tmp, count, offset);
-        int rc = block_cache_pwrite(ptbw->output, tmp, count, offset, streamed);
-        free(tmp);
-        return rc;
-    } else {
+    if (!ptbw->dc)
         return block_cache_pwrite(ptbw->output, buf, count, offset, streamed);
+
+    // If encrypting and we can't encrypt in-place, then encrypt whole
+    // segments directly into the cache and anything else to a temporary buffer.
+    uint8_t *tmp = NULL;
+    int rc = 0;
+    while (count > 0) {
+        size_t segment_remainder = BLOCK_CACHE_SEGMENT_SIZE - (offset & ~BLOCK_CACHE_SEGMENT_MASK);
+        size_t to_write = min(count, segment_remainder);
+
+        if (streamed && to_write == BLOCK_CACHE_SEGMENT_SIZE) {
+            uint8_t *data;
+            OK_OR_CLEANUP(block_cache_reserve_segment(ptbw->output, offset, &data));
+            disk_crypto_encrypt(ptbw->dc, buf, data, to_write, offset);
+            OK_OR_CLEANUP(block_cache_commit_segment(ptbw->output, offset));
+        } else {
+            if (!tmp) {
+                tmp = malloc(BLOCK_CACHE_SEGMENT_SIZE);
+                if (!tmp)
+                    fwup_err(EXIT_FAILURE, "malloc");
+            }
+            disk_crypto_encrypt(ptbw->dc, buf, tmp, to_write, offset);
+            OK_OR_CLEANUP(block_cache_pwrite(ptbw->output, tmp, to_write, offset, streamed));
+        }
+
+        buf += to_write;
+        count -= to_write;
+        offset += to_write;
     }
+
+cleanup:
+    free(tmp);
+    return rc;
 }
 
 void ptbw_init(struct pad_to_block_writer *ptbw, struct block_cache *output, struct disk_crypto *dc)
@@ -0,0 +1,391 @@
+/*
+ * Copyright 2026 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "readback.h"
+#include "block_cache.h"
+#include "monocypher.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * The readback check proves that the resources written by raw_write are
+ * really on the destination. It runs after all of the on-resource handlers
+ * so that everything can be read back at once and hashed in parallel. The
+ * result is compared against the resource's BLAKE2b-256 hash from meta.conf,
+ * so any problem between decompression and the media shows up before the
+ * on-finish handler switches over to the new firmware.
+ *
+ * Only the data parts of sparse resources are read since holes aren't
+ * included in the hash. Encrypted resources are decrypted first.
+ */
+
+// Reads are aligned to this so that they work with O_DIRECT
+#define READBACK_ALIGNMENT 4096
+
+enum readback_status {
+    READBACK_OK = 0,
+    READBACK_READ_FAILED,
+    READBACK_MISMATCH
+};
+
+struct readback_job {
+    const struct readback_range *range;
+    int fd;
+
+    enum readback_status status;
+    off_t bad_offset;
+};
+
+struct readback_work {
+    struct readback_job *jobs;
+    int count;
+    int next;
+#if USE_PTHREADS
+    pthread_mutex_t mutex;
+#endif
+};
+
+void readback_init(struct readback_list *list)
+{
+    memset(list, 0, sizeof(struct readback_list));
+}
+
+static void free_range(struct readback_range *range)
+{
+    free(range->resource);
+    sparse_file_free(&range->sfm);
+    if (range->encrypted)
+        disk_crypto_free(&range->dc);
+}
+
+static bool ranges_overlap(const struct readback_range *a, const struct readback_range *b)
+{
+    off_t a_end = a->dest_offset + sparse_file_size(&a->sfm);
+    off_t b_end = b->dest_offset + sparse_file_size(&b->sfm);
+    return a->dest_offset < b_end && b->dest_offset < a_end;
+}
+
+/**
+ * Forget ranges that were written or trimmed since the last time since they
+ * can't be checked any more. This needs block_cache_track_changes() to have
+ * been called on bc.
+ */
+static void drop_changed_ranges(struct readback_list *list, struct block_cache *bc)
+{
+    int j = 0;
+    for (int i = 0; i < list->count; i++) {
+        struct readback_range *range = &list->ranges[i];
+        if (block_cache_changed(bc, range->dest_offset, sparse_file_size(&range->sfm)))
+            free_range(range);
+        else
+            list->ranges[j++] = *range;
+    }
+    list->count = j;
+    block_cache_clear_changes(bc);
+}
+
+/**
+ * @brief Remember a resource that was written so that it can be checked later
+ *
+ * If anything overwrote or trimmed part of a resource that was added before,
+ * the old one is forgotten since it can't be checked any more.
+ *
+ * @param list the ranges to check
+ * @param bc where the resource was written
+ * @param resource the file-resource that was written
+ * @param dest_offset where it was written
+ * @param dc the disk encryption used for the write or NULL if not encrypted
+ * @return 0 if successful
+ */
+int readback_add(struct readback_list *list, struct block_cache *bc, cfg_t *resource, off_t dest_offset, const struct disk_crypto *dc)
+{
+    int rc = 0;
+    struct readback_range range;
+    memset(&range, 0, sizeof(range));
+    sparse_file_init(&range.sfm);
+
+    const char *resource_name = cfg_title(resource);
+
+    const char *expected_hash = cfg_getstr(resource, "blake2b-256");
+    if (!expected_hash || hex_to_bytes(expected_hash, range.expected, FWUP_BLAKE2b_256_LEN) < 0)
+        ERR_CLEANUP_MSG("invalid blake2b hash for '%s'", resource_name);
+
+    OK_OR_CLEANUP(sparse_file_get_map_from_resource(resource, &range.sfm));
+
+    range.resource = strdup(resource_name);
+    if (!range.resource)
+        fwup_err(EXIT_FAILURE, "strdup");
+    range.dest_offset = dest_offset;
+    if (dc) {
+        range.encrypted = true;
+        range.dc = *dc;
+    }
+
+    // The resource's own writes are recorded as changes too, so this also
+    // drops anything it overwrote. Resources written at the same time
+    // aren't recorded separately, so check those against each other.
+    drop_changed_ranges(list, bc);
+    int j = 0;
+    for (int i = 0; i < list->count; i++) {
+        if (ranges_overlap(&list->ranges[i], &range))
+            free_range(&list->ranges[i]);
+        else
+            list->ranges[j++] = list->ranges[i];
+    }
+    list->count = j;
+
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 16;
+        list->ranges = realloc(list->ranges, list->capacity * sizeof(struct readback_range));
+        if (!list->ranges)
+            fwup_err(EXIT_FAILURE, "realloc");
+    }
+    list->ranges[list->count++] = range;
+    return 0;
+
+cleanup:
+    free_range(&range);
+    return rc;
+}
+
+/**
+ * Drop the destination's data from the OS's cache so that the reads come
+ * from the media. Devices are opened with O_DIRECT on Linux, so this is
+ * mostly for image files.
+ */
+static void drop_cached_data(int fd)
+{
+#ifdef POSIX_FADV_DONTNEED
+    (void) posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#else
+    (void) fd;
+#endif
+}
+
+static off_t round_up(off_t value, off_t alignment)
+{
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+static int read_and_hash(struct readback_job *job, crypto_blake2b_ctx *hash_state, uint8_t *buffer, off_t offset, off_t len)
+{
+    const struct readback_range *range = job->range;
+    off_t end = offset + len;
+    off_t aligned_end = round_up(end, READBACK_ALIGNMENT);
+
+    while (offset < end) {
+        off_t read_offset = offset & ~(READBACK_ALIGNMENT - 1);
+        size_t to_read = READBACK_READ_SIZE;
+        if (read_offset + (off_t) to_read > aligned_end)
+            to_read = aligned_end - read_offset;
+
+        ssize_t amount_read = pread(job->fd, buffer, to_read, read_offset);
+        off_t read_end = read_offset + (amount_read > 0 ? amount_read : 0);
+        off_t data_end = read_end < end ? read_end : end;
+        if (data_end <= offset)
+            goto read_failed;
+
+        if (range->encrypted) {
+            // Whole blocks were encrypted so they're needed to decrypt.
+            off_t block_offset = offset & ~(FWUP_BLOCK_SIZE - 1);
+            off_t block_end = round_up(data_end, FWUP_BLOCK_SIZE);
+            if (block_end > read_end)
+                goto read_failed;
+
+            uint8_t *blocks = buffer + (block_offset - read_offset);
+            disk_crypto_decrypt((struct disk_crypto *) &range->dc, blocks, blocks, block_end - block_offset, block_offset);
+        }
+
+        crypto_blake2b_update(hash_state, buffer + (offset - read_offset), data_end - offset);
+        offset = data_end;
+    }
+    return 0;
+
+read_failed:
+    job->status = READBACK_READ_FAILED;
+    job->bad_offset = offset;
+    return -1;
+}
+
+static void check_range(struct readback_job *job, uint8_t *buffer)
+{
+    const struct readback_range *range = job->range;
+
+    crypto_blake2b_ctx hash_state;
+    crypto_blake2b_general_init(&hash_state, FWUP_BLAKE2b_256_LEN, NULL, 0);
+
+    // Even entries in the sparse map are data and odd entries are holes.
+    off_t offset = range->dest_offset;
+    for (int i = 0; i < range->sfm.map_len; i++) {
+        off_t len = range->sfm.map[i];
+        if ((i & 1) == 0 && len > 0 &&
+                read_and_hash(job, &hash_state, buffer, offset, len) < 0)
+            return;
+        offset += len;
+    }
+
+    uint8_t digest[FWUP_BLAKE2b_256_LEN];
+    crypto_blake2b_final(&hash_state, digest);
+    if (memcmp(digest, range->expected, sizeof(digest)) != 0)
+        job->status = READBACK_MISMATCH;
+}
+
+static struct readback_job *next_job(struct readback_work *work)
+{
+    struct readback_job *job = NULL;
+#if USE_PTHREADS
+    pthread_mutex_lock(&work->mutex);
+#endif
+    if (work->next < work->count)
+        job = &work->jobs[work->next++];
+#if USE_PTHREADS
+    pthread_mutex_unlock(&work->mutex);
+#endif
+    return job;
+}
+
+static void *readback_worker(void *arg)
+{
+    struct readback_work *work = (struct readback_work *) arg;
+    uint8_t *buffer;
+    alloc_page_aligned((void **) &buffer, READBACK_READ_SIZE);
+
+    struct readback_job *job;
+    while ((job = next_job(work)) != NULL)
+        check_range(job, buffer);
+
+    free(buffer);
+    return NULL;
+}
+
+static void run_jobs(struct readback_work *work)
+{
+#if USE_PTHREADS
+    pthread_t threads[READBACK_MAX_THREADS];
+    int num_threads = 0;
+    int max_threads = work->count < READBACK_MAX_THREADS ? work->count : READBACK_MAX_THREADS;
+
+    pthread_mutex_init(&work->mutex, NULL);
+    for (; num_threads < max_threads; num_threads++) {
+        if (pthread_create(&threads[num_threads], NULL, readback_worker, work) != 0)
+            break;
+    }
+
+    // Make sure that everything gets done even if no threads could be started.
+    if (num_threads == 0)
+        readback_worker(work);
+
+    for (int i = 0; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&work->mutex);
+#else
+    readback_worker(work);
+#endif
+}
+
+static int report_job(const struct readback_job *job)
+{
+    switch (job->status) {
+    case READBACK_READ_FAILED:
+        ERR_RETURN("readback of '%s' failed at offset %" PRId64, job->range->resource, (int64_t) job->bad_offset);
+    case READBACK_MISMATCH:
+        ERR_RETURN("readback of '%s' at offset %" PRId64 " doesn't match its hash", job->range->resource, (int64_t) job->range->dest_offset);
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @brief Read back everything that was added and compare it to the expected hashes
+ *
+ * Everything is made durable first. When programming more than one
+ * destination, each one is checked. Followers that fail are dropped like
+ * they would be for a write error.
+ *
+ * @param list the ranges to check
+ * @param bc the destination
+ * @return 0 if everything matches
+ */
+int readback_check(struct readback_list *list, struct block_cache *bc)
+{
+    drop_changed_ranges(list, bc);
+    if (list->count == 0)
+        return 0;
+
+    OK_OR_RETURN(block_cache_barrier(bc));
+
+    int num_caches = 1 + bc->follower_count;
+    struct block_cache **caches = malloc(num_caches * sizeof(struct block_cache *));
+    struct readback_work work;
+    work.count = num_caches * list->count;
+    work.next = 0;
+    work.jobs = calloc(work.count, sizeof(struct readback_job));
+    if (!caches || !work.jobs)
+        fwup_err(EXIT_FAILURE, "malloc");
+
+    caches[0] = bc;
+    for (int i = 0; i < bc->follower_count; i++)
+        caches[i + 1] = bc->followers[i];
+
+    // Followers that have already failed are left out.
+    work.count = 0;
+    for (int i = 0; i < num_caches; i++) {
+        if (caches[i]->error)
+            continue;
+
+        drop_cached_data(caches[i]->fd);
+        for (int j = 0; j < list->count; j++) {
+            struct readback_job *job = &work.jobs[work.count++];
+            job->range = &list->ranges[j];
+            job->fd = caches[i]->fd;
+        }
+    }
+
+    run_jobs(&work);
+
+    int rc = 0;
+    for (int i = 0; i < work.count; i++) {
+        const struct readback_job *job = &work.jobs[i];
+        if (report_job(job) == 0)
+            continue;
+
+        if (job->fd == bc->fd) {
+            rc = -1;
+            break;
+        }
+
+        for (int j = 1; j < num_caches; j++) {
+            if (caches[j]->fd == job->fd && !caches[j]->error)
+                block_cache_drop_follower(caches[j]);
+        }
+    }
+
+    free(work.jobs);
+    free(caches);
+    return rc;
+}
+
+void readback_free(struct readback_list *list)
+{
+    for (int i = 0; i < list->count; i++)
+        free_range(&list->ranges[i]);
+    free(list->ranges);
+    readback_init(list);
+}
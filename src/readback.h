@@ -0,0 +1,54 @@
+/*
+ * Copyright 2026 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef READBACK_H
+#define READBACK_H
+
+#include <confuse.h>
+#include <stdbool.h>
+
+#include "disk_crypto.h"
+#include "sparse_file.h"
+#include "util.h"
+
+struct block_cache;
+
+#define READBACK_MAX_THREADS 4
+#define READBACK_READ_SIZE   (1024*1024)
+
+// A resource that raw_write put on the destination
+struct readback_range {
+    char *resource;
+    off_t dest_offset;
+    struct sparse_file_map sfm;
+    uint8_t expected[FWUP_BLAKE2b_256_LEN];
+
+    bool encrypted;
+    struct disk_crypto dc;
+};
+
+struct readback_list {
+    struct readback_range *ranges;
+    int count;
+    int capacity;
+};
+
+void readback_init(struct readback_list *list);
+int readback_add(struct readback_list *list, struct block_cache *bc, cfg_t *resource, off_t dest_offset, const struct disk_crypto *dc);
+int readback_check(struct readback_list *list, struct block_cache *bc);
+void readback_free(struct readback_list *list);
+
+#endif // READBACK_H
@@ -20,28 +20,75 @@
 #include <stdlib.h>
 #include <string.h>
 
+static size_t hash_name(const char *name)
+{
+    // FNV-1a
+    size_t hash = 2166136261u;
+    while (*name) {
+        hash ^= (unsigned char) *name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void add_resource(struct resource_table *resources, cfg_t *resource)
+{
+    struct resource_list *new_node = (struct resource_list *) malloc(sizeof(struct resource_list));
+    if (!new_node)
+        fwup_err(EXIT_FAILURE, "malloc");
+
+    size_t bucket = hash_name(cfg_title(resource)) & (resources->bucket_count - 1);
+    new_node->next = resources->list;
+    new_node->bucket_next = resources->buckets[bucket];
+    new_node->resource = resource;
+    new_node->processed = false;
+    resources->list = new_node;
+    resources->buckets[bucket] = new_node;
+}
+
+static void alloc_buckets(struct resource_table *resources, unsigned int count)
+{
+    // Use a power of two number of buckets with at most half of them used.
+    size_t bucket_count = 16;
+    while (bucket_count < 2 * (size_t) count)
+        bucket_count *= 2;
+
+    resources->buckets = (struct resource_list **) calloc(bucket_count, sizeof(struct resource_list *));
+    if (!resources->buckets)
+        fwup_err(EXIT_FAILURE, "calloc");
+    resources->bucket_count = bucket_count;
+}
+
+/**
+ * @brief Initialize an empty resource table
+ *
+ * This is only needed if the table might be freed before it's filled in.
+ *
+ * @param resources the table
+ */
+void rlist_init(struct resource_table *resources)
+{
+    resources->list = NULL;
+    resources->buckets = NULL;
+    resources->bucket_count = 0;
+}
+
 /**
  * @brief Create a list of all resources in an archive
  *
  * @param cfg the meta.conf configuration
- * @param resources the list of resources (could be NULL if none referenced in task)
+ * @param resources the table of resources (the list could be NULL if none)
  * @return 0 on success
  */
-int rlist_get_all(cfg_t *cfg, struct resource_list **resources)
+int rlist_get_all(cfg_t *cfg, struct resource_table *resources)
 {
-    struct resource_list *list = NULL;
-    for (unsigned ix = 0;; ix++) {
-        cfg_t *resource = cfg_getnsec(cfg, "file-resource", ix);
-        if (!resource)
-            break;
-
-        struct resource_list *new_node = (struct resource_list *) malloc(sizeof(struct resource_list));
-        new_node->next = list;
-        new_node->resource = resource;
-        new_node->processed = false;
-        list = new_node;
-    }
-    *resources = list;
+    unsigned int count = cfg_size(cfg, "file-resource");
+
+    rlist_init(resources);
+    alloc_buckets(resources, count);
+    for (unsigned ix = 0; ix < count; ix++)
+        add_resource(resources, cfg_getnsec(cfg, "file-resource", ix));
+
     return 0;
 }
 
@@ -49,64 +96,71 @@ int rlist_get_all(cfg_t *cfg, struct resource_list **resources)
  * @brief Create a list of all resources referenced by a task
  * @param cfg the meta.conf configuration
  * @param task the desired task
- * @param resources the list of resources (could be NULL if none referenced in task)
+ * @param resources the table of resources (the list could be NULL if none referenced in task)
  * @return 0 on success
  */
-int rlist_get_from_task(cfg_t *cfg, cfg_t *task, struct resource_list **resources)
+int rlist_get_from_task(cfg_t *cfg, cfg_t *task, struct resource_table *resources)
 {
-    struct resource_list *list = NULL;
-    for (unsigned ix = 0;; ix++) {
-        cfg_t *onresource = cfg_getnsec(task, "on-resource", ix);
-        if (!onresource)
-            break;
+    // Index all of the resources first so that finding each one is quick.
+    struct resource_table all;
+    OK_OR_RETURN(rlist_get_all(cfg, &all));
+
+    unsigned int count = cfg_size(task, "on-resource");
 
-        struct resource_list *new_node = (struct resource_list *) malloc(sizeof(struct resource_list));
-        new_node->next = list;
+    rlist_init(resources);
+    alloc_buckets(resources, count);
+    for (unsigned ix = 0; ix < count; ix++) {
+        cfg_t *onresource = cfg_getnsec(task, "on-resource", ix);
 
         const char *resource_name = cfg_title(onresource);
-        cfg_t *resource = cfg_gettsec(cfg, "file-resource", resource_name);
-        if (resource == NULL) {
-            free(new_node);
-            rlist_free(list);
+        struct resource_list *item = rlist_find_by_name(&all, resource_name);
+        if (item == NULL) {
+            rlist_free(&all);
+            rlist_free(resources);
             ERR_RETURN("Resource '%s' used, but metadata is missing. Archive is corrupt.", resource_name);
         }
 
-        new_node->resource = resource;
-        new_node->processed = false;
-        list = new_node;
+        add_resource(resources, item->resource);
     }
-    *resources = list;
+    rlist_free(&all);
     return 0;
 }
 
 /**
- * @brief Free the specified resource list
+ * @brief Free the specified resource table
  *
- * @param list a resource list
+ * @param resources a resource table
  */
-void rlist_free(struct resource_list *list)
+void rlist_free(struct resource_table *resources)
 {
+    struct resource_list *list = resources->list;
     while (list) {
         struct resource_list *next = list->next;
         free(list);
         list = next;
     }
+    free(resources->buckets);
+    rlist_init(resources);
 }
 
 /**
- * @brief Find a resource by name in the list
+ * @brief Find a resource by name
  *
- * @param list a resource list
+ * @param resources a resource table
  * @param name the name of the resource
  *
  * @return the resource information or NULL if not found
  */
-struct resource_list *rlist_find_by_name(struct resource_list *list, const char *name)
+struct resource_list *rlist_find_by_name(const struct resource_table *resources, const char *name)
 {
-    while (list) {
-        if (strcmp(name, cfg_title(list->resource)) == 0)
-            return list;
-        list = list->next;
+    if (resources->bucket_count == 0)
+        return NULL;
+
+    struct resource_list *item = resources->buckets[hash_name(name) & (resources->bucket_count - 1)];
+    while (item) {
+        if (strcmp(name, cfg_title(item->resource)) == 0)
+            return item;
+        item = item->bucket_next;
     }
     return NULL;
 }
@@ -22,13 +22,22 @@
 
 struct resource_list {
     struct resource_list *next;
+    struct resource_list *bucket_next;
     cfg_t *resource;
     bool processed;
 };
 
-int rlist_get_all(cfg_t *cfg, struct resource_list **resources);
-int rlist_get_from_task(cfg_t *cfg, cfg_t *task, struct resource_list **resources);
-void rlist_free(struct resource_list *list);
-struct resource_list *rlist_find_by_name(struct resource_list *list, const char *name);
+// Resources indexed by name so that lookups don't need to walk the list
+struct resource_table {
+    struct resource_list *list; // NULL if no resources
+    struct resource_list **buckets;
+    size_t bucket_count;
+};
+
+void rlist_init(struct resource_table *resources);
+int rlist_get_all(cfg_t *cfg, struct resource_table *resources);
+int rlist_get_from_task(cfg_t *cfg, cfg_t *task, struct resource_table *resources);
+void rlist_free(struct resource_table *resources);
+struct resource_list *rlist_find_by_name(const struct resource_table *resources, const char *name);
 
 #endif // RESOURCES_H
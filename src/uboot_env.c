@@ -372,6 +372,9 @@ int uboot_env_write(struct block_cache *bc, struct uboot_env *env)
 
     OK_OR_CLEANUP(uboot_env_encode(env, buffer));
 
+    if (bc->stats)
+        bc->stats->uboot_env_writes++;
+
     if (env->use_redundant)
         buffer[4] = env->flags + 1;
 
@@ -28,6 +28,11 @@ extern bool fwup_verbose;
 extern bool fwup_framing;
 extern bool fwup_unsafe;
 extern bool fwup_handshake_on_exit;
+extern off_t fwup_max_meta_conf_size;
+
+// meta.conf is read into memory before its signature can be checked, so
+// limit how big it can be.
+#define FWUP_DEFAULT_MAX_META_CONF_SIZE (16 * 1024 * 1024)
 
 struct tm;
 
@@ -0,0 +1,370 @@
+/*
+ * Copyright 2026 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "zip_splice.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef FWUP_MINIMAL
+
+/**
+ * libarchive can only write ZIP entries by compressing them. Splicing works
+ * around this by copying the compressed bytes of entries from one ZIP file
+ * into another. Only the local headers and central directory records need
+ * to change and neither of those depends on the compressed data.
+ *
+ * Entries are copied from their local header to the start of the next
+ * entry so that data descriptors come along too. This is how libarchive
+ * lays out ZIP files. ZIP64 isn't supported, so everything has to fit in
+ * 4 GB.
+ */
+
+#define ZIP_LOCAL_SIG        0x04034b50
+#define ZIP_CENTRAL_SIG      0x02014b50
+#define ZIP_EOCD_SIG         0x06054b50
+#define ZIP64_LOCATOR_SIG    0x07064b50
+
+#define ZIP_LOCAL_LEN        30
+#define ZIP_CENTRAL_LEN      46
+#define ZIP_EOCD_LEN         22
+#define ZIP64_LOCATOR_LEN    20
+#define ZIP_MAX_COMMENT_LEN  65535
+
+#define ZIP_COPY_SIZE        (128 * 1024)
+
+static uint16_t get_le16(const uint8_t *p)
+{
+    return (uint16_t) (p[0] | (p[1] << 8));
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static int pread_all(int fd, void *buf, size_t count, off_t offset)
+{
+    uint8_t *p = (uint8_t *) buf;
+    while (count > 0) {
+        ssize_t amount_read = pread(fd, p, count, offset);
+        if (amount_read <= 0)
+            return -1;
+
+        p += amount_read;
+        count -= amount_read;
+        offset += amount_read;
+    }
+    return 0;
+}
+
+static int entry_offset_compare(const void *pa, const void *pb)
+{
+    const struct zip_index_entry *a = (const struct zip_index_entry *) pa;
+    const struct zip_index_entry *b = (const struct zip_index_entry *) pb;
+
+    return a->offset < b->offset ? -1 : (a->offset > b->offset ? 1 : 0);
+}
+
+static int parse_central_directory(struct zip_index *zi, const char *filename, const uint8_t *cd, size_t cd_size, int entry_count)
+{
+    zi->entries = calloc(entry_count > 0 ? entry_count : 1, sizeof(struct zip_index_entry));
+    if (!zi->entries)
+        fwup_err(EXIT_FAILURE, "calloc");
+
+    size_t pos = 0;
+    for (int i = 0; i < entry_count; i++) {
+        const uint8_t *c = &cd[pos];
+        if (pos + ZIP_CENTRAL_LEN > cd_size || get_le32(c) != ZIP_CENTRAL_SIG)
+            ERR_RETURN("corrupt central directory in '%s'", filename);
+
+        size_t name_len = get_le16(&c[28]);
+        size_t len = ZIP_CENTRAL_LEN + name_len + get_le16(&c[30]) + get_le16(&c[32]);
+        if (pos + len > cd_size)
+            ERR_RETURN("corrupt central directory in '%s'", filename);
+
+        uint32_t uncompressed_size = get_le32(&c[24]);
+        uint32_t offset = get_le32(&c[42]);
+        if (uncompressed_size == 0xffffffff || offset == 0xffffffff)
+            ERR_RETURN("ZIP64 entries aren't supported in '%s'", filename);
+        if (offset >= zi->cd_offset)
+            ERR_RETURN("corrupt central directory in '%s'", filename);
+
+        struct zip_index_entry *entry = &zi->entries[zi->count++];
+        entry->name = malloc(name_len + 1);
+        entry->central = malloc(len);
+        if (!entry->name || !entry->central)
+            fwup_err(EXIT_FAILURE, "malloc");
+        memcpy(entry->name, &c[ZIP_CENTRAL_LEN], name_len);
+        entry->name[name_len] = '\0';
+        memcpy(entry->central, c, len);
+        entry->central_len = len;
+        entry->method = get_le16(&c[10]);
+        entry->uncompressed_size = uncompressed_size;
+        entry->offset = offset;
+
+        pos += len;
+    }
+
+    // Each entry runs up to the next one or the central directory.
+    qsort(zi->entries, zi->count, sizeof(struct zip_index_entry), entry_offset_compare);
+    for (int i = 0; i < zi->count; i++)
+        zi->entries[i].end = (i + 1 < zi->count) ? zi->entries[i + 1].offset : zi->cd_offset;
+
+    return 0;
+}
+
+void zip_index_init(struct zip_index *zi)
+{
+    memset(zi, 0, sizeof(struct zip_index));
+    zi->fd = -1;
+}
+
+/**
+ * @brief Read the central directory of a ZIP file
+ *
+ * @param zi an initialized index. Call zip_index_close even on error.
+ * @param filename the ZIP file
+ * @return 0 if successful
+ */
+int zip_index_open(struct zip_index *zi, const char *filename)
+{
+    int rc = 0;
+    uint8_t *tail = NULL;
+    uint8_t *cd = NULL;
+
+    zi->fd = open(filename, O_RDONLY | O_WIN32_BINARY);
+    if (zi->fd < 0)
+        ERR_RETURN("can't open '%s': %s", filename, strerror(errno));
+
+    struct stat st;
+    if (fstat(zi->fd, &st) < 0)
+        ERR_CLEANUP_MSG("can't stat '%s': %s", filename, strerror(errno));
+
+    // The end of central directory record is followed by a variable length
+    // comment, so search backwards for it.
+    off_t tail_len = ZIP_EOCD_LEN + ZIP_MAX_COMMENT_LEN;
+    if (tail_len > st.st_size)
+        tail_len = st.st_size;
+    tail = malloc(tail_len > 0 ? tail_len : 1);
+    if (!tail)
+        fwup_err(EXIT_FAILURE, "malloc");
+    if (pread_all(zi->fd, tail, tail_len, st.st_size - tail_len) < 0)
+        ERR_CLEANUP_MSG("error reading '%s'", filename);
+
+    off_t eocd = tail_len - ZIP_EOCD_LEN;
+    while (eocd >= 0 && get_le32(&tail[eocd]) != ZIP_EOCD_SIG)
+        eocd--;
+    if (eocd < 0)
+        ERR_CLEANUP_MSG("'%s' isn't a ZIP file", filename);
+
+    const uint8_t *p = &tail[eocd];
+    uint16_t entry_count = get_le16(&p[10]);
+    uint32_t cd_size = get_le32(&p[12]);
+    uint32_t cd_offset = get_le32(&p[16]);
+    if (entry_count == 0xffff || cd_size == 0xffffffff || cd_offset == 0xffffffff ||
+            (eocd >= ZIP64_LOCATOR_LEN && get_le32(&tail[eocd - ZIP64_LOCATOR_LEN]) == ZIP64_LOCATOR_SIG))
+        ERR_CLEANUP_MSG("ZIP64 isn't supported in '%s'", filename);
+    if ((off_t) cd_offset + cd_size > st.st_size)
+        ERR_CLEANUP_MSG("corrupt central directory in '%s'", filename);
+
+    cd = malloc(cd_size > 0 ? cd_size : 1);
+    if (!cd)
+        fwup_err(EXIT_FAILURE, "malloc");
+    if (pread_all(zi->fd, cd, cd_size, cd_offset) < 0)
+        ERR_CLEANUP_MSG("error reading '%s'", filename);
+
+    zi->cd_offset = cd_offset;
+    OK_OR_CLEANUP(parse_central_directory(zi, filename, cd, cd_size, entry_count));
+
+cleanup:
+    free(cd);
+    free(tail);
+    return rc;
+}
+
+const struct zip_index_entry *zip_index_find(const struct zip_index *zi, const char *name)
+{
+    for (int i = 0; i < zi->count; i++) {
+        if (strcmp(zi->entries[i].name, name) == 0)
+            return &zi->entries[i];
+    }
+    return NULL;
+}
+
+void zip_index_close(struct zip_index *zi)
+{
+    for (int i = 0; i < zi->count; i++) {
+        free(zi->entries[i].name);
+        free(zi->entries[i].central);
+    }
+    free(zi->entries);
+    if (zi->fd >= 0)
+        close(zi->fd);
+    zip_index_init(zi);
+}
+
+static int write_all(FILE *fp, const void *buf, size_t count, off_t *out_offset)
+{
+    if (fwrite(buf, 1, count, fp) != count)
+        ERR_RETURN("error writing ZIP file: %s", strerror(errno));
+    *out_offset += count;
+    return 0;
+}
+
+/**
+ * Copy an entry from its local header through its data descriptor and give
+ * it a new name. Everything after the name is copied as is.
+ */
+static int copy_entry(int fd, const struct zip_index_entry *entry, const char *name, FILE *fp, uint8_t *buffer, off_t *out_offset)
+{
+    uint8_t header[ZIP_LOCAL_LEN];
+    if (pread_all(fd, header, sizeof(header), entry->offset) < 0 ||
+            get_le32(header) != ZIP_LOCAL_SIG)
+        ERR_RETURN("error reading local header for '%s'", entry->name);
+
+    off_t offset = entry->offset + ZIP_LOCAL_LEN + get_le16(&header[26]);
+    if (offset > entry->end)
+        ERR_RETURN("corrupt local header for '%s'", entry->name);
+
+    size_t name_len = strlen(name);
+    copy_le16(&header[26], (uint16_t) name_len);
+    OK_OR_RETURN(write_all(fp, header, sizeof(header), out_offset));
+    OK_OR_RETURN(write_all(fp, name, name_len, out_offset));
+
+    while (offset < entry->end) {
+        size_t to_copy = ZIP_COPY_SIZE;
+        if ((off_t) to_copy > entry->end - offset)
+            to_copy = entry->end - offset;
+
+        if (pread_all(fd, buffer, to_copy, offset) < 0)
+            ERR_RETURN("error reading '%s'", entry->name);
+        OK_OR_RETURN(write_all(fp, buffer, to_copy, out_offset));
+        offset += to_copy;
+    }
+    return 0;
+}
+
+static int write_central(const struct zip_index_entry *entry, const char *name, off_t local_offset, FILE *fp, off_t *out_offset)
+{
+    uint8_t header[ZIP_CENTRAL_LEN];
+    memcpy(header, entry->central, sizeof(header));
+
+    size_t old_name_len = get_le16(&header[28]);
+    size_t name_len = strlen(name);
+    copy_le16(&header[28], (uint16_t) name_len);
+    copy_le32(&header[42], (uint32_t) local_offset);
+
+    OK_OR_RETURN(write_all(fp, header, sizeof(header), out_offset));
+    OK_OR_RETURN(write_all(fp, name, name_len, out_offset));
+
+    // Extra fields and the comment
+    size_t rest = ZIP_CENTRAL_LEN + old_name_len;
+    return write_all(fp, entry->central + rest, entry->central_len - rest, out_offset);
+}
+
+static const struct zip_index_entry *find_replacement(const char *name,
+                                                      const char * const *names,
+                                                      const struct zip_index_entry * const *replacements,
+                                                      int replacement_count)
+{
+    for (int i = 0; i < replacement_count; i++) {
+        if (strcmp(names[i], name) == 0)
+            return replacements[i];
+    }
+    return NULL;
+}
+
+/**
+ * @brief Write a copy of a ZIP file with some entries replaced by ones from another
+ *
+ * The replacements keep the names and positions of the entries that they
+ * replace. Nothing is decompressed or recompressed.
+ *
+ * @param zi the ZIP file to copy
+ * @param from where the replacements come from
+ * @param names the names of the entries in zi to replace
+ * @param replacements the entries in from to use instead
+ * @param replacement_count how many entries to replace
+ * @param output_filename where to write the new ZIP file
+ * @return 0 if successful
+ */
+int zip_splice(const struct zip_index *zi,
+               const struct zip_index *from,
+               const char * const *names,
+               const struct zip_index_entry * const *replacements,
+               int replacement_count,
+               const char *output_filename)
+{
+    int rc = 0;
+    off_t out_offset = 0;
+    off_t *local_offsets = calloc(zi->count > 0 ? zi->count : 1, sizeof(off_t));
+    uint8_t *buffer = malloc(ZIP_COPY_SIZE);
+    if (!local_offsets || !buffer)
+        fwup_err(EXIT_FAILURE, "malloc");
+
+    FILE *fp = fopen(output_filename, "wb");
+    if (!fp)
+        ERR_CLEANUP_MSG("can't create '%s': %s", output_filename, strerror(errno));
+
+    for (int i = 0; i < zi->count; i++) {
+        const struct zip_index_entry *entry = &zi->entries[i];
+        const struct zip_index_entry *replacement = find_replacement(entry->name, names, replacements, replacement_count);
+
+        local_offsets[i] = out_offset;
+        if (replacement)
+            OK_OR_CLEANUP(copy_entry(from->fd, replacement, entry->name, fp, buffer, &out_offset));
+        else
+            OK_OR_CLEANUP(copy_entry(zi->fd, entry, entry->name, fp, buffer, &out_offset));
+    }
+
+    off_t cd_offset = out_offset;
+    for (int i = 0; i < zi->count; i++) {
+        const struct zip_index_entry *entry = &zi->entries[i];
+        const struct zip_index_entry *replacement = find_replacement(entry->name, names, replacements, replacement_count);
+
+        OK_OR_CLEANUP(write_central(replacement ? replacement : entry, entry->name, local_offsets[i], fp, &out_offset));
+    }
+    off_t cd_size = out_offset - cd_offset;
+    if (out_offset > 0xffffffff)
+        ERR_CLEANUP_MSG("'%s' would need ZIP64, which isn't supported", output_filename);
+
+    uint8_t eocd[ZIP_EOCD_LEN];
+    memset(eocd, 0, sizeof(eocd));
+    copy_le32(&eocd[0], ZIP_EOCD_SIG);
+    copy_le16(&eocd[8], (uint16_t) zi->count);
+    copy_le16(&eocd[10], (uint16_t) zi->count);
+    copy_le32(&eocd[12], (uint32_t) cd_size);
+    copy_le32(&eocd[16], (uint32_t) cd_offset);
+    OK_OR_CLEANUP(write_all(fp, eocd, sizeof(eocd), &out_offset));
+
+cleanup:
+    if (fp && fclose(fp) != 0 && rc == 0) {
+        set_last_error("error writing '%s': %s", output_filename, strerror(errno));
+        rc = -1;
+    }
+    free(buffer);
+    free(local_offsets);
+    return rc;
+}
+
+#endif // FWUP_MINIMAL
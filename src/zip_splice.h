@@ -0,0 +1,62 @@
+/*
+ * Copyright 2026 Frank Hunleth
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ZIP_SPLICE_H
+#define ZIP_SPLICE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define ZIP_METHOD_STORE   0
+#define ZIP_METHOD_DEFLATE 8
+
+struct zip_index_entry {
+    char *name;
+    uint16_t method;
+    uint32_t uncompressed_size;
+
+    // The entry's bytes in the file from the local header through the data
+    // descriptor
+    off_t offset;
+    off_t end;
+
+    // The entry's central directory record
+    uint8_t *central;
+    size_t central_len;
+};
+
+// The central directory of a ZIP file
+struct zip_index {
+    int fd;
+    off_t cd_offset;
+
+    struct zip_index_entry *entries;
+    int count;
+};
+
+void zip_index_init(struct zip_index *zi);
+int zip_index_open(struct zip_index *zi, const char *filename);
+const struct zip_index_entry *zip_index_find(const struct zip_index *zi, const char *name);
+void zip_index_close(struct zip_index *zi);
+
+int zip_splice(const struct zip_index *zi,
+               const struct zip_index *from,
+               const char * const *names,
+               const struct zip_index_entry * const *replacements,
+               int replacement_count,
+               const char *output_filename);
+
+#endif // ZIP_SPLICE_H